@@ -33,146 +33,465 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fts.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <CommonCrypto/CommonDigest.h>
+#include "../darwinxref/batchpool.h"
+#include "../darwinxref/filedigest.h"
+#include "../darwinxref/manifestindex.h"
 
+static int compare(const FTSENT **a, const FTSENT **b) {
+	return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+static int read_index(int fd, const char* filename, struct mf_tree* t) {
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		perror(filename);
+		return -1;
+	}
+	void* map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(filename);
+		return -1;
+	}
+	struct mf_header* h = map;
+	if (h->byteorder != MANIFEST_V2_BYTEORDER ||
+		(uint64_t)sb.st_size != sizeof(*h) + (uint64_t)h->count * sizeof(struct mf_entry) + h->strsize ||
+		h->count == 0 || h->strsize == 0) {
+		fprintf(stderr, "%s: malformed manifest index\n", filename);
+		munmap(map, (size_t)sb.st_size);
+		return -1;
+	}
+	t->entries = (struct mf_entry*)(h + 1);
+	t->count = h->count;
+	t->strings = (const char*)(t->entries + t->count);
+	t->strsize = h->strsize;
+	t->map = map;
+	t->maplen = (size_t)sb.st_size;
 
-static char* format_digest(const unsigned char* m) {
-        char* result = NULL;
-		// SHA-1
-		asprintf(&result,
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x",
-                m[0], m[1], m[2], m[3],
-                m[4], m[5], m[6], m[7],
-                m[8], m[9], m[10], m[11],
-                m[12], m[13], m[14], m[15],
-		m[16], m[17], m[18], m[19]
-		);
-        return result;
+	// Make sure the structure can be walked without further checks
+	uint32_t i;
+	if (t->strings[t->strsize - 1] != 0) t->count = 0;
+	for (i = 0; i < t->count; ++i) {
+		struct mf_entry* e = &t->entries[i];
+		if (e->name >= t->strsize || e->link >= t->strsize ||
+			(e->nchildren && (e->first <= i || e->first > t->count || e->nchildren > t->count - e->first))) {
+			fprintf(stderr, "%s: malformed manifest index\n", filename);
+			munmap(map, t->maplen);
+			return -1;
+		}
+	}
+	return 0;
 }
 
-static char* calculate_digest(int fd) {
-	unsigned char md[CC_SHA1_DIGEST_LENGTH];
-	CC_SHA1_CTX c;
-	CC_SHA1_Init(&c);
-	
-	memset(md, 0, CC_SHA1_DIGEST_LENGTH);
-	
-	ssize_t len;
-	const unsigned int blocklen = 8192;
-	static unsigned char* block = NULL;
-	if (block == NULL) {
-		block = malloc(blocklen);
-	}
-	while(1) {
-		len = read(fd, block, blocklen);
-		if (len == 0) { close(fd); break; }
-		if ((len < 0) && (errno == EINTR)) continue;
-		if (len < 0) { close(fd); return NULL; }
-		CC_SHA1_Update(&c, block, (CC_LONG)len);
-	}
-	
-	CC_SHA1_Final(md, &c);
-	return format_digest(md);
+// Reads a text manifest, as printed by this tool or by darwinxref register.
+static int read_manifest(FILE* f, const char* filename, struct mf_builder* b) {
+	size_t size;
+	char* buf;
+	int lineno = 0;
+	while ((buf = fgetln(f, &size)) != NULL) {
+		++lineno;
+		if (mf_builder_add_line(b, buf, size) != 0) {
+			fprintf(stderr, "%s:%d: malformed line\n", filename, lineno);
+			return -1;
+		}
+	}
+	return 0;
 }
 
-static int compare(const FTSENT **a, const FTSENT **b) {
-	return strcmp((*a)->fts_name, (*b)->fts_name);
+//
+// Walking a root
+//
+// Entries are collected from fts in batches.  The regular files of a
+// batch are checksummed by a pool of threads, and the batch is then
+// printed in walk order, so the output is the same as a serial walk.
+//
+#define WALK_BATCH_SIZE 1024
+
+struct walk_entry {
+	char* path;		// full path; filename points into it
+	char* filename;		// "/a/b", relative to the root
+	char* symlink;
+	char* checksum;
+	int info;		// fts_info
+	int error;		// errno from checksumming
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	off_t size;
+};
+
+static int walk_jobs = 0;	// -j, 0 for one per CPU
+static int walk_stat_only = 0;	// -stat-only
+
+static void checksum_entry(void* arg) {
+	struct walk_entry* e = arg;
+	if (e->info != FTS_F) return;
+	int fd = open(e->path, O_RDONLY);
+	if (fd == -1) {
+		e->error = errno;
+		return;
+	}
+	e->checksum = calculate_digest(fd);
+	if (e->checksum == NULL) e->error = errno;
+	close(fd);
 }
 
-#if 0
-static void ent_filename(FTSENT* ent, char* filename) {
-	if (ent->fts_level > 1) {
-		ent_filename(ent->fts_parent, filename);
-		strcat(filename, "/");
-	} else if (ent->fts_level == 1) {
-		strcat(filename, "./");
+// Prints and collects a checksummed batch, in walk order.
+static int flush_entries(struct walk_entry* entries, size_t count, FILE* out, struct mf_builder* b) {
+	int res = 0;
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		struct walk_entry* e = &entries[i];
+		if (e->error && res == 0) {
+			errno = e->error;
+			perror(e->filename);
+			res = -1;
+		}
+		if (res == 0) {
+			const char* checksum = e->checksum ? e->checksum : "                                        ";
+			const char* symlink = e->symlink ? e->symlink : "";
+			off_t size = (e->info != FTS_D) ? e->size : (off_t)0;
+			if (out) {
+				fprintf(out, "%s %o %d %d %lld .%s%s%s\n",
+					checksum,
+					e->mode,
+					e->uid,
+					e->gid,
+					(long long)size,
+					e->filename,
+					symlink[0] ? " -> " : "",
+					symlink);
+			}
+			if (b) {
+				struct mf_node* node = mf_builder_add(b, e->filename, symlink);
+				node->mode = e->mode;
+				node->uid = e->uid;
+				node->gid = e->gid;
+				node->size = (uint64_t)size;
+				mf_parse_digest(checksum, node->digest);
+			}
+		}
+		free(e->path);
+		free(e->symlink);
+		free(e->checksum);
 	}
-	strcat(filename, ent->fts_name);
+	return res;
 }
-#endif
 
-static size_t ent_filename(FTSENT* ent, char* filename, size_t bufsiz) {
-	if (ent == NULL) return 0;
-	if (ent->fts_level > 1) {
-		bufsiz = ent_filename(ent->fts_parent, filename, bufsiz);
+//
+// Prints the text manifest of the root at path to out, if out is not NULL,
+// and collects its entries into b, if b is not NULL.
+//
+static int walk_root(char* path, FILE* out, struct mf_builder* b) {
+	char* path_argv[] = { path, NULL };
+	FTS* fts = fts_open(path_argv, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_NOCHDIR, compare);
+	FTSENT* ent = fts ? fts_read(fts) : NULL; // throw away the entry for the DSTROOT itself
+	if (ent == NULL || ent->fts_info == FTS_NS || ent->fts_info == FTS_ERR) {
+		perror(path);
+		if (fts) fts_close(fts);
+		return -1;
 	}
-	strncat(filename, "/", bufsiz);
-	bufsiz -= 1;
-	if (ent->fts_namelen != 0) {
-		strncat(filename, ent->fts_name, bufsiz);
-		bufsiz -= strlen(ent->fts_name);
+	if (b) {
+		struct mf_node* root = mf_builder_add(b, "", NULL);
+		root->mode = ent->fts_statp->st_mode;
+		root->uid = ent->fts_statp->st_uid;
+		root->gid = ent->fts_statp->st_gid;
 	}
-	return bufsiz;
-}
 
+	// The path of the current entry is kept in buf, with the length of
+	// the path of each enclosing directory in lens[level], so each entry
+	// only appends its own name to that of its parent.
+	char buf[MAXPATHLEN+1];
+	size_t rootlen = strlen(path);
+	while (rootlen > 0 && path[rootlen - 1] == '/') --rootlen;
+	if (rootlen > MAXPATHLEN) rootlen = MAXPATHLEN;
+	memcpy(buf, path, rootlen);
+	size_t maxlevel = 64;
+	size_t* lens = malloc(maxlevel * sizeof(size_t));
+	lens[0] = rootlen;
 
-int main(int argc, char* argv[]) {
-	if (argc != 2) {
-		char* progname = basename(argv[0]);
-		fprintf(stderr, "usage: %s <dir>\n", progname);
-		return 1;
-	}
-	char* path[] = { argv[1], NULL };
-	FTS* fts = fts_open(path, FTS_PHYSICAL | FTS_COMFOLLOW, compare);
-	FTSENT* ent = fts_read(fts); // throw away the entry for the DSTROOT itself
-	while ((ent = fts_read(fts)) != NULL) {
-		char filename[MAXPATHLEN+1];
-		char symlink[MAXPATHLEN+1];
-		ssize_t len;
+	// -stat-only checksums nothing, so needs no threads
+	struct batch_pool pool;
+	batch_pool_init(&pool, walk_stat_only ? 1 : walk_jobs, sizeof(struct walk_entry), checksum_entry);
+	struct walk_entry* entries = calloc(WALK_BATCH_SIZE, sizeof(struct walk_entry));
+	size_t count = 0;
+	int res = 0;
+
+	while (res == 0 && (ent = fts_read(fts)) != NULL) {
+		// add all regular files, directories, and symlinks to the manifest
+		if (ent->fts_info != FTS_F && ent->fts_info != FTS_D &&
+			ent->fts_info != FTS_SL && ent->fts_info != FTS_SLNONE) {
+			continue;
+		}
 
 		// Filename
-		filename[0] = 0;
-		ent_filename(ent, filename, MAXPATHLEN);
+		size_t level = (size_t)ent->fts_level;
+		if (level >= maxlevel) {
+			maxlevel *= 2;
+			lens = realloc(lens, maxlevel * sizeof(size_t));
+		}
+		size_t len = lens[level - 1];
+		if (len + 1 + ent->fts_namelen > MAXPATHLEN) {
+			fprintf(stderr, "%s: %s\n", ent->fts_path, strerror(ENAMETOOLONG));
+			res = -1;
+			break;
+		}
+		buf[len] = '/';
+		memcpy(buf + len + 1, ent->fts_name, ent->fts_namelen);
+		len += 1 + ent->fts_namelen;
+		buf[len] = 0;
+		lens[level] = len;
+
+		struct walk_entry* e = &entries[count++];
+		memset(e, 0, sizeof(*e));
+		e->path = strdup(buf);
+		e->filename = e->path + rootlen;
+		e->info = ent->fts_info;
+		e->mode = ent->fts_statp->st_mode;
+		e->uid = ent->fts_statp->st_uid;
+		e->gid = ent->fts_statp->st_gid;
+		e->size = ent->fts_statp->st_size;
 
 		// Symlinks
-		symlink[0] = 0;
 		if (ent->fts_info == FTS_SL || ent->fts_info == FTS_SLNONE) {
-			len = readlink(ent->fts_accpath, symlink, MAXPATHLEN);
-			if (len >= 0) symlink[len] = 0;
+			char symlink[MAXPATHLEN+1];
+			ssize_t n = readlink(ent->fts_accpath, symlink, MAXPATHLEN);
+			if (n >= 0) {
+				symlink[n] = 0;
+				e->symlink = strdup(symlink);
+			}
+		}
+
+		if (count == WALK_BATCH_SIZE) {
+			if (!walk_stat_only) batch_pool_run(&pool, entries, count);
+			res = flush_entries(entries, count, out, b);
+			count = 0;
 		}
+	}
+	if (!walk_stat_only) batch_pool_run(&pool, entries, count);
+	if (res != 0) {
+		out = NULL;
+		b = NULL;
+	}
+	if (flush_entries(entries, count, out, b) != 0) res = -1;
 
-		// Default to empty SHA-1 checksum
-		char* checksum = strdup("                                        ");
+	batch_pool_destroy(&pool);
+	free(entries);
+	free(lens);
+	fts_close(fts);
 
-		// Checksum regular files
-		if (ent->fts_info == FTS_F) {
-			int fd = open(ent->fts_accpath, O_RDONLY);
-			if (fd == -1) {
-				perror(filename);
-				return -1;
-			}
-			checksum = calculate_digest(fd);
+	return res;
+}
+
+//
+// Loads a directory, an index, or a text manifest ("-" for stdin).
+//
+static int load_tree(char* filename, struct mf_tree* t) {
+	struct mf_builder b;
+	mf_builder_init(&b);
+	int res = 0;
+
+	struct stat sb;
+	if (strcmp(filename, "-") == 0) {
+		mf_builder_add(&b, "", NULL)->mode = S_IFDIR;
+		res = read_manifest(stdin, filename, &b);
+	} else if (stat(filename, &sb) == -1) {
+		perror(filename);
+		return -1;
+	} else if (S_ISDIR(sb.st_mode)) {
+		res = walk_root(filename, NULL, &b);
+	} else {
+		int fd = open(filename, O_RDONLY);
+		if (fd == -1) {
+			perror(filename);
+			return -1;
+		}
+		char magic[sizeof(MANIFEST_V2_MAGIC) - 1];
+		if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+			memcmp(magic, MANIFEST_V2_MAGIC, sizeof(magic)) == 0) {
+			res = read_index(fd, filename, t);
 			close(fd);
+			return res;
+		}
+		close(fd);
+		FILE* f = fopen(filename, "r");
+		if (f == NULL) {
+			perror(filename);
+			return -1;
 		}
+		mf_builder_add(&b, "", NULL)->mode = S_IFDIR;
+		res = read_manifest(f, filename, &b);
+		fclose(f);
+	}
+	if (res == 0) res = mf_builder_finish(&b, t);
+	mf_builder_free(&b);
+	return res;
+}
 
-		// add all regular files, directories, and symlinks to the manifest
-		if (ent->fts_info == FTS_F || ent->fts_info == FTS_D ||
-			ent->fts_info == FTS_SL || ent->fts_info == FTS_SLNONE) {
-			fprintf(stdout, "%s %o %d %d %lld .%s%s%s\n",
-				checksum,
-				ent->fts_statp->st_mode,
-				ent->fts_statp->st_uid,
-				ent->fts_statp->st_gid,
-				(ent->fts_info != FTS_D) ? ent->fts_statp->st_size : (off_t)0,
-				filename,
-				symlink[0] ? " -> " : "",
-				symlink[0] ? symlink : "");
+static int entries_equal(struct mf_tree* a, struct mf_entry* ea, struct mf_tree* b, struct mf_entry* eb) {
+	return ea->mode == eb->mode && ea->uid == eb->uid && ea->gid == eb->gid &&
+		ea->size == eb->size &&
+		memcmp(ea->digest, eb->digest, CC_SHA1_DIGEST_LENGTH) == 0 &&
+		strcmp(a->strings + ea->link, b->strings + eb->link) == 0;
+}
+
+static size_t append_name(char* path, size_t len, const char* name) {
+	size_t n = strlen(name);
+	if (len + n + 1 >= MAXPATHLEN) n = MAXPATHLEN - len - 2;
+	path[len] = '/';
+	memcpy(path + len + 1, name, n);
+	path[len + n + 1] = 0;
+	return len + n + 1;
+}
+
+// Reports an entry and everything below it.
+static uint32_t report_subtree(char tag, struct mf_tree* t, uint32_t i, char* path, size_t len) {
+	struct mf_entry* e = &t->entries[i];
+	uint32_t count = 1;
+	uint32_t j;
+	fprintf(stdout, "%c .%s\n", tag, path);
+	for (j = e->first; j < e->first + e->nchildren; ++j) {
+		size_t n = append_name(path, len, t->strings + t->entries[j].name);
+		count += report_subtree(tag, t, j, path, n);
+	}
+	path[len] = 0;
+	return count;
+}
+
+//
+// Compares the children of two directories whose digests differ.  Both
+// child lists are sorted by name, so they are merged in a single pass,
+// and only subdirectories whose digests differ are descended into.
+//
+static uint32_t diff_children(struct mf_tree* a, uint32_t ai, struct mf_tree* b, uint32_t bi, char* path, size_t len) {
+	struct mf_entry* da = &a->entries[ai];
+	struct mf_entry* db = &b->entries[bi];
+	uint32_t i = da->first, iend = da->first + da->nchildren;
+	uint32_t j = db->first, jend = db->first + db->nchildren;
+	uint32_t count = 0;
+
+	while (i < iend || j < jend) {
+		struct mf_entry* ea = (i < iend) ? &a->entries[i] : NULL;
+		struct mf_entry* eb = (j < jend) ? &b->entries[j] : NULL;
+		int cmp = (ea == NULL) ? 1 : (eb == NULL) ? -1 :
+			strcmp(a->strings + ea->name, b->strings + eb->name);
+		size_t n = append_name(path, len, (cmp <= 0) ? a->strings + ea->name : b->strings + eb->name);
+
+		if (cmp < 0) {
+			count += report_subtree('D', a, i++, path, n);
+		} else if (cmp > 0) {
+			count += report_subtree('A', b, j++, path, n);
+		} else if (S_ISDIR(ea->mode) != S_ISDIR(eb->mode)) {
+			count += report_subtree('D', a, i++, path, n);
+			count += report_subtree('A', b, j++, path, n);
+		} else if (S_ISDIR(ea->mode)) {
+			if (ea->mode != eb->mode || ea->uid != eb->uid || ea->gid != eb->gid) {
+				fprintf(stdout, "M .%s\n", path);
+				++count;
+			}
+			if (memcmp(ea->digest, eb->digest, CC_SHA1_DIGEST_LENGTH) != 0) {
+				count += diff_children(a, i, b, j, path, n);
+			}
+			++i;
+			++j;
+		} else {
+			if (!entries_equal(a, ea, b, eb)) {
+				fprintf(stdout, "M .%s\n", path);
+				++count;
+			}
+			++i;
+			++j;
 		}
-		free(checksum);
+		path[len] = 0;
 	}
-	fts_close(fts);
+	return count;
+}
 
-	return 0;
+static int diff_trees(char* old, char* new) {
+	struct mf_tree a, b;
+	if (load_tree(old, &a) != 0) return 2;
+	if (load_tree(new, &b) != 0) return 2;
+
+	char path[MAXPATHLEN];
+	path[0] = 0;
+	uint32_t count = 0;
+	if (memcmp(a.entries[0].digest, b.entries[0].digest, CC_SHA1_DIGEST_LENGTH) != 0) {
+		count = diff_children(&a, 0, &b, 0, path, 0);
+	}
+	mf_tree_free(&a);
+	mf_tree_free(&b);
+	return count ? 1 : 0;
+}
+
+static void usage(char* progname) {
+	fprintf(stderr, "usage: %s [-j <jobs>] [-stat-only] [-o <index>] <dir>\n", progname);
+	fprintf(stderr, "       %s -index <manifest> <index>\n", progname);
+	fprintf(stderr, "       %s [-j <jobs>] [-stat-only] -diff <old> <new>\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -j          checksum files with <jobs> threads (default: one per CPU)\n");
+	fprintf(stderr, "  -stat-only  do not checksum files, leave their checksums blank\n");
+	fprintf(stderr, "  -o          also write a version 2 index of <dir> to <index>\n");
+	fprintf(stderr, "  -index      write a version 2 index of an existing text manifest\n");
+	fprintf(stderr, "  -diff       list added (A), deleted (D) and modified (M) paths;\n");
+	fprintf(stderr, "              <old> and <new> may each be a directory, a text\n");
+	fprintf(stderr, "              manifest (- for stdin), or an index\n");
+}
+
+int main(int argc, char* argv[]) {
+	char* progname = basename(argv[0]);
+	struct mf_tree t;
+	char* index = NULL;
+	int res;
+
+	int i;
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != 0; ++i) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			walk_jobs = atoi(argv[++i]);
+		} else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '9') {
+			walk_jobs = atoi(argv[i] + 2);
+		} else if (strcmp(argv[i], "-stat-only") == 0) {
+			walk_stat_only = 1;
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			index = argv[++i];
+		} else if (strcmp(argv[i], "-diff") == 0 && i + 3 == argc) {
+			return diff_trees(argv[i + 1], argv[i + 2]);
+		} else if (strcmp(argv[i], "-index") == 0 && i + 3 == argc) {
+			if (load_tree(argv[i + 1], &t) != 0) return 1;
+			res = mf_write_index(&t, argv[i + 2]);
+			mf_tree_free(&t);
+			return res ? 1 : 0;
+		} else {
+			usage(progname);
+			return 1;
+		}
+	}
+	if (i + 1 != argc) {
+		usage(progname);
+		return 1;
+	}
+
+	if (index) {
+		struct mf_builder b;
+		mf_builder_init(&b);
+		res = walk_root(argv[i], stdout, &b);
+		if (res == 0) res = mf_builder_finish(&b, &t);
+		mf_builder_free(&b);
+		if (res == 0) {
+			res = mf_write_index(&t, index);
+			mf_tree_free(&t);
+		}
+		return res ? 1 : 0;
+	}
+
+	return walk_root(argv[i], stdout, NULL) ? 1 : 0;
 }
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "darwintrace.h"
+
+
+void print_usage() {
+	fprintf(stdout, "darwintrace-dump [-l] [file ...]                      \n");
+	fprintf(stdout, "   Convert a binary darwintrace log to the text format.\n");
+	fprintf(stdout, "   Text logs are copied unchanged.                     \n");
+	fprintf(stdout, "                                                       \n");
+	fprintf(stdout, "     -l       Also print time, ppid and thread id      \n");
+	fprintf(stdout, "                                                       \n");
+}
+
+int copy_text(FILE* fp, const char* magic, size_t len) {
+	char buf[8192];
+	fwrite(magic, 1, len, stdout);
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		fwrite(buf, 1, len, stdout);
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+int dump(FILE* fp, const char* filename, int longformat) {
+	struct darwintrace_reader reader;
+	struct darwintrace_record rec;
+	const char* name;
+	const char* path;
+	char magic[4];
+	int res;
+
+	size_t len = fread(magic, 1, sizeof(magic), fp);
+	if (len < sizeof(magic) || memcmp(magic, DARWINTRACE_MAGIC, sizeof(magic)) != 0) {
+		res = copy_text(fp, magic, len);
+		if (res != 0) fprintf(stderr, "darwintrace-dump: %s: %s\n", filename, strerror(errno));
+		return res;
+	}
+	uint32_t version;
+	if (fread(&version, sizeof(version), 1, fp) != 1 || version != DARWINTRACE_VERSION) {
+		fprintf(stderr, "darwintrace-dump: %s: unsupported trace version\n", filename);
+		return -1;
+	}
+
+	darwintrace_reader_init(&reader, fp);
+	while ((res = darwintrace_read(&reader, &rec, &name, &path)) > 0) {
+		const char* tag = darwintrace_op_name(rec.op);
+		if (longformat) {
+			fprintf(stdout, "%llu.%06llu\t%d\t%llu\t",
+					(unsigned long long)(rec.timestamp / 1000000),
+					(unsigned long long)(rec.timestamp % 1000000),
+					rec.ppid, (unsigned long long)rec.tid);
+		}
+		if (tag && DARWINTRACE_OP_PROCESS(rec.op)) {
+			fprintf(stdout, "%s[%d]\t%s\t%d\t%llu\t%s\n", name, rec.pid, tag,
+					rec.ppid, (unsigned long long)rec.timestamp, path);
+		} else if (tag) {
+			fprintf(stdout, "%s[%d]\t%s\t%s\n", name, rec.pid, tag, path);
+		} else {
+			fprintf(stdout, "%s[%d]\top%u\t%s\n", name, rec.pid, rec.op, path);
+		}
+	}
+	if (res < 0) {
+		fprintf(stderr, "darwintrace-dump: %s: malformed trace record\n", filename);
+	}
+	darwintrace_reader_free(&reader);
+	return res;
+}
+
+
+int main(int argc, char* argv[]) {
+	int longformat = 0;
+	int res = 0;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "l")) != -1) {
+		switch (ch) {
+			case 'l':
+				longformat = 1;
+				break;
+			case '?':
+			default:
+				print_usage();
+				exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0) {
+		return dump(stdin, "stdin", longformat) == 0 ? 0 : 1;
+	}
+
+	int i;
+	for (i = 0; i < argc; ++i) {
+		FILE* fp = fopen(argv[i], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "darwintrace-dump: %s: %s\n", argv[i], strerror(errno));
+			res = 1;
+			continue;
+		}
+		if (dump(fp, argv[i], longformat) != 0) res = 1;
+		fclose(fp);
+	}
+
+	return res;
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "darwintrace.h"
+
+/*
+ * Builds the process tree of a build from the start and exit records that
+ * darwintrace writes with DARWINTRACE_PROFILE, and reports where the time
+ * went by tool.
+ *
+ * Each process image is one node: a fork starts a new one, and so does an
+ * exec, which ends the image that was running in that pid.  An image
+ * whose end wasn't logged (killed, or exec'd by something that isn't
+ * traced) is taken to end with the last of its children.
+ */
+
+struct event {
+	int op;
+	pid_t pid;
+	pid_t ppid;
+	uint64_t time;
+	size_t seq;		/* keeps the log order for equal times */
+	char* name;
+	char* path;
+};
+
+struct image {
+	char* name;
+	pid_t pid;
+	uint64_t start;
+	uint64_t end;
+	int status;		/* -1 if unknown */
+	int ended;
+	long parent;		/* index, -1 for a root */
+	long child;		/* first child, in start order */
+	long last;
+	long sibling;
+};
+
+struct tool {
+	const char* name;
+	uint64_t inclusive;
+	uint64_t exclusive;
+	size_t count;
+};
+
+static struct event* events;
+static size_t nevents, maxevents;
+static struct image* images;
+static size_t nimages;
+
+
+void print_usage() {
+	fprintf(stdout, "darwintrace-profile [-t] [file ...]                    \n");
+	fprintf(stdout, "   Report inclusive and exclusive time per tool from a \n");
+	fprintf(stdout, "   darwintrace log written with DARWINTRACE_PROFILE.   \n");
+	fprintf(stdout, "                                                       \n");
+	fprintf(stdout, "     -t       Also print the process tree              \n");
+	fprintf(stdout, "                                                       \n");
+}
+
+int add_event(int op, pid_t pid, pid_t ppid, uint64_t time, const char* name, const char* path) {
+	if (nevents == maxevents) {
+		size_t n = maxevents ? maxevents * 2 : 1024;
+		struct event* e = realloc(events, n * sizeof(*e));
+		if (e == NULL) return -1;
+		events = e;
+		maxevents = n;
+	}
+	struct event* e = &events[nevents];
+	e->op = op;
+	e->pid = pid;
+	e->ppid = ppid;
+	e->time = time;
+	e->seq = nevents;
+	e->name = strdup(name);
+	e->path = strdup(path);
+	if (e->name == NULL || e->path == NULL) return -1;
+	++nevents;
+	return 0;
+}
+
+// name[pid]\top\tppid\tusec\tpath, other records are skipped
+int parse_line(char* line) {
+	char* tab = strchr(line, '\t');
+	char* bracket = tab ? memchr(line, '[', (size_t)(tab - line)) : NULL;
+	char* fields[4];
+	int i, op;
+	if (tab == NULL || bracket == NULL) return 0;
+	for (i = 0; i < 4 && tab; ++i) {
+		fields[i] = tab + 1;
+		tab = strchr(fields[i], '\t');
+		if (tab) *tab = 0;
+	}
+	if (i < 4) return 0;
+	if (strcmp(fields[0], darwintrace_op_name(DARWINTRACE_OP_START)) == 0) {
+		op = DARWINTRACE_OP_START;
+	} else if (strcmp(fields[0], darwintrace_op_name(DARWINTRACE_OP_EXIT)) == 0) {
+		op = DARWINTRACE_OP_EXIT;
+	} else {
+		return 0;
+	}
+	*bracket = 0;
+	return add_event(op, (pid_t)strtol(bracket + 1, NULL, 10),
+					 (pid_t)strtol(fields[1], NULL, 10),
+					 strtoull(fields[2], NULL, 10), line, fields[3]);
+}
+
+// the bytes in head were already read to tell the format apart
+int read_text(FILE* fp, const char* head, size_t headlen) {
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int res = 0;
+	while (res == 0 && (len = getline(&line, &size, fp)) > 0) {
+		if (headlen > 0) {
+			char* joined = malloc(headlen + len + 1);
+			if (joined == NULL) {
+				res = -1;
+				break;
+			}
+			memcpy(joined, head, headlen);
+			memcpy(joined + headlen, line, len + 1);
+			free(line);
+			line = joined;
+			size = headlen + len + 1;
+			len += headlen;
+			headlen = 0;
+		}
+		/* the head may hold more than one line */
+		char* next;
+		char* cur = line;
+		while (res == 0 && (next = strchr(cur, '\n')) != NULL) {
+			*next = 0;
+			res = parse_line(cur);
+			cur = next + 1;
+		}
+		if (res == 0 && *cur) res = parse_line(cur);
+	}
+	free(line);
+	return (res != 0 || ferror(fp)) ? -1 : 0;
+}
+
+int read_log(FILE* fp, const char* filename) {
+	struct darwintrace_reader reader;
+	struct darwintrace_record rec;
+	const char* name;
+	const char* path;
+	char magic[4];
+	int res;
+
+	size_t len = fread(magic, 1, sizeof(magic), fp);
+	if (len < sizeof(magic) || memcmp(magic, DARWINTRACE_MAGIC, sizeof(magic)) != 0) {
+		if (read_text(fp, magic, len) != 0) {
+			fprintf(stderr, "darwintrace-profile: %s: %s\n", filename, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	uint32_t version;
+	if (fread(&version, sizeof(version), 1, fp) != 1 || version != DARWINTRACE_VERSION) {
+		fprintf(stderr, "darwintrace-profile: %s: unsupported trace version\n", filename);
+		return -1;
+	}
+
+	darwintrace_reader_init(&reader, fp);
+	while ((res = darwintrace_read(&reader, &rec, &name, &path)) > 0) {
+		if (!DARWINTRACE_OP_PROCESS(rec.op)) continue;
+		if (add_event(rec.op, rec.pid, rec.ppid, rec.timestamp, name, path) != 0) {
+			fprintf(stderr, "darwintrace-profile: %s\n", strerror(ENOMEM));
+			res = -1;
+			break;
+		}
+	}
+	if (res < 0 && errno != ENOMEM) {
+		fprintf(stderr, "darwintrace-profile: %s: malformed trace record\n", filename);
+	}
+	darwintrace_reader_free(&reader);
+	return res;
+}
+
+int compare_events(const void* a, const void* b) {
+	const struct event* x = a;
+	const struct event* y = b;
+	if (x->time != y->time) return x->time < y->time ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+//
+// The image currently running in each pid, in an open addressing table.
+//
+static long* running;
+static pid_t* running_pid;
+static size_t nrunning = 0;
+
+size_t running_slot(pid_t pid) {
+	size_t b = ((size_t)pid * 2654435761u) & (nrunning - 1);
+	while (running[b] != -1 && running_pid[b] != pid) {
+		b = (b + 1) & (nrunning - 1);
+	}
+	return b;
+}
+
+long running_get(pid_t pid) {
+	return running[running_slot(pid)];
+}
+
+// every image stays in the table until its pid is reused, which is rare
+void running_set(pid_t pid, long image) {
+	size_t b = running_slot(pid);
+	running[b] = image;
+	running_pid[b] = pid;
+}
+
+void add_child(long parent, long child) {
+	images[child].parent = parent;
+	if (parent < 0) return;
+	if (images[parent].last < 0) {
+		images[parent].child = child;
+	} else {
+		images[images[parent].last].sibling = child;
+	}
+	images[parent].last = child;
+}
+
+int build_tree() {
+	size_t i;
+
+	qsort(events, nevents, sizeof(*events), compare_events);
+
+	nrunning = 1024;
+	while (nrunning < nevents * 2) nrunning *= 2;
+	running = malloc(nrunning * sizeof(*running));
+	running_pid = malloc(nrunning * sizeof(*running_pid));
+	images = malloc((nevents + 1) * sizeof(*images));
+	if (running == NULL || running_pid == NULL || images == NULL) return -1;
+	for (i = 0; i < nrunning; ++i) running[i] = -1;
+
+	for (i = 0; i < nevents; ++i) {
+		struct event* e = &events[i];
+		long prev = running_get(e->pid);
+		if (prev >= 0 && images[prev].ended) prev = -1;
+
+		if (e->op == DARWINTRACE_OP_EXIT) {
+			if (prev < 0) continue;
+			images[prev].end = e->time;
+			images[prev].ended = 1;
+			images[prev].status = strcmp(e->path, "?") == 0 ? -1 : atoi(e->path);
+			continue;
+		}
+
+		struct image* img = &images[nimages];
+		img->name = e->name;
+		img->pid = e->pid;
+		img->start = e->time;
+		img->end = e->time;
+		img->status = -1;
+		img->ended = 0;
+		img->child = img->last = img->sibling = -1;
+		if (prev >= 0) {
+			/* an exec, which replaces the image that was running */
+			images[prev].end = e->time;
+			images[prev].ended = 1;
+			add_child(images[prev].parent, (long)nimages);
+		} else {
+			long parent = running_get(e->ppid);
+			add_child(parent >= 0 && !images[parent].ended ? parent : -1, (long)nimages);
+		}
+		running_set(e->pid, (long)nimages);
+		++nimages;
+	}
+
+	/* children always come after their parent */
+	i = nimages;
+	while (i-- > 0) {
+		struct image* img = &images[i];
+		long c;
+		if (img->ended) continue;
+		for (c = img->child; c >= 0; c = images[c].sibling) {
+			if (images[c].end > img->end) img->end = images[c].end;
+		}
+	}
+	return 0;
+}
+
+// the time of an image not spent waiting on its children
+uint64_t exclusive_time(struct image* img) {
+	uint64_t busy = 0, from = img->start, to = img->start;
+	long c;
+	for (c = img->child; c >= 0; c = images[c].sibling) {
+		uint64_t start = images[c].start < img->start ? img->start : images[c].start;
+		uint64_t end = images[c].end > img->end ? img->end : images[c].end;
+		if (end <= start) continue;
+		if (start > to) {
+			busy += to - from;
+			from = start;
+		}
+		if (end > to) to = end;
+	}
+	busy += to - from;
+	return (img->end - img->start) - busy;
+}
+
+int has_ancestor(struct image* img, const char* name) {
+	long p;
+	for (p = img->parent; p >= 0; p = images[p].parent) {
+		if (strcmp(images[p].name, name) == 0) return 1;
+	}
+	return 0;
+}
+
+int compare_tools(const void* a, const void* b) {
+	const struct tool* x = a;
+	const struct tool* y = b;
+	if (x->inclusive != y->inclusive) return x->inclusive > y->inclusive ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+void print_tree(long i, int depth) {
+	for (; i >= 0; i = images[i].sibling) {
+		struct image* img = &images[i];
+		uint64_t duration = img->end - img->start;
+		fprintf(stdout, "%*s%s[%d]\t%llu.%06llu", depth * 2, "", img->name, img->pid,
+				(unsigned long long)(duration / 1000000),
+				(unsigned long long)(duration % 1000000));
+		if (img->status >= 0) {
+			fprintf(stdout, "\texit %d\n", img->status);
+		} else {
+			fprintf(stdout, "\t%s\n", img->ended ? "exec" : "?");
+		}
+		print_tree(img->child, depth + 1);
+	}
+}
+
+int report(int tree) {
+	struct tool* tools = calloc(nimages + 1, sizeof(*tools));
+	size_t ntools = 0, i, j;
+	if (tools == NULL) return -1;
+
+	for (i = 0; i < nimages; ++i) {
+		struct image* img = &images[i];
+		for (j = 0; j < ntools; ++j) {
+			if (strcmp(tools[j].name, img->name) == 0) break;
+		}
+		if (j == ntools) tools[ntools++].name = img->name;
+		/* a recursive make is already in the time of the outer one */
+		if (!has_ancestor(img, img->name)) {
+			tools[j].inclusive += img->end - img->start;
+		}
+		tools[j].exclusive += exclusive_time(img);
+		++tools[j].count;
+	}
+	qsort(tools, ntools, sizeof(*tools), compare_tools);
+
+	fprintf(stdout, "%12s %12s %8s  %s\n", "inclusive", "exclusive", "count", "tool");
+	for (i = 0; i < ntools; ++i) {
+		fprintf(stdout, "%5llu.%06llu %5llu.%06llu %8zu  %s\n",
+				(unsigned long long)(tools[i].inclusive / 1000000),
+				(unsigned long long)(tools[i].inclusive % 1000000),
+				(unsigned long long)(tools[i].exclusive / 1000000),
+				(unsigned long long)(tools[i].exclusive % 1000000),
+				tools[i].count, tools[i].name);
+	}
+	free(tools);
+
+	if (tree) {
+		fprintf(stdout, "\n");
+		for (i = 0; i < nimages; ++i) {
+			if (images[i].parent < 0) print_tree((long)i, 0);
+		}
+	}
+	return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+	int tree = 0;
+	int res = 0;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "t")) != -1) {
+		switch (ch) {
+			case 't':
+				tree = 1;
+				break;
+			case '?':
+			default:
+				print_usage();
+				exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0) {
+		res = read_log(stdin, "stdin") == 0 ? 0 : 1;
+	}
+
+	int i;
+	for (i = 0; i < argc; ++i) {
+		FILE* fp = fopen(argv[i], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "darwintrace-profile: %s: %s\n", argv[i], strerror(errno));
+			res = 1;
+			continue;
+		}
+		if (read_log(fp, argv[i]) != 0) res = 1;
+		fclose(fp);
+	}
+
+	if (build_tree() != 0 || report(tree) != 0) {
+		fprintf(stderr, "darwintrace-profile: %s\n", strerror(ENOMEM));
+		return 1;
+	}
+	return res;
+}
@@ -30,7 +30,13 @@
  * @APPLE_BSD_LICENSE_HEADER_END@
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#else
 #include <crt_externs.h>
+#endif
+#include <dirent.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <spawn.h>
@@ -38,18 +44,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#include <mach-o/dyld.h>
 #include <sys/paths.h>
+#else
+#include <paths.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/time.h>
 #include <errno.h>
+#include <time.h>
+
+#include "darwintrace.h"
 
 #define DARWINTRACE_LOG_FULL_PATH 1
 #define DARWINTRACE_DEBUG_OUTPUT 0
 #define DARWINTRACE_START_FD 101
 #define DARWINTRACE_STOP_FD  200
 #define DARWINTRACE_BUFFER_SIZE 1024
+#define DARWINTRACE_THREAD_BUFFER_SIZE 8192
+#define DARWINTRACE_SEEN_SIZE 65536 /* power of two */
+#define DARWINTRACE_SEEN_PROBES 32
+#define DARWINTRACE_STRTAB_SIZE 256 /* power of two */
 
 #if DARWINTRACE_DEBUG_OUTPUT
 #define dprintf(...) fprintf(stderr, __VA_ARGS__)
@@ -59,6 +81,25 @@
 
 #define LION_OR_LATER (__MAC_OS_X_VERSION_MIN_REQUIRED >= 1070)
 
+/* openat(2) and friends, from 10.10 on */
+#if defined(__linux__) || (__MAC_OS_X_VERSION_MIN_REQUIRED >= 101000)
+#define DARWINTRACE_AT_CALLS 1
+#else
+#define DARWINTRACE_AT_CALLS 0
+#endif
+
+/* before 2.33, glibc's stat(2) calls are inline wrappers of __xstat() */
+#ifdef __GLIBC__
+#define DARWINTRACE_XSTAT (!__GLIBC_PREREQ(2, 33))
+#else
+#define DARWINTRACE_XSTAT 0
+#endif
+
+#ifdef __APPLE__
+
+#define DARWINTRACE_PRELOAD "DYLD_INSERT_LIBRARIES"
+#define DARWINTRACE_LIBRARY "darwintrace.dylib"
+
 #define DARWINTRACE_INTERPOSE(_replacement,_replacee) \
 	__attribute__((used)) static struct { \
 		const void* replacement; \
@@ -69,9 +110,51 @@
 		(const void*)(unsigned long)&_replacee \
 	}
 
+/* dyld doesn't apply interposing to the library doing it */
+#define DARWINTRACE_REAL(_func) _func
+
+#else /* Linux, loaded with LD_PRELOAD */
+
+#define DARWINTRACE_PRELOAD "LD_PRELOAD"
+#define DARWINTRACE_LIBRARY "darwintrace.so"
+
+/* export the replacement under the name of the function it replaces */
+#define DARWINTRACE_INTERPOSE(_replacement,_replacee) \
+	extern __typeof__(_replacee) _replacee \
+	__attribute__((alias(#_replacement), visibility("default")))
+
+/* look up the next definition, the one in libc */
+#define DARWINTRACE_REAL(_func) \
+	({ \
+		static __typeof__(&_func) _real = NULL; \
+		if (_real == NULL) _real = (__typeof__(&_func))dlsym(RTLD_NEXT, #_func); \
+		_real; \
+	})
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+static size_t strlcpy(char *dst, const char *src, size_t size) {
+	size_t len = strlen(src);
+	if (size > 0) {
+		size_t n = len < size - 1 ? len : size - 1;
+		memcpy(dst, src, n);
+		dst[n] = 0;
+	}
+	return len;
+}
+
+static size_t strlcat(char *dst, const char *src, size_t size) {
+	size_t len = strnlen(dst, size);
+	if (len == size) return size + strlen(src);
+	return len + strlcpy(dst + len, src, size - len);
+}
+#endif
+
+#endif
+
 static int darwintrace_fd = -2;
 static char darwintrace_progname[DARWINTRACE_BUFFER_SIZE];
 static pid_t darwintrace_pid = -1;
+static pid_t darwintrace_ppid = -1;
 
 /**
  * Redirect file access
@@ -94,54 +177,406 @@ static const char *darwintrace_exceptions[] = {
 	"/dev/",
 };
 
-/* store root paths so we can ignore them when logging */
-static char   **darwintrace_ignores     = NULL;
-static size_t  *darwintrace_ignore_lens = NULL;
+/**
+ * Path prefixes, compiled once at setup into a trie of bytes, so a path
+ * is only compared as far as its longest matching prefix. The exceptions
+ * above, those in DARWINTRACE_EXCEPTIONS (separated by colons) and the
+ * redirect and buildroot paths are never redirected. With
+ * DARWINTRACE_IGNORE_ROOTS, paths under OBJROOT, SRCROOT, DSTROOT and
+ * SYMROOT aren't logged.
+ */
+#define DARWINTRACE_PREFIX_NOREDIRECT 1
+#define DARWINTRACE_PREFIX_IGNORE 2
+
+struct darwintrace_trie {
+	unsigned char c;
+	unsigned char kinds;	/* of the prefixes ending here */
+	uint32_t child;		/* 0 for none, the root is never a child */
+	uint32_t sibling;
+};
+
+static struct darwintrace_trie *darwintrace_prefixes = NULL;
+static uint32_t darwintrace_prefix_nodes = 0;
+static uint32_t darwintrace_prefix_capacity = 0;
+static bool darwintrace_ignore_roots = false;
+
+/* environment variables forced on exec, built once at setup */
+static char *darwintrace_env_log;
+static char *darwintrace_env_preload;
+static const char *darwintrace_dylib_path;
+
+/* the switches children have to trace with, kept as they were at setup */
+static const char *const darwintrace_switches[] = {
+	"DARWINTRACE_PROFILE",
+	"DARWINTRACE_PROBES",
+	"DARWINTRACE_LOG_ALL",
+	"DARWINTRACE_UNBUFFERED",
+	"DARWINTRACE_EXCEPTIONS",
+};
+#define DARWINTRACE_SWITCHES (sizeof(darwintrace_switches)/sizeof(*darwintrace_switches))
+static char *darwintrace_env_switches[DARWINTRACE_SWITCHES];
+
+/**
+ * Per-thread record buffers. Records are collected in the calling thread's
+ * buffer and written out with one write(2) per buffer, so a record is never
+ * split between writes. All buffers are kept on a list so that they can be
+ * flushed before exec, fork and exit, which would otherwise lose the records
+ * of every thread. DARWINTRACE_UNBUFFERED writes each record immediately.
+ *
+ * In the binary format each buffer also carries the thread's string table,
+ * a direct-mapped cache of the names and paths it has written; the id of a
+ * string is its slot plus one. It is only used by the owning thread, so it
+ * isn't covered by the lock. The table is scoped by the thread id kept here,
+ * which also covers a vfork(2) child that shares the buffer until it execs.
+ */
+struct darwintrace_str {
+	uint64_t hash;
+	char *str;
+};
+
+struct darwintrace_tbuf {
+	struct darwintrace_tbuf *next;
+	pthread_mutex_t lock;
+	size_t len;
+	char data[DARWINTRACE_THREAD_BUFFER_SIZE];
+	uint64_t tid;
+	struct darwintrace_str strs[DARWINTRACE_STRTAB_SIZE];
+};
+
+/**
+ * Hashes of the (tag, path) pairs this process has already logged, so
+ * that reopening the same header or tool isn't logged again. Slots are
+ * claimed with compare-and-swap and never freed; when a probe sequence
+ * finds no free slot, the record is simply logged. A zero slot is free.
+ * DARWINTRACE_LOG_ALL logs every event instead.
+ */
+static uint64_t darwintrace_seen[DARWINTRACE_SEEN_SIZE];
+static bool darwintrace_dedup = false;
+
+/**
+ * With DARWINTRACE_PROBES, successful stat(2), access(2) and opendir(3)
+ * calls are logged too, each with its own tag. Build systems look for
+ * headers with these before opening them, or without ever opening them.
+ */
+static bool darwintrace_probes = false;
 
-/* store environment variables to preserve them on exec */
-static char *darwintrace_dylib_path;
-static char *darwintrace_log_path;
+/**
+ * With DARWINTRACE_PROFILE, each process image logs a start record when
+ * the library is loaded or the process forks, and an exit record with
+ * its exit status when it exits. Both carry the ppid and a monotonic
+ * timestamp, see darwintrace-profile. The status comes from exit(3),
+ * _exit(2) or, on Linux, the return from main.
+ */
+static bool darwintrace_profile = false;
+static char darwintrace_exe_path[MAXPATHLEN];
+static int darwintrace_exit_status = -1;	/* unknown */
+
+static bool darwintrace_binary = false;
+static bool darwintrace_buffered = false;
+static pthread_key_t darwintrace_tbuf_key;
+static pthread_mutex_t darwintrace_tbuf_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct darwintrace_tbuf *darwintrace_tbuf_list = NULL;
+
+static uint32_t darwintrace_prefix_node(unsigned char c) {
+	if (darwintrace_prefix_nodes == darwintrace_prefix_capacity) {
+		uint32_t capacity = darwintrace_prefix_capacity ? darwintrace_prefix_capacity * 2 : 256;
+		struct darwintrace_trie *nodes = realloc(darwintrace_prefixes, capacity * sizeof(*nodes));
+		if (nodes == NULL) return 0;
+		darwintrace_prefixes = nodes;
+		darwintrace_prefix_capacity = capacity;
+	}
+	struct darwintrace_trie *node = &darwintrace_prefixes[darwintrace_prefix_nodes];
+	node->c = c;
+	node->kinds = 0;
+	node->child = 0;
+	node->sibling = 0;
+	return darwintrace_prefix_nodes++;
+}
 
-/* check if str starts with one of the exceptions */
-static inline bool darwintrace_except(const char *str) {
-	size_t c = sizeof(darwintrace_exceptions)/sizeof(*darwintrace_exceptions);
+/* add the first len bytes of prefix; only called during setup */
+static void darwintrace_prefix_add(const char *prefix, size_t len, int kind) {
+	uint32_t n = 0;
 	size_t i;
-	for (i = 0; i < c; i++) {
-		if (strncmp(darwintrace_exceptions[i], str, strlen(darwintrace_exceptions[i])) == 0) {
-			return true;
+	if (darwintrace_prefix_nodes == 0 && darwintrace_prefix_node(0) != 0) return;
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)prefix[i];
+		uint32_t child = darwintrace_prefixes[n].child;
+		while (child != 0 && darwintrace_prefixes[child].c != c) {
+			child = darwintrace_prefixes[child].sibling;
+		}
+		if (child == 0) {
+			child = darwintrace_prefix_node(c);
+			if (child == 0) {
+				dprintf("darwintrace: unable to allocate memory for prefixes\n");
+				return;
+			}
+			darwintrace_prefixes[child].sibling = darwintrace_prefixes[n].child;
+			darwintrace_prefixes[n].child = child;
 		}
+		n = child;
 	}
-	return false;
+	darwintrace_prefixes[n].kinds |= kind;
 }
 
-/* apply redirection heuristic to path */
-static inline char* darwintrace_redirect_path(const char* path) {
+/* add each of the paths in list, separated by colons */
+static void darwintrace_prefix_add_list(const char *list, int kind) {
+	while (list && *list) {
+		const char *end = strchr(list, ':');
+		size_t len = end ? (size_t)(end - list) : strlen(list);
+		if (len > 0) darwintrace_prefix_add(list, len, kind);
+		list += len;
+		if (*list == ':') ++list;
+	}
+}
+
+/* check if path starts with one of the prefixes of the given kinds */
+static inline bool darwintrace_prefix_match(const char *path, int kinds) {
+	const unsigned char *p = (const unsigned char *)path;
+	uint32_t n = 0;
+	if (darwintrace_prefix_nodes == 0) return false;
+	for (;;) {
+		if (darwintrace_prefixes[n].kinds & kinds) return true;
+		if (*p == 0) return false;
+		n = darwintrace_prefixes[n].child;
+		while (n != 0 && darwintrace_prefixes[n].c != *p) {
+			n = darwintrace_prefixes[n].sibling;
+		}
+		if (n == 0) return false;
+		p++;
+	}
+}
+
+static inline void darwintrace_setup(void);
+
+/*
+ * Apply redirection heuristic to path. Returns path itself, or the
+ * redirected path in buf, which must hold MAXPATHLEN bytes. Returns NULL
+ * with errno set to ENAMETOOLONG if the redirected path doesn't fit.
+ */
+static inline char* darwintrace_redirect_path(const char* path, char* buf) {
+	darwintrace_setup();
 	if (!darwintrace_redirect) return (char*)path;
 
-	char *redirpath;
-	redirpath = (char *)path;
 	if (path[0] == '/'
-		&& !darwintrace_except(path)
-		&& strncmp(darwintrace_buildroot, path, strlen(darwintrace_buildroot))!=0
-		&& strncmp(darwintrace_redirect, path, strlen(darwintrace_redirect))!=0 ) {
-		asprintf(&redirpath, "%s%s%s", darwintrace_redirect, (*path == '/' ? "" : "/"), path);
-		dprintf("darwintrace: redirect %s -> %s\n", path, redirpath);
+		&& !darwintrace_prefix_match(path, DARWINTRACE_PREFIX_NOREDIRECT)) {
+		if (snprintf(buf, MAXPATHLEN, "%s%s", darwintrace_redirect, path) >= MAXPATHLEN) {
+			dprintf("darwintrace: redirected path too long: %s\n", path);
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		dprintf("darwintrace: redirect %s -> %s\n", path, buf);
+		return buf;
+	}
+
+	return (char*)path;
+}
+
+/* write the whole buffer to the log, preserving errno */
+static void darwintrace_write(const char *buf, size_t size) {
+	int olderrno = errno;
+	while (size > 0) {
+		ssize_t written = write(darwintrace_fd, buf, size);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			dprintf("darwintrace: lost %zu bytes of trace\n", size);
+			break;
+		}
+		buf += written;
+		size -= written;
 	}
+	errno = olderrno;
+}
 
-	return redirpath;
+/* the caller must hold tb->lock */
+static inline void darwintrace_flush_locked(struct darwintrace_tbuf *tb) {
+	if (tb->len > 0) {
+		darwintrace_write(tb->data, tb->len);
+		tb->len = 0;
+	}
 }
 
-/* free path if not the same as test */
-static inline void darwintrace_free_path(char* path, const char* test) {
-	if (path != test) free(path);
+static void darwintrace_flush_all(void) {
+	struct darwintrace_tbuf *tb;
+	pthread_mutex_lock(&darwintrace_tbuf_list_lock);
+	for (tb = darwintrace_tbuf_list; tb != NULL; tb = tb->next) {
+		pthread_mutex_lock(&tb->lock);
+		darwintrace_flush_locked(tb);
+		pthread_mutex_unlock(&tb->lock);
+	}
+	pthread_mutex_unlock(&darwintrace_tbuf_list_lock);
+}
+
+static void darwintrace_strtab_clear(struct darwintrace_tbuf *tb) {
+	int i;
+	for (i = 0; i < DARWINTRACE_STRTAB_SIZE; i++) {
+		free(tb->strs[i].str);
+		tb->strs[i].str = NULL;
+	}
+}
+
+/* pthread key destructor, runs as each thread exits */
+static void darwintrace_thread_exit(void *arg) {
+	struct darwintrace_tbuf *tb = arg;
+	struct darwintrace_tbuf **prev;
+
+	pthread_mutex_lock(&darwintrace_tbuf_list_lock);
+	for (prev = &darwintrace_tbuf_list; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == tb) {
+			*prev = tb->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&darwintrace_tbuf_list_lock);
+
+	/* no longer reachable by anyone else */
+	darwintrace_flush_locked(tb);
+	darwintrace_strtab_clear(tb);
+	pthread_mutex_destroy(&tb->lock);
+	free(tb);
+}
+
+static inline uint64_t darwintrace_thread_id(void) {
+#ifdef __APPLE__
+	uint64_t tid = 0;
+	pthread_threadid_np(NULL, &tid);
+	return tid;
+#else
+	return (uint64_t)syscall(SYS_gettid);
+#endif
+}
+
+static struct darwintrace_tbuf *darwintrace_thread_buffer(void) {
+	struct darwintrace_tbuf *tb = pthread_getspecific(darwintrace_tbuf_key);
+	if (tb == NULL) {
+		tb = calloc(1, sizeof(*tb));
+		if (tb == NULL) return NULL;
+		pthread_mutex_init(&tb->lock, NULL);
+		tb->tid = darwintrace_thread_id();
+
+		pthread_mutex_lock(&darwintrace_tbuf_list_lock);
+		tb->next = darwintrace_tbuf_list;
+		darwintrace_tbuf_list = tb;
+		pthread_mutex_unlock(&darwintrace_tbuf_list_lock);
+
+		pthread_setspecific(darwintrace_tbuf_key, tb);
+	}
+	return tb;
+}
+
+/* FNV-1a */
+static inline uint64_t darwintrace_fnv(uint64_t hash, const char *str) {
+	const unsigned char *p;
+	for (p = (const unsigned char *)str; *p; p++) {
+		hash = (hash ^ *p) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* hash of the tag, a separator and the path */
+static inline uint64_t darwintrace_hash(const char *tag, const char *path) {
+	uint64_t hash = darwintrace_fnv(14695981039346656037ULL, tag);
+	hash = darwintrace_fnv((hash ^ '\t') * 1099511628211ULL, path);
+	return hash ? hash : 1;
+}
+
+/* returns true if (tag, path) was logged before, and marks it as logged */
+static bool darwintrace_already_seen(const char *tag, const char *path) {
+	uint64_t hash = darwintrace_hash(tag, path);
+	size_t i = (size_t)hash & (DARWINTRACE_SEEN_SIZE - 1);
+	int probe;
+	for (probe = 0; probe < DARWINTRACE_SEEN_PROBES; probe++) {
+		uint64_t slot = darwintrace_seen[i];
+		if (slot == 0) {
+			slot = __sync_val_compare_and_swap(&darwintrace_seen[i], 0, hash);
+			if (slot == 0) return false;
+		}
+		if (slot == hash) return true;
+		i = (i + 1) & (DARWINTRACE_SEEN_SIZE - 1);
+	}
+	return false;
+}
+
+/* append one complete record to this thread's buffer */
+static void darwintrace_emit(const char *record, size_t size) {
+	struct darwintrace_tbuf *tb = darwintrace_buffered ? darwintrace_thread_buffer() : NULL;
+	if (tb == NULL) {
+		darwintrace_write(record, size);
+		return;
+	}
+
+	pthread_mutex_lock(&tb->lock);
+	if (tb->len + size > sizeof(tb->data)) {
+		darwintrace_flush_locked(tb);
+	}
+	memcpy(tb->data + tb->len, record, size);
+	tb->len += size;
+	pthread_mutex_unlock(&tb->lock);
+}
+
+/*
+ * Flush everything before fork, so the child doesn't inherit (and later
+ * write again) records of the parent, and hold the locks across the fork
+ * so no buffer is copied mid-update.
+ */
+static void darwintrace_atfork_prepare(void) {
+	struct darwintrace_tbuf *tb;
+	pthread_mutex_lock(&darwintrace_tbuf_list_lock);
+	for (tb = darwintrace_tbuf_list; tb != NULL; tb = tb->next) {
+		pthread_mutex_lock(&tb->lock);
+		darwintrace_flush_locked(tb);
+	}
+}
+
+static void darwintrace_atfork_parent(void) {
+	struct darwintrace_tbuf *tb;
+	for (tb = darwintrace_tbuf_list; tb != NULL; tb = tb->next) {
+		pthread_mutex_unlock(&tb->lock);
+	}
+	pthread_mutex_unlock(&darwintrace_tbuf_list_lock);
+}
+
+static void darwintrace_log_process(int op);
+
+static void darwintrace_atfork_child(void) {
+	struct darwintrace_tbuf *tb;
+	darwintrace_atfork_parent();
+	darwintrace_ppid = darwintrace_pid;
+	darwintrace_pid = getpid();
+	/* string ids are per process, so the child has to define its own */
+	for (tb = darwintrace_tbuf_list; tb != NULL; tb = tb->next) {
+		darwintrace_strtab_clear(tb);
+	}
+	if (darwintrace_buffered) {
+		tb = pthread_getspecific(darwintrace_tbuf_key);
+		if (tb != NULL) tb->tid = darwintrace_thread_id();
+	}
+	if (darwintrace_profile) darwintrace_log_process(DARWINTRACE_OP_START);
+}
+
+static inline void darwintrace_setup(void);
+
+/* profiling has to start as soon as the library is loaded */
+__attribute__((constructor))
+static void darwintrace_init(void) {
+	if (getenv("DARWINTRACE_PROFILE") != NULL) {
+		darwintrace_setup();
+	}
+}
+
+__attribute__((destructor))
+static void darwintrace_fini(void) {
+	if (darwintrace_fd >= 0) {
+		if (darwintrace_profile) darwintrace_log_process(DARWINTRACE_OP_EXIT);
+		darwintrace_flush_all();
+	}
 }
 
 static void _darwintrace_setup(void) {
 	char* path = getenv("DARWINTRACE_LOG");
 	if (path != NULL) {
 		int olderrno = errno;
-		int fd = open(path,
-					  O_CREAT | O_WRONLY | O_APPEND,
+		int fd = DARWINTRACE_REAL(open)(path,
+					  O_CREAT | O_RDWR | O_APPEND,
 					  DEFFILEMODE);
 		int newfd;
 		for(newfd = DARWINTRACE_START_FD; newfd < DARWINTRACE_STOP_FD; newfd++) {
@@ -152,48 +587,109 @@ static void _darwintrace_setup(void) {
 				break;
 			}
 		}
-		darwintrace_log_path = strdup(path);
+		if (asprintf(&darwintrace_env_log, "DARWINTRACE_LOG=%s", path) < 0) {
+			darwintrace_env_log = NULL;
+		}
+
+		/* an existing log decides the format, so that it's never mixed */
+		if (darwintrace_fd >= 0) {
+			char magic[4];
+			ssize_t len = pread(darwintrace_fd, magic, sizeof(magic), 0);
+			if (len == sizeof(magic)) {
+				darwintrace_binary = (memcmp(magic, DARWINTRACE_MAGIC, sizeof(magic)) == 0);
+			} else if (len == 0 && getenv("DARWINTRACE_BINARY") != NULL) {
+				struct darwintrace_file_header header;
+				memcpy(header.magic, DARWINTRACE_MAGIC, sizeof(header.magic));
+				header.version = DARWINTRACE_VERSION;
+				darwintrace_write((const char *)&header, sizeof(header));
+				darwintrace_binary = true;
+			}
+		}
 		errno = olderrno;
 	}
 
+	if (darwintrace_fd >= 0 && getenv("DARWINTRACE_UNBUFFERED") == NULL
+		&& pthread_key_create(&darwintrace_tbuf_key, &darwintrace_thread_exit) == 0) {
+		darwintrace_buffered = true;
+	}
+	/* a forked child has to pick up its own pid in any case */
+	if (darwintrace_fd >= 0) {
+		pthread_atfork(&darwintrace_atfork_prepare, &darwintrace_atfork_parent, &darwintrace_atfork_child);
+	}
+
+	darwintrace_dedup = (getenv("DARWINTRACE_LOG_ALL") == NULL);
+	darwintrace_probes = (getenv("DARWINTRACE_PROBES") != NULL);
+	darwintrace_profile = (darwintrace_fd >= 0 && getenv("DARWINTRACE_PROFILE") != NULL);
+
 	/* read env vars needed for redirection */
 	darwintrace_redirect = getenv("DARWINTRACE_REDIRECT");
 	darwintrace_buildroot = getenv("DARWIN_BUILDROOT");
 
 	darwintrace_pid = getpid();
+	darwintrace_ppid = getppid();
+#ifdef __APPLE__
 	char** progname = _NSGetProgname();
+#else
+	char** progname = &program_invocation_short_name;
+#endif
 	if (progname && *progname) {
 		if (strlcpy(darwintrace_progname, *progname, sizeof(darwintrace_progname)) >= sizeof(darwintrace_progname)) {
 			dprintf("darwintrace: progname too long to copy: %s\n", *progname);
 		}
 	}
 
-	/* create ignores list from root env vars */
+	if (darwintrace_profile) {
+#ifdef __APPLE__
+		uint32_t size = sizeof(darwintrace_exe_path);
+		if (_NSGetExecutablePath(darwintrace_exe_path, &size) != 0) {
+			darwintrace_exe_path[0] = 0;
+		}
+#else
+		ssize_t len = DARWINTRACE_REAL(readlink)("/proc/self/exe", darwintrace_exe_path, sizeof(darwintrace_exe_path) - 1);
+		darwintrace_exe_path[len < 0 ? 0 : len] = 0;
+#endif
+		darwintrace_log_process(DARWINTRACE_OP_START);
+	}
+
+	/* compile the prefixes that aren't redirected */
+	if (darwintrace_redirect) {
+		size_t i;
+		for (i = 0; i < sizeof(darwintrace_exceptions)/sizeof(*darwintrace_exceptions); i++) {
+			darwintrace_prefix_add(darwintrace_exceptions[i], strlen(darwintrace_exceptions[i]), DARWINTRACE_PREFIX_NOREDIRECT);
+		}
+		darwintrace_prefix_add_list(getenv("DARWINTRACE_EXCEPTIONS"), DARWINTRACE_PREFIX_NOREDIRECT);
+		darwintrace_prefix_add(darwintrace_redirect, strlen(darwintrace_redirect), DARWINTRACE_PREFIX_NOREDIRECT);
+		if (darwintrace_buildroot) {
+			darwintrace_prefix_add(darwintrace_buildroot, strlen(darwintrace_buildroot), DARWINTRACE_PREFIX_NOREDIRECT);
+		}
+	}
+
+	/* and the roots that aren't logged */
 	if (getenv("DARWINTRACE_IGNORE_ROOTS")) {
-		darwintrace_ignores = (char**)calloc(4, sizeof(char*));
-		darwintrace_ignore_lens = (size_t*)calloc(4, sizeof(size_t));
-		if (darwintrace_ignores && darwintrace_ignore_lens) {
-			darwintrace_ignores[0] = getenv("OBJROOT");
-			if (darwintrace_ignores[0])
-			darwintrace_ignore_lens[0] = strlen(darwintrace_ignores[0]);
-			darwintrace_ignores[1] = getenv("SRCROOT");
-			if (darwintrace_ignores[1])
-			darwintrace_ignore_lens[1] = strlen(darwintrace_ignores[1]);
-			darwintrace_ignores[2] = getenv("DSTROOT");
-			if (darwintrace_ignores[2])
-			darwintrace_ignore_lens[2] = strlen(darwintrace_ignores[2]);
-			darwintrace_ignores[3] = getenv("SYMROOT");
-			if (darwintrace_ignores[3])
-			darwintrace_ignore_lens[3] = strlen(darwintrace_ignores[3]);
-		} else {
-			dprintf("unable to allocate memory for darwintrace_ignores");
+		static const char *roots[] = { "OBJROOT", "SRCROOT", "DSTROOT", "SYMROOT" };
+		size_t i;
+		darwintrace_ignore_roots = true;
+		for (i = 0; i < sizeof(roots)/sizeof(*roots); i++) {
+			char *root = getenv(roots[i]);
+			if (root) darwintrace_prefix_add(root, strlen(root), DARWINTRACE_PREFIX_IGNORE);
+		}
+	}
+
+	/* and the switches to pass on */
+	{
+		size_t i;
+		for (i = 0; i < DARWINTRACE_SWITCHES; i++) {
+			char *value = getenv(darwintrace_switches[i]);
+			if (value && asprintf(&darwintrace_env_switches[i], "%s=%s", darwintrace_switches[i], value) < 0) {
+				darwintrace_env_switches[i] = NULL;
+			}
 		}
 	}
 
 	/* find the install path of the darwintrace dylib for later use */
-	path = getenv("DYLD_INSERT_LIBRARIES");
+	path = getenv(DARWINTRACE_PRELOAD);
 	if (path != NULL) {
-		char *ptr = strstr(path, "darwintrace.dylib");
+		char *ptr = strstr(path, DARWINTRACE_LIBRARY);
 		if (ptr) {
 			/* scan backward for : or start of string */
 			while (ptr > path) {
@@ -204,12 +700,12 @@ static void _darwintrace_setup(void) {
 				--ptr;
 			}
 
-			darwintrace_dylib_path = strdup(ptr);
-
-			/* scan forward for : or end of string and terminate */
-			ptr = strchr(darwintrace_dylib_path, ':');
-			if (ptr) {
-				*ptr = 0;
+			/* up to the next : or end of string */
+			if (asprintf(&darwintrace_env_preload, "%s=%.*s", DARWINTRACE_PRELOAD,
+						 (int)strcspn(ptr, ":"), ptr) >= 0) {
+				darwintrace_dylib_path = darwintrace_env_preload + strlen(DARWINTRACE_PRELOAD "=");
+			} else {
+				darwintrace_env_preload = NULL;
 			}
 		}
 	}
@@ -220,20 +716,80 @@ static inline void darwintrace_setup(void) {
 	pthread_once(&once, &_darwintrace_setup);
 }
 
+/*
+ * Returns the id of str in this thread's string table, adding it if it
+ * isn't there yet. *define is set when the string has to be written out.
+ */
+static uint16_t darwintrace_intern(struct darwintrace_tbuf *tb, const char *str, bool *define) {
+	uint64_t hash = darwintrace_fnv(14695981039346656037ULL, str);
+	size_t slot = hash & (DARWINTRACE_STRTAB_SIZE - 1);
+	struct darwintrace_str *s = &tb->strs[slot];
+	*define = true;
+	if (*str == 0) return 0;
+	if (s->str && s->hash == hash && strcmp(s->str, str) == 0) {
+		*define = false;
+		return slot + 1;
+	}
+	char *copy = strdup(str);
+	if (copy == NULL) return 0;
+	free(s->str);
+	s->hash = hash;
+	s->str = copy;
+	return slot + 1;
+}
+
+static void darwintrace_log_binary(const char *procname, int op, const char *path, uint64_t timestamp) {
+	struct darwintrace_tbuf *tb = darwintrace_buffered ? darwintrace_thread_buffer() : NULL;
+	struct darwintrace_record rec;
+	bool define_name = true, define_path = true;
+	char darwintrace_buf[sizeof(rec) + DARWINTRACE_BUFFER_SIZE + MAXPATHLEN];
+	size_t namelen = strlen(procname);
+	size_t pathlen = strlen(path);
+
+	if (namelen >= DARWINTRACE_BUFFER_SIZE) namelen = DARWINTRACE_BUFFER_SIZE - 1;
+	if (pathlen >= MAXPATHLEN) pathlen = MAXPATHLEN - 1;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.pid = darwintrace_pid;
+	rec.ppid = darwintrace_ppid;
+	rec.tid = (uint32_t)(tb ? tb->tid : darwintrace_thread_id());
+	rec.timestamp = timestamp;
+	if (tb != NULL) {
+		rec.name_id = darwintrace_intern(tb, procname, &define_name);
+		rec.path_id = darwintrace_intern(tb, path, &define_path);
+	}
+	rec.name_len = define_name ? namelen : 0;
+	rec.path_len = define_path ? pathlen : 0;
+	rec.size = sizeof(rec) + rec.name_len + rec.path_len;
+
+	memcpy(darwintrace_buf, &rec, sizeof(rec));
+	memcpy(darwintrace_buf + sizeof(rec), procname, rec.name_len);
+	memcpy(darwintrace_buf + sizeof(rec) + rec.name_len, path, rec.path_len);
+	darwintrace_emit(darwintrace_buf, rec.size);
+}
+
 /* darwintrace_setup must have been called already */
-static inline void darwintrace_logpath(int fd, const char *procname, char *tag, const char *path) {
-	if (darwintrace_ignores) {
-		for (int i=0; i < 4; i++) {
-			if (darwintrace_ignores[i]
-				&& strncmp(darwintrace_ignores[i], path, darwintrace_ignore_lens[i]) == 0) {
-				return;
-			}
-		}
+static inline void darwintrace_logpath(int fd, const char *procname, int op, const char *path) {
+	const char *tag = darwintrace_op_name(op);
+	if (darwintrace_ignore_roots && darwintrace_prefix_match(path, DARWINTRACE_PREFIX_IGNORE)) {
+		return;
+	}
+	if (darwintrace_dedup && darwintrace_already_seen(tag, path)) {
+		return;
+	}
+	if (darwintrace_binary) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		darwintrace_log_binary(procname ? procname : darwintrace_progname, op, path,
+							   (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+		return;
 	}
 	size_t size;
 	char pidstr_bytes[16];
 	char *pidstr = &pidstr_bytes[sizeof(pidstr_bytes)-1];
-	char darwintrace_buf[DARWINTRACE_BUFFER_SIZE];
+	/* room for the longest name and path, so records aren't truncated */
+	char darwintrace_buf[DARWINTRACE_BUFFER_SIZE + MAXPATHLEN + 64];
 
 	pid_t pid = darwintrace_pid;
 	*pidstr = 0;
@@ -252,7 +808,58 @@ static inline void darwintrace_logpath(int fd, const char *procname, char *tag,
 	size = strlcat(darwintrace_buf, "\t", sizeof(darwintrace_buf));
 	size = strlcat(darwintrace_buf, path, sizeof(darwintrace_buf));
 	size = strlcat(darwintrace_buf, "\n", sizeof(darwintrace_buf));
-	write(fd, darwintrace_buf, size);
+	if (size >= sizeof(darwintrace_buf)) {
+		/* truncated, but still a whole line */
+		size = sizeof(darwintrace_buf) - 1;
+		darwintrace_buf[size - 1] = '\n';
+	}
+	darwintrace_emit(darwintrace_buf, size);
+}
+
+/* microseconds since some fixed point in the past, for profiling */
+static uint64_t darwintrace_monotonic(void) {
+#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0) mach_timebase_info(&timebase);
+	return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * Logs the start or exit of this process image.  These are never
+ * suppressed, and go straight to the log so that they survive _exit(2).
+ */
+static void darwintrace_log_process(int op) {
+	char path[MAXPATHLEN];
+	uint64_t now = darwintrace_monotonic();
+
+	if (op == DARWINTRACE_OP_START) {
+		strlcpy(path, darwintrace_exe_path, sizeof(path));
+	} else if (darwintrace_exit_status >= 0) {
+		snprintf(path, sizeof(path), "%d", darwintrace_exit_status);
+	} else {
+		strlcpy(path, "?", sizeof(path));
+	}
+
+	if (darwintrace_binary) {
+		darwintrace_log_binary(darwintrace_progname, op, path, now);
+	} else {
+		char darwintrace_buf[DARWINTRACE_BUFFER_SIZE + MAXPATHLEN + 96];
+		int size = snprintf(darwintrace_buf, sizeof(darwintrace_buf), "%s[%d]\t%s\t%d\t%llu\t%s\n",
+							darwintrace_progname, (int)darwintrace_pid, darwintrace_op_name(op),
+							(int)darwintrace_ppid, (unsigned long long)now, path);
+		if (size < 0) return;
+		if ((size_t)size >= sizeof(darwintrace_buf)) {
+			size = sizeof(darwintrace_buf) - 1;
+			darwintrace_buf[size - 1] = '\n';
+		}
+		darwintrace_emit(darwintrace_buf, size);
+	}
+	if (darwintrace_buffered) darwintrace_flush_all();
 }
 
 /* remap resource fork access to the data fork.
@@ -265,6 +872,7 @@ static inline void darwintrace_cleanup_path(char *path) {
 
 	/* if this is a foo/..namedfork/rsrc, strip it off */
 	pathlen = strlen(path);
+#ifdef _PATH_RSRCFORKSPEC
 	rsrclen = strlen(_PATH_RSRCFORKSPEC);
 	if(pathlen > rsrclen
 	   && 0 == strncmp(path + pathlen - rsrclen,
@@ -272,6 +880,9 @@ static inline void darwintrace_cleanup_path(char *path) {
 		   path[pathlen - rsrclen] = '\0';
 		   pathlen -= rsrclen;
 	   }
+#else
+	(void)rsrclen;
+#endif
 
 	/* for each position in string (including
 	 terminal \0), check if we're in a run of
@@ -298,23 +909,60 @@ static inline void darwintrace_cleanup_path(char *path) {
 	dprintf("darwintrace: cleanup resulted in %s\n", path);
 }
 
+/* F_GETPATH: the path of the file open as fd, realpath is MAXPATHLEN long */
+static int darwintrace_getpath(int fd, char *realpath) {
+#ifdef __APPLE__
+	return fcntl(fd, F_GETPATH, realpath);
+#else
+	char procpath[32];
+	ssize_t len;
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+	len = DARWINTRACE_REAL(readlink)(procpath, realpath, MAXPATHLEN - 1);
+	if (len < 0) return -1;
+	realpath[len] = 0;
+	return 0;
+#endif
+}
+
+/* log path, relative to dirfd unless that is negative or AT_FDCWD */
+static void darwintrace_log_at(int op, int dirfd, const char* path) {
+	darwintrace_setup();
+	if (darwintrace_fd >= 0 && *path) {
+		char realpath[MAXPATHLEN];
+		size_t len = 0;
+
+		dprintf("darwintrace: original %s path is %s\n", darwintrace_op_name(op), path);
+
+		if (path[0] != '/' && dirfd >= 0
+			&& darwintrace_getpath(dirfd, realpath) == 0) {
+			len = strlcat(realpath, "/", sizeof(realpath));
+		} else {
+			realpath[0] = 0;
+		}
+		if (len >= sizeof(realpath)
+			|| strlcat(realpath, path, sizeof(realpath)) >= sizeof(realpath)) {
+			dprintf("darwintrace: in %s: path too long to copy: %s\n", darwintrace_op_name(op), path);
+		}
+
+		darwintrace_cleanup_path(realpath);
+		darwintrace_logpath(darwintrace_fd, NULL, op, realpath);
+	}
+}
+
+/* probes are cheap and frequent, so only look further if they're logged */
+static inline void darwintrace_log_probe(bool success, int op, int dirfd, const char* path) {
+	if (success && darwintrace_probes) {
+		darwintrace_log_at(op, dirfd, path);
+	}
+}
+
 /* 
  Only logs files where the open succeeds.
  Only logs files opened for read access, without the O_CREAT flag set.
  The assumption is that any file that can be created isn't necessary
  to build the project.
  */
-int darwintrace_open(const char* path, int flags, ...) {
-	mode_t mode;
-	int result;
-	va_list args;
-
-	char* redirpath = darwintrace_redirect_path(path);
-
-	va_start(args, flags);
-	mode = va_arg(args, int);
-	va_end(args);
-	result = open(redirpath, flags, mode);
+static void darwintrace_log_open(int result, const char* redirpath, int flags) {
 	if (result >= 0 && (flags & (O_CREAT | O_WRONLY)) == 0 ) {
 		darwintrace_setup();
 		if (darwintrace_fd >= 0) {
@@ -333,7 +981,7 @@ int darwintrace_open(const char* path, int flags, ...) {
 			}
 
 			if(usegetpath) {
-				if(0 == fcntl(result, F_GETPATH, realpath)) {
+				if(0 == darwintrace_getpath(result, realpath)) {
 					dprintf("darwintrace: resolved %s to %s\n", redirpath, realpath);
 				} else {
 					/* use original path */
@@ -349,11 +997,25 @@ int darwintrace_open(const char* path, int flags, ...) {
 			}
 
 			darwintrace_cleanup_path(realpath);
-			darwintrace_logpath(darwintrace_fd, NULL, "open", realpath);
+			darwintrace_logpath(darwintrace_fd, NULL, DARWINTRACE_OP_OPEN, realpath);
 		}
 	}
+}
 
-	darwintrace_free_path(redirpath, path);
+int darwintrace_open(const char* path, int flags, ...) {
+	mode_t mode;
+	int result;
+	va_list args;
+
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+
+	va_start(args, flags);
+	mode = va_arg(args, int);
+	va_end(args);
+	result = DARWINTRACE_REAL(open)(redirpath, flags, mode);
+	darwintrace_log_open(result, redirpath, flags);
 	return result;
 }
 DARWINTRACE_INTERPOSE(darwintrace_open, open);
@@ -369,111 +1031,239 @@ DARWINTRACE_INTERPOSE(darwintrace_open, __open_nocancel);
 ssize_t darwintrace_readlink(const char * path, char * buf, size_t bufsiz) {
 	ssize_t result;
 
-	char* redirpath = darwintrace_redirect_path(path);
-	result = readlink(redirpath, buf, bufsiz);
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(readlink)(redirpath, buf, bufsiz);
 	if (result >= 0) {
-		darwintrace_setup();
-		if (darwintrace_fd >= 0) {
-			char realpath[MAXPATHLEN];
+		darwintrace_log_at(DARWINTRACE_OP_READLINK, -1, redirpath);
+	}
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_readlink, readlink);
 
-			dprintf("darwintrace: original readlink path is %s\n", redirpath);
+/*
+ Probes are only logged with DARWINTRACE_PROBES, and only when they
+ succeed: a file that isn't there can't be a dependency.
+ */
+#if !DARWINTRACE_XSTAT
+int darwintrace_stat(const char* path, struct stat* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(stat)(redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_stat, stat);
 
-			if (strlcpy(realpath, redirpath, sizeof(realpath)) >= sizeof(realpath)) {
-				dprintf("darwintrace: in readlink: path too long to copy: %s\n", redirpath);
-			}
+int darwintrace_lstat(const char* path, struct stat* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(lstat)(redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_lstat, lstat);
+#endif
 
-			darwintrace_cleanup_path(realpath);
-			darwintrace_logpath(darwintrace_fd, NULL, "readlink", realpath);
-		}
+int darwintrace_access(const char* path, int mode) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(access)(redirpath, mode);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_ACCESS, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_access, access);
+
+DIR* darwintrace_opendir(const char* path) {
+	DIR* result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return NULL;
+	result = DARWINTRACE_REAL(opendir)(redirpath);
+	darwintrace_log_probe(result != NULL, DARWINTRACE_OP_OPENDIR, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_opendir, opendir);
+
+#if DARWINTRACE_AT_CALLS
+/* relative paths aren't redirected, the log has the full path anyway */
+int darwintrace_openat(int dirfd, const char* path, int flags, ...) {
+	mode_t mode;
+	int result;
+	va_list args;
+
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+
+	va_start(args, flags);
+	mode = va_arg(args, int);
+	va_end(args);
+	result = DARWINTRACE_REAL(openat)(dirfd, redirpath, flags, mode);
+	darwintrace_log_open(result, redirpath, flags);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_openat, openat);
+
+/* 
+ Only logs links where the readlinkat succeeds, relative to dirfd if
+ that isn't the working directory.
+ */
+ssize_t darwintrace_readlinkat(int dirfd, const char * path, char * buf, size_t bufsiz) {
+	ssize_t result;
+
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(readlinkat)(dirfd, redirpath, buf, bufsiz);
+	if (result >= 0) {
+		darwintrace_log_at(DARWINTRACE_OP_READLINK, dirfd, redirpath);
 	}
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_readlinkat, readlinkat);
 
-	darwintrace_free_path(redirpath, path);
+#if !DARWINTRACE_XSTAT
+int darwintrace_fstatat(int dirfd, const char* path, struct stat* sb, int flags) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(fstatat)(dirfd, redirpath, sb, flags);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, dirfd, redirpath);
 	return result;
 }
-DARWINTRACE_INTERPOSE(darwintrace_readlink, readlink);
+DARWINTRACE_INTERPOSE(darwintrace_fstatat, fstatat);
+#endif
+
+int darwintrace_faccessat(int dirfd, const char* path, int mode, int flags) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(faccessat)(dirfd, redirpath, mode, flags);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_ACCESS, dirfd, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_faccessat, faccessat);
+#endif
 
 static inline int has_prefix(const char *s, const char *p) {
 	return (strncmp(s, p, strlen(p)) == 0);
 }
 
+/*
+ * The environment passed on exec, kept on the caller's stack. Only an
+ * environment of more than DARWINTRACE_ENVIRON_SIZE variables, or other
+ * inserted libraries too long for preload_buf, is allocated.
+ */
+#define DARWINTRACE_ENVIRON_SIZE 256
+
+struct darwintrace_environ {
+	char **envp;
+	char *preload;
+	char *envp_buf[DARWINTRACE_ENVIRON_SIZE];
+	char preload_buf[MAXPATHLEN];
+};
+
 /* force the values of several environment variables */
-static char *const *darwintrace_make_environ(char *const envp[]) {
+static char *const *darwintrace_make_environ(struct darwintrace_environ *env, char *const envp[]) {
 	static const char *DARWINTRACE_IGNORE_ROOTS = "DARWINTRACE_IGNORE_ROOTS=";
-	static const char *DYLD_INSERT_LIBRARIES = "DYLD_INSERT_LIBRARIES=";
+	static const char *LIBRARY_PRELOAD = DARWINTRACE_PRELOAD "=";
 	static const char *DARWINTRACE_LOG = "DARWINTRACE_LOG=";
 	static const char *DARWINTRACE_PLACEHOLDER = "__DARWINTRACE_PLACEHOLDER=UNUSED";
 
 	char **result = NULL;
 	char *libs = NULL;
 	int count = 0;
+	size_t j;
+
+	env->envp = NULL;
+	env->preload = NULL;
 
 	/* count the environment variables */
 	if (envp) {
 		while (envp[count] != NULL) {
-			if (has_prefix(envp[count], DYLD_INSERT_LIBRARIES)) {
-				libs = envp[count] + strlen(DYLD_INSERT_LIBRARIES);
+			if (has_prefix(envp[count], LIBRARY_PRELOAD)) {
+				libs = envp[count];
 			}
 			++count;
 		}
 	}
 
-	/* allocate size of envp with enough space for three more values and NULL */
-	result = (char **)calloc(count + 4, sizeof(char *));
-	if (result != NULL) {
-		int i = 0;
+	/* size of envp with enough space for the forced values and NULL */
+	size_t forced = 3 + DARWINTRACE_SWITCHES;
+	if (count + forced + 1 <= DARWINTRACE_ENVIRON_SIZE) {
+		result = env->envp_buf;
+	} else {
+		result = env->envp = (char **)malloc((count + forced + 1) * sizeof(char *));
+		if (result == NULL) return envp;
+	}
 
-		if (darwintrace_log_path) {
-			asprintf(&result[i], "%s%s", DARWINTRACE_LOG, darwintrace_log_path);
-		} else {
-			result[i] = strdup(DARWINTRACE_PLACEHOLDER);
-		}
-		++i;
+	int i = 0;
 
-		if (darwintrace_ignores) {
-			asprintf(&result[i], "%s%s", DARWINTRACE_IGNORE_ROOTS, "1");
-		} else {
-			result[i] = strdup(DARWINTRACE_PLACEHOLDER);
-		}
-		++i;
+	result[i++] = darwintrace_env_log ? darwintrace_env_log : (char *)DARWINTRACE_PLACEHOLDER;
+	result[i++] = darwintrace_ignore_roots ? "DARWINTRACE_IGNORE_ROOTS=1" : (char *)DARWINTRACE_PLACEHOLDER;
+	for (j = 0; j < DARWINTRACE_SWITCHES; j++) {
+		result[i++] = darwintrace_env_switches[j] ? darwintrace_env_switches[j] : (char *)DARWINTRACE_PLACEHOLDER;
+	}
 
-		if (darwintrace_dylib_path) {
-			if (libs && strstr(libs, darwintrace_dylib_path)) {
-				/* inserted libraries already contain dylib */
-				asprintf(&result[i], "%s%s",
-						 DYLD_INSERT_LIBRARIES, libs);
-			} else {
-				/* otherwise set or insert the dylib path */
-				asprintf(&result[i], "%s%s%s%s",
-						 DYLD_INSERT_LIBRARIES, darwintrace_dylib_path,
-						 libs ? ":" : "", libs ? libs : "");
-			}
+	if (darwintrace_env_preload == NULL) {
+		result[i] = (char *)DARWINTRACE_PLACEHOLDER;
+	} else if (libs == NULL) {
+		result[i] = darwintrace_env_preload;
+	} else if (strstr(libs + strlen(LIBRARY_PRELOAD), darwintrace_dylib_path)) {
+		/* inserted libraries already contain dylib */
+		result[i] = libs;
+	} else {
+		/* otherwise insert the dylib path */
+		const char *fmt = "%s:%s";
+		libs += strlen(LIBRARY_PRELOAD);
+		if (snprintf(env->preload_buf, sizeof(env->preload_buf), fmt,
+					 darwintrace_env_preload, libs) < (int)sizeof(env->preload_buf)) {
+			result[i] = env->preload_buf;
+		} else if (asprintf(&env->preload, fmt, darwintrace_env_preload, libs) >= 0) {
+			result[i] = env->preload;
 		} else {
-			result[i] = strdup(DARWINTRACE_PLACEHOLDER);
+			env->preload = NULL;
+			result[i] = darwintrace_env_preload;
 		}
-		++i;
+	}
+	++i;
 
-		if (envp) {
-			memcpy(&result[i], envp, count * sizeof(char *));
-		}
+	if (envp) {
+		memcpy(&result[i], envp, count * sizeof(char *));
+	}
+	result[i + count] = NULL;
 
-		while (result[i] != NULL) {
-			if (has_prefix(result[i], DARWINTRACE_IGNORE_ROOTS) ||
-				has_prefix(result[i], DYLD_INSERT_LIBRARIES) ||
-				has_prefix(result[i], DARWINTRACE_LOG)) {
+	while (result[i] != NULL) {
+		if (has_prefix(result[i], DARWINTRACE_IGNORE_ROOTS) ||
+			has_prefix(result[i], LIBRARY_PRELOAD) ||
+			has_prefix(result[i], DARWINTRACE_LOG)) {
+			result[i] = (char *)DARWINTRACE_PLACEHOLDER;
+		}
+		for (j = 0; j < DARWINTRACE_SWITCHES; j++) {
+			size_t len = strlen(darwintrace_switches[j]);
+			if (strncmp(result[i], darwintrace_switches[j], len) == 0 && result[i][len] == '=') {
 				result[i] = (char *)DARWINTRACE_PLACEHOLDER;
 			}
-			++i;
 		}
+		++i;
 	}
 
 	return result;
 }
 
-static void darwintrace_free_environ(char *const envp[]) {
-	free(envp[0]);
-	free(envp[1]);
-	free(envp[2]);
-	free((char*)envp);
+static void darwintrace_free_environ(struct darwintrace_environ *env) {
+	free(env->envp);
+	free(env->preload);
 }
 
 static void darwintrace_log_exec(const char* redirpath, char* const argv[]) {
@@ -518,10 +1308,10 @@ static void darwintrace_log_exec(const char* redirpath, char* const argv[]) {
 				}
 
 				darwintrace_cleanup_path(realpath);
-				darwintrace_logpath(darwintrace_fd, NULL, "execve", realpath);
+				darwintrace_logpath(darwintrace_fd, NULL, DARWINTRACE_OP_EXECVE, realpath);
 			}
 
-			fd = open(redirpath, O_RDONLY, 0);
+			fd = DARWINTRACE_REAL(open)(redirpath, O_RDONLY, 0);
 			if (fd != -1) {
 
 				char buffer[MAXPATHLEN];
@@ -531,7 +1321,7 @@ static void darwintrace_log_exec(const char* redirpath, char* const argv[]) {
 				if(printreal) {
 
 					if(usegetpath) {
-						if(0 == fcntl(fd, F_GETPATH, realpath)) {
+						if(0 == darwintrace_getpath(fd, realpath)) {
 							dprintf("darwintrace: resolved execve path %s to %s\n", redirpath, realpath);
 						} else {
 							dprintf("darwintrace: failed to resolve %s\n", redirpath);
@@ -546,7 +1336,7 @@ static void darwintrace_log_exec(const char* redirpath, char* const argv[]) {
 					}
 
 					darwintrace_cleanup_path(realpath);
-					darwintrace_logpath(darwintrace_fd, NULL, "execve", realpath);
+					darwintrace_logpath(darwintrace_fd, NULL, DARWINTRACE_OP_EXECVE, realpath);
 				}
 
 				bzero(buffer, sizeof(buffer));
@@ -586,7 +1376,7 @@ static void darwintrace_log_exec(const char* redirpath, char* const argv[]) {
 						}
 
 						darwintrace_cleanup_path(interp);
-						darwintrace_logpath(darwintrace_fd, procname, "execve", interp);
+						darwintrace_logpath(darwintrace_fd, procname, DARWINTRACE_OP_EXECVE, interp);
 					}
 				}
 
@@ -598,12 +1388,15 @@ static void darwintrace_log_exec(const char* redirpath, char* const argv[]) {
 
 int darwintrace_execve(const char* path, char* const argv[], char* const envp[]) {
 	int result;
-	char* redirpath = darwintrace_redirect_path(path);
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
 	darwintrace_log_exec(redirpath, argv);
-	char *const *new_envp = darwintrace_make_environ(envp);
-	result = execve(redirpath, argv, new_envp);
-	darwintrace_free_environ(new_envp);
-	darwintrace_free_path(redirpath, path);
+	if (darwintrace_buffered) darwintrace_flush_all();
+	struct darwintrace_environ env;
+	char *const *new_envp = darwintrace_make_environ(&env, envp);
+	result = DARWINTRACE_REAL(execve)(redirpath, argv, new_envp);
+	darwintrace_free_environ(&env);
 	return result;
 }
 DARWINTRACE_INTERPOSE(darwintrace_execve, execve);
@@ -621,17 +1414,312 @@ int darwintrace_posix_spawn(pid_t * __restrict pid,
 							char *const argv[__restrict],
 							char *const envp[__restrict]) {
 	int result;
-	char* redirpath = darwintrace_redirect_path(path);
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return errno;
 	darwintrace_log_exec(redirpath, argv);
-	char *const *new_envp = darwintrace_make_environ(envp);
+	if (darwintrace_buffered) darwintrace_flush_all();
+	struct darwintrace_environ env;
+	char *const *new_envp = darwintrace_make_environ(&env, envp);
 	result = __posix_spawn(pid, redirpath, desc, argv, new_envp);
-	darwintrace_free_environ(new_envp);
-	darwintrace_free_path(redirpath, path);
+	darwintrace_free_environ(&env);
 	return result;
 }
 DARWINTRACE_INTERPOSE(darwintrace_posix_spawn, __posix_spawn);
 #endif
 
+/* the exit record is written by darwintrace_fini */
+void darwintrace_exit(int status) {
+	darwintrace_exit_status = status & 0377;
+	DARWINTRACE_REAL(exit)(status);
+	__builtin_unreachable();
+}
+DARWINTRACE_INTERPOSE(darwintrace_exit, exit);
+
+/*
+ _exit(2) skips the destructors, so write the exit record here, and
+ flush the buffers whether or not we're profiling.
+ */
+void darwintrace__exit(int status) {
+	if (darwintrace_profile) {
+		darwintrace_exit_status = status & 0377;
+		darwintrace_log_process(DARWINTRACE_OP_EXIT);
+		darwintrace_profile = false;
+	}
+	if (darwintrace_buffered) darwintrace_flush_all();
+	DARWINTRACE_REAL(_exit)(status);
+	__builtin_unreachable();
+}
+DARWINTRACE_INTERPOSE(darwintrace__exit, _exit);
+
+#ifdef __linux__
+/*
+ glibc calls exit(3) internally when main returns, so wrap main to see
+ the status of programs that don't call exit themselves.
+ */
+extern int __libc_start_main(int (*main)(int, char**, char**), int argc, char** argv,
+							 void (*init)(void), void (*fini)(void),
+							 void (*rtld_fini)(void), void* stack_end);
+
+static int (*darwintrace_main)(int, char**, char**);
+
+static int darwintrace_main_wrapper(int argc, char** argv, char** envp) {
+	int result = darwintrace_main(argc, argv, envp);
+	darwintrace_exit_status = result & 0377;
+	return result;
+}
+
+int darwintrace___libc_start_main(int (*main)(int, char**, char**), int argc, char** argv,
+								  void (*init)(void), void (*fini)(void),
+								  void (*rtld_fini)(void), void* stack_end) {
+	darwintrace_main = main;
+	return DARWINTRACE_REAL(__libc_start_main)(&darwintrace_main_wrapper, argc, argv,
+											   init, fini, rtld_fini, stack_end);
+}
+DARWINTRACE_INTERPOSE(darwintrace___libc_start_main, __libc_start_main);
+
+/*
+ glibc calls its own internal entry points, so none of the calls above
+ sees the large-file variants, fopen(3) or the exec family; interpose
+ the ones that matter for dependencies directly.
+ */
+int darwintrace_open64(const char* path, int flags, ...) {
+	mode_t mode;
+	int result;
+	va_list args;
+
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+
+	va_start(args, flags);
+	mode = va_arg(args, int);
+	va_end(args);
+	result = DARWINTRACE_REAL(open64)(redirpath, flags, mode);
+	darwintrace_log_open(result, redirpath, flags);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_open64, open64);
+
+static inline int darwintrace_fopen_flags(const char* mode) {
+	return (mode[0] == 'r' && strchr(mode, '+') == NULL) ? O_RDONLY : O_WRONLY;
+}
+
+FILE* darwintrace_fopen(const char* path, const char* mode) {
+	FILE* result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return NULL;
+	result = DARWINTRACE_REAL(fopen)(redirpath, mode);
+	if (result != NULL) {
+		darwintrace_log_open(fileno(result), redirpath, darwintrace_fopen_flags(mode));
+	}
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_fopen, fopen);
+
+FILE* darwintrace_fopen64(const char* path, const char* mode) {
+	FILE* result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return NULL;
+	result = DARWINTRACE_REAL(fopen64)(redirpath, mode);
+	if (result != NULL) {
+		darwintrace_log_open(fileno(result), redirpath, darwintrace_fopen_flags(mode));
+	}
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_fopen64, fopen64);
+
+#if DARWINTRACE_XSTAT
+int darwintrace___xstat(int ver, const char* path, struct stat* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(__xstat)(ver, redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace___xstat, __xstat);
+
+int darwintrace___lxstat(int ver, const char* path, struct stat* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(__lxstat)(ver, redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace___lxstat, __lxstat);
+
+int darwintrace___fxstatat(int ver, int dirfd, const char* path, struct stat* sb, int flags) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(__fxstatat)(ver, dirfd, redirpath, sb, flags);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, dirfd, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace___fxstatat, __fxstatat);
+
+int darwintrace___xstat64(int ver, const char* path, struct stat64* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(__xstat64)(ver, redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace___xstat64, __xstat64);
+
+int darwintrace___lxstat64(int ver, const char* path, struct stat64* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(__lxstat64)(ver, redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace___lxstat64, __lxstat64);
+
+int darwintrace___fxstatat64(int ver, int dirfd, const char* path, struct stat64* sb, int flags) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(__fxstatat64)(ver, dirfd, redirpath, sb, flags);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, dirfd, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace___fxstatat64, __fxstatat64);
+#else
+int darwintrace_stat64(const char* path, struct stat64* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(stat64)(redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_stat64, stat64);
+
+int darwintrace_lstat64(const char* path, struct stat64* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(lstat64)(redirpath, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, -1, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_lstat64, lstat64);
+
+int darwintrace_fstatat64(int dirfd, const char* path, struct stat64* sb, int flags) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(fstatat64)(dirfd, redirpath, sb, flags);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, dirfd, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_fstatat64, fstatat64);
+#endif
+
+#if __GLIBC_PREREQ(2, 28)
+/* coreutils and friends use statx(2) where it's available */
+int darwintrace_statx(int dirfd, const char* path, int flags, unsigned int mask, struct statx* sb) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return -1;
+	result = DARWINTRACE_REAL(statx)(dirfd, redirpath, flags, mask, sb);
+	darwintrace_log_probe(result == 0, DARWINTRACE_OP_STAT, dirfd, redirpath);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_statx, statx);
+#endif
+
+
+int darwintrace_execv(const char* path, char* const argv[]) {
+	return darwintrace_execve(path, argv, environ);
+}
+DARWINTRACE_INTERPOSE(darwintrace_execv, execv);
+
+/* search PATH like execvp(3) does, to find what is going to be run */
+static int darwintrace_search_path(const char* file, char* result) {
+	const char* dir = getenv("PATH");
+	if (dir == NULL) dir = "/bin:/usr/bin";
+	while (*dir) {
+		const char* end = strchr(dir, ':');
+		size_t len = end ? (size_t)(end - dir) : strlen(dir);
+		if (snprintf(result, MAXPATHLEN, "%.*s%s%s", (int)len, dir,
+					 len ? "/" : "", file) < MAXPATHLEN
+			&& access(result, X_OK) == 0) {
+			return 0;
+		}
+		dir += len;
+		if (*dir == ':') ++dir;
+	}
+	return -1;
+}
+
+int darwintrace_execvp(const char* file, char* const argv[]) {
+	int result;
+	char path[MAXPATHLEN];
+
+	if (strchr(file, '/') != NULL) {
+		return darwintrace_execve(file, argv, environ);
+	}
+	if (*file == 0 || darwintrace_search_path(file, path) != 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	result = darwintrace_execve(path, argv, environ);
+	if (errno == ENOEXEC) {
+		/* not a binary and no #!, run it with the shell like execvp(3) */
+		int argc = 0;
+		while (argv[argc] != NULL) ++argc;
+		char** shargv = calloc(argc + 2, sizeof(char*));
+		if (shargv != NULL) {
+			shargv[0] = "sh";
+			shargv[1] = path;
+			if (argc > 1) memcpy(&shargv[2], &argv[1], (argc - 1) * sizeof(char*));
+			result = darwintrace_execve(_PATH_BSHELL, shargv, environ);
+			free(shargv);
+		}
+	}
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_execvp, execvp);
+
+int darwintrace_posix_spawn(pid_t * __restrict pid,
+							const char * __restrict path,
+							const posix_spawn_file_actions_t * __restrict file_actions,
+							const posix_spawnattr_t * __restrict attrp,
+							char *const argv[__restrict],
+							char *const envp[__restrict]) {
+	int result;
+	char redirbuf[MAXPATHLEN];
+	char* redirpath = darwintrace_redirect_path(path, redirbuf);
+	if (redirpath == NULL) return errno;
+	darwintrace_log_exec(redirpath, argv);
+	if (darwintrace_buffered) darwintrace_flush_all();
+	struct darwintrace_environ env;
+	char *const *new_envp = darwintrace_make_environ(&env, envp);
+	result = DARWINTRACE_REAL(posix_spawn)(pid, redirpath, file_actions, attrp, argv, new_envp);
+	darwintrace_free_environ(&env);
+	return result;
+}
+DARWINTRACE_INTERPOSE(darwintrace_posix_spawn, posix_spawn);
+#endif
+
 /* 
  if darwintrace has been initialized, trap
  attempts to close our file descriptor
@@ -642,9 +1730,28 @@ int darwintrace_close(int fd) {
 		return -1;
 	}
 
-	return close(fd);
+	return DARWINTRACE_REAL(close)(fd);
 }
 DARWINTRACE_INTERPOSE(darwintrace_close, close);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+/* close the range around our file descriptor */
+int darwintrace_close_range(unsigned int first, unsigned int last, int flags) {
+	int result;
+	if (darwintrace_fd >= 0 && (unsigned int)darwintrace_fd >= first
+		&& (unsigned int)darwintrace_fd <= last) {
+		result = 0;
+		if ((unsigned int)darwintrace_fd > first) {
+			result = DARWINTRACE_REAL(close_range)(first, darwintrace_fd - 1, flags);
+		}
+		if (result == 0 && (unsigned int)darwintrace_fd < last) {
+			result = DARWINTRACE_REAL(close_range)(darwintrace_fd + 1, last, flags);
+		}
+		return result;
+	}
+	return DARWINTRACE_REAL(close_range)(first, last, flags);
+}
+DARWINTRACE_INTERPOSE(darwintrace_close_range, close_range);
+#endif
 #if LION_OR_LATER
 extern int __close_nocancel(int);
 DARWINTRACE_INTERPOSE(darwintrace_close, __close_nocancel);
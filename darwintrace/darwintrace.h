@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef __DARWINTRACE_H__
+#define __DARWINTRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Binary trace format, written when DARWINTRACE_BINARY is set and the log
+ * is empty.  The log starts with a file header, followed by records in
+ * host byte order.  Each record is a fixed header, then name_len bytes of
+ * process name and path_len bytes of path, neither NUL-terminated.
+ *
+ * Strings repeat a lot, so each thread of each process keeps a table of
+ * the strings it has written.  A string is written out once along with a
+ * non-zero id (a definition); later records leave the length at zero and
+ * refer to the id instead.  Ids are scoped by (pid, tid), and a later
+ * definition of the same id replaces the earlier one.  An id of zero with
+ * a non-zero length is a string that isn't kept in any table.  The tid is
+ * the low 32 bits of the thread id.
+ *
+ * Concurrent processes may each write a file header; readers skip them.
+ *
+ * The start and exit records written with DARWINTRACE_PROFILE describe
+ * processes rather than files.  Their timestamp is from a monotonic clock
+ * instead, the path of a start record is the executable, and the path of
+ * an exit record is the exit status in decimal, or "?" if it is unknown.
+ * In the text format they are written as name[pid]\top\tppid\tusec\tpath.
+ */
+
+#define DARWINTRACE_MAGIC "DTRB"
+#define DARWINTRACE_VERSION 1
+
+struct darwintrace_file_header {
+	char magic[4];
+	uint32_t version;
+};
+
+enum {
+	DARWINTRACE_OP_OPEN = 1,
+	DARWINTRACE_OP_READLINK,
+	DARWINTRACE_OP_EXECVE,
+	DARWINTRACE_OP_STAT,		/* stat(2) and lstat(2) probes */
+	DARWINTRACE_OP_ACCESS,
+	DARWINTRACE_OP_OPENDIR,
+	DARWINTRACE_OP_START,		/* process records, see above */
+	DARWINTRACE_OP_EXIT,
+	DARWINTRACE_OP_COUNT
+};
+
+struct darwintrace_record {
+	uint16_t size;		/* of the record, including name and path */
+	uint8_t op;
+	uint8_t flags;		/* reserved, zero */
+	int32_t pid;
+	int32_t ppid;
+	uint32_t tid;
+	uint64_t timestamp;	/* microseconds since the epoch */
+	uint16_t name_id;
+	uint16_t name_len;
+	uint16_t path_id;
+	uint16_t path_len;
+};
+
+static inline const char *darwintrace_op_name(unsigned int op) {
+	static const char *names[DARWINTRACE_OP_COUNT] = {
+		NULL,
+		"open",
+		"readlink",
+		"execve",
+		"stat",
+		"access",
+		"opendir",
+		"start",
+		"exit",
+	};
+	return op < DARWINTRACE_OP_COUNT ? names[op] : NULL;
+}
+
+#define DARWINTRACE_OP_PROCESS(op) ((op) == DARWINTRACE_OP_START || (op) == DARWINTRACE_OP_EXIT)
+
+/*
+ * Reader for the binary format.  Definitions are kept in a single open
+ * addressing table keyed by (pid, tid, id).
+ */
+struct darwintrace_string {
+	int32_t pid;
+	uint32_t tid;
+	uint32_t id;
+	char *str;		/* NULL if the slot is empty */
+};
+
+struct darwintrace_reader {
+	FILE *fp;
+	struct darwintrace_string *strings;
+	size_t count;
+	size_t nbuckets;
+	char *buf[2];		/* name and path of the current record */
+	size_t bufsize[2];
+};
+
+static inline void darwintrace_reader_init(struct darwintrace_reader *r, FILE *fp) {
+	memset(r, 0, sizeof(*r));
+	r->fp = fp;
+}
+
+static inline void darwintrace_reader_free(struct darwintrace_reader *r) {
+	size_t i;
+	for (i = 0; i < r->nbuckets; ++i) {
+		free(r->strings[i].str);
+	}
+	free(r->strings);
+	free(r->buf[0]);
+	free(r->buf[1]);
+}
+
+static inline size_t darwintrace_reader_bucket(struct darwintrace_reader *r, int32_t pid, uint32_t tid, uint32_t id) {
+	uint64_t h = ((uint64_t)(uint32_t)pid * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)tid * 0xC2B2AE3D27D4EB4FULL) ^ id;
+	size_t b = (size_t)(h ^ (h >> 29)) & (r->nbuckets - 1);
+	while (r->strings[b].str != NULL) {
+		struct darwintrace_string *s = &r->strings[b];
+		if (s->pid == pid && s->tid == tid && s->id == id) break;
+		b = (b + 1) & (r->nbuckets - 1);
+	}
+	return b;
+}
+
+static inline int darwintrace_reader_grow(struct darwintrace_reader *r) {
+	size_t i, n = r->nbuckets;
+	struct darwintrace_string *old = r->strings;
+	struct darwintrace_string *strings = calloc(n ? n * 2 : 1024, sizeof(*strings));
+	if (strings == NULL) return -1;
+	r->strings = strings;
+	r->nbuckets = n ? n * 2 : 1024;
+	for (i = 0; i < n; ++i) {
+		if (old[i].str) {
+			r->strings[darwintrace_reader_bucket(r, old[i].pid, old[i].tid, old[i].id)] = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static inline char *darwintrace_reader_buffer(struct darwintrace_reader *r, int which, size_t len) {
+	if (r->bufsize[which] < len + 1) {
+		char *buf = realloc(r->buf[which], len + 1);
+		if (buf == NULL) return NULL;
+		r->buf[which] = buf;
+		r->bufsize[which] = len + 1;
+	}
+	return r->buf[which];
+}
+
+/*
+ * Reads a string of the current record into buffer which, or copies it
+ * there from the table, since the next string may replace the definition.
+ */
+static inline const char *darwintrace_reader_string(struct darwintrace_reader *r, const struct darwintrace_record *rec, int which, uint32_t id, uint32_t len) {
+	if (len == 0 && id == 0) return "";
+	if (len == 0) {
+		if (r->nbuckets == 0) return NULL;
+		struct darwintrace_string *s = &r->strings[darwintrace_reader_bucket(r, rec->pid, rec->tid, id)];
+		if (s->str == NULL) return NULL;
+		len = strlen(s->str);
+		if (darwintrace_reader_buffer(r, which, len) == NULL) return NULL;
+		memcpy(r->buf[which], s->str, len + 1);
+		return r->buf[which];
+	}
+
+	if (darwintrace_reader_buffer(r, which, len) == NULL) return NULL;
+	if (fread(r->buf[which], 1, len, r->fp) != len) return NULL;
+	r->buf[which][len] = 0;
+
+	if (id != 0) {
+		if ((r->count + 1) * 2 > r->nbuckets && darwintrace_reader_grow(r) != 0) return NULL;
+		struct darwintrace_string *s = &r->strings[darwintrace_reader_bucket(r, rec->pid, rec->tid, id)];
+		char *str = strdup(r->buf[which]);
+		if (str == NULL) return NULL;
+		if (s->str == NULL) {
+			++r->count;
+		} else {
+			free(s->str);
+		}
+		s->pid = rec->pid;
+		s->tid = rec->tid;
+		s->id = id;
+		s->str = str;
+	}
+	return r->buf[which];
+}
+
+/*
+ * Reads the next record.  Returns 1 with *name and *path pointing at
+ * storage that is valid until the next call, 0 at the end of the log,
+ * or -1 if the log is malformed.
+ */
+static inline int darwintrace_read(struct darwintrace_reader *r, struct darwintrace_record *rec, const char **name, const char **path) {
+	/* the file header is as long as the start of a record, up to pid */
+	const size_t start = offsetof(struct darwintrace_record, pid);
+	for (;;) {
+		size_t n = fread(rec, 1, start, r->fp);
+		if (n == 0 && feof(r->fp)) return 0;
+		if (n != start) return -1;
+		if (memcmp(rec, DARWINTRACE_MAGIC, 4) != 0) break;
+
+		uint32_t version;
+		if (fread(&version, sizeof(version), 1, r->fp) != 1 || version != DARWINTRACE_VERSION) return -1;
+	}
+	if (fread((char *)rec + start, sizeof(*rec) - start, 1, r->fp) != 1) return -1;
+	if (rec->size != sizeof(*rec) + rec->name_len + rec->path_len) return -1;
+	*name = darwintrace_reader_string(r, rec, 0, rec->name_id, rec->name_len);
+	*path = darwintrace_reader_string(r, rec, 1, rec->path_id, rec->path_len);
+	return (*name && *path) ? 1 : -1;
+}
+
+#endif /* __DARWINTRACE_H__ */
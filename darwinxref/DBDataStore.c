@@ -223,6 +223,10 @@ int DBDataStoreInitialize(const char* datafile) {
 	if (res != SQLITE_OK) {
 		sqlite3_close(__DBDataStore);
 		__DBDataStore = NULL;
+	} else {
+		// Parallel darwinbuilds share the database; wait out each other's
+		// locks instead of failing with SQLITE_BUSY.
+		sqlite3_busy_timeout(__DBDataStore, 60000);
 	}
 
 	SQL_NOERR("CREATE TABLE properties (build TEXT, project TEXT, property TEXT, key TEXT, value TEXT)");
@@ -231,9 +235,44 @@ int DBDataStoreInitialize(const char* datafile) {
 	SQL_NOERR("CREATE TABLE groups (build TEXT, name TEXT, member TEXT)");
 	SQL_NOERR("CREATE INDEX groups_index ON groups (build, name, member)");
 
+	// Transitive dependencies, maintained by the closure plugin.
+	SQL_NOERR("CREATE TABLE dependency_closure (build TEXT, project TEXT, kind TEXT, dep TEXT, depth INTEGER, position INTEGER)");
+
+	// Digests of installed files, written by register, loadDeps and stale
+	// and reused while a file keeps its size and mtime.
+	SQL_NOERR("CREATE TABLE file_digests (build TEXT, path TEXT, size INTEGER, mtime INTEGER, digest TEXT)");
+	SQL_NOERR("CREATE UNIQUE INDEX file_digests_index ON file_digests (build, path)");
+
+	// The files each project read during its last traced build, from loadDeps.
+	SQL_NOERR("CREATE TABLE input_digests (build TEXT, project TEXT, path TEXT, size INTEGER, mtime INTEGER, digest TEXT)");
+	SQL_NOERR("CREATE INDEX input_digests_index ON input_digests (build, project)");
+	SQL_NOERR("CREATE INDEX dependency_closure_index ON dependency_closure (build, project, kind, depth, dep)");
+	SQL_NOERR("CREATE INDEX dependency_closure_dep_index ON dependency_closure (dep, build, kind, project)");
+
 	return 0;
 }
 
+//
+// Drops the parts of dependency_closure that a property change makes stale;
+// the closure plugin recomputes them the next time they are asked for.
+// A project's dependencies show up in the closure of every project that
+// reaches it, in its own build and in any build inheriting from it, so
+// those are dropped everywhere.  Every computed closure lists its own
+// project at depth 0, so one lookup on dep finds them all.  Changing a
+// build's inheritance can change anything.
+//
+static void _DBInvalidateDependencyClosure(const char* cproj, const char* cprop) {
+	if (cprop == NULL) return;
+	if (cproj && strcmp(cprop, "dependencies") == 0) {
+		SQL("DELETE FROM dependency_closure WHERE rowid IN "
+			"(SELECT d.rowid FROM dependency_closure AS c, dependency_closure AS d "
+			"WHERE c.dep=%Q AND d.build=c.build AND d.project=c.project)",
+			cproj);
+	} else if (cproj == NULL && strcmp(cprop, "inherits") == 0) {
+		SQL("DELETE FROM dependency_closure");
+	}
+}
+
 int DBHasBuild(CFStringRef build) {
 	char* cbuild = strdup_cfstr(build);
 	const char* sql = "SELECT 1 FROM properties WHERE build=%Q LIMIT 1";
@@ -593,6 +632,7 @@ int DBSetPropString(CFStringRef build, CFStringRef project, CFStringRef property
 		SQL("DELETE FROM properties WHERE build=%Q AND project IS NULL AND property=%Q", cbuild, cprop);
 		SQL("INSERT INTO properties (build,property,value) VALUES (%Q, %Q, %Q)", cbuild, cprop, cvalu);
 	}
+	_DBInvalidateDependencyClosure(cproj, cprop);
 	free(cbuild);
         free(cproj);
         free(cprop);
@@ -616,6 +656,7 @@ int DBSetPropData(CFStringRef build, CFStringRef project, CFStringRef property,
 		SQL("DELETE FROM properties WHERE build=%Q AND project IS NULL AND property=%Q", cbuild, cprop);
 		sql = "INSERT INTO properties (build,property,value) VALUES (?, ?, ?)";
 	}
+	_DBInvalidateDependencyClosure(cproj, cprop);
 
 	sqlite3_prepare(db, sql, -1, &stmt, NULL);
 	sqlite3_bind_text(stmt, i++, cbuild, -1, NULL);
@@ -642,6 +683,7 @@ int DBSetPropArray(CFStringRef build, CFStringRef project, CFStringRef property,
 	} else {
 		SQL("DELETE FROM properties WHERE build=%Q AND project IS NULL AND property=%Q", cbuild, cprop);
 	}
+	_DBInvalidateDependencyClosure(cproj, cprop);
 	CFIndex i, count = CFArrayGetCount(value);
 	for (i = 0; i < count; ++i) {
 		char* cvalu = strdup_cfstr(CFArrayGetValueAtIndex(value, i));
@@ -669,6 +711,7 @@ int DBSetPropDictionary(CFStringRef build, CFStringRef project, CFStringRef prop
 	} else {
 		SQL("DELETE FROM properties WHERE build=%Q AND project IS NULL AND property=%Q", cbuild, cprop);
 	}
+	_DBInvalidateDependencyClosure(cproj, cprop);
 
 	CFArrayRef keys = dictionaryGetSortedKeys(value);
 	CFIndex i, count = CFArrayGetCount(keys);
@@ -809,6 +852,9 @@ int DBSetPlist(CFStringRef buildParam, CFStringRef projectParam, CFPropertyListR
 			} else {
 				SQL("DELETE FROM properties WHERE build=%Q AND project IS NULL AND property=%Q", cbuild, cprop);
 			}
+			char* cproj = strdup_cfstr(project);
+			_DBInvalidateDependencyClosure(cproj, cprop);
+			free(cproj);
 			free(cbuild);
 			free(cprop);
 		}
@@ -908,6 +954,268 @@ int DBSetGroupMembers(CFStringRef build, CFStringRef group, CFArrayRef members)
 	return 0;
 }
 
+//
+// Transitive dependencies.
+//
+// dependency_closure holds, for each project and kind, every project reached
+// by following the project's dependencies the way "darwinxref dependencies"
+// does, along with the depth it was first reached at and its position in
+// the depth first order "dependencies" lists them in, which is the order
+// darwinbuild installs them in.  Each computed closure
+// also lists the project itself at depth 0, which marks it as present; the
+// setters above drop closures that a change makes stale, and they are
+// recomputed here on demand.
+//
+
+// The dependencies plugin describes the "+type" and "-type" entries.
+CFDictionaryRef DBCopyMergedDependencies(CFArrayRef builds, CFStringRef project) {
+	CFMutableDictionaryRef result = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	CFIndex i, count = CFArrayGetCount(builds);
+	
+	for (i = 0; i < count; ++i) {
+		CFStringRef build = CFArrayGetValueAtIndex(builds, i);
+		CFDictionaryRef deps = DBCopyOnePropDictionary(build, project, CFSTR("dependencies"));
+		if (deps == NULL) continue;
+		CFArrayRef keys = dictionaryGetSortedKeys(deps);
+		CFIndex k, kcount = CFArrayGetCount(keys);
+		// iterate through the array backwards, since we want to process these in the order:
+		// "foo", "-foo", "+foo".
+		for (k = kcount - 1; k >= 0; k--) {
+			CFStringRef key = CFArrayGetValueAtIndex(keys, k);
+			CFTypeRef value = CFDictionaryGetValue(deps, key);
+			CFArrayRef newdeps;
+			// if it's a single string, make it an array
+			if (CFGetTypeID(value) == CFStringGetTypeID()) {
+				newdeps = CFArrayCreate(NULL, &value, 1, &kCFTypeArrayCallBacks);
+			} else if (CFGetTypeID(value) == CFArrayGetTypeID()) {
+				newdeps = CFRetain(value);
+			} else {
+				continue;
+			}
+			
+			UniChar first = CFStringGetCharacterAtIndex(key, 0);
+			if (first == '+') {
+				// add in these dependencies (if they don't already exist)
+				CFStringRef base = CFStringCreateWithSubstring(NULL, key, CFRangeMake(1, CFStringGetLength(key)-1));
+				CFMutableArrayRef olddeps = (CFMutableArrayRef)CFDictionaryGetValue(result, base);
+				if (olddeps != NULL) arrayAppendArrayDistinct(olddeps, newdeps);
+				CFRelease(base);
+			} else if (first == '-') {
+				// subtract these dependencies (if they exist)
+				CFStringRef base = CFStringCreateWithSubstring(NULL, key, CFRangeMake(1, CFStringGetLength(key)-1));
+				CFMutableArrayRef olddeps = (CFMutableArrayRef)CFDictionaryGetValue(result, base);
+				if (olddeps != NULL) {
+					CFIndex j, jcount = CFArrayGetCount(newdeps);
+					CFRange range = CFRangeMake(0, CFArrayGetCount(olddeps));
+					for (j = 0; j < jcount; ++j) {
+						CFStringRef item = CFArrayGetValueAtIndex(newdeps, j);
+						// XXX: assumes there's only one occurrance of the value
+						CFIndex idx = CFArrayGetFirstIndexOfValue(olddeps, range, item);
+						if (idx != kCFNotFound) {
+							CFArrayRemoveValueAtIndex(olddeps, idx);
+							--range.length;
+						}
+					}
+				}
+				CFRelease(base);
+			} else {
+				// replace the entire list of dependencies
+				// (with a copy that later builds may add to and subtract from)
+				CFMutableArrayRef copy = CFArrayCreateMutableCopy(NULL, 0, newdeps);
+				CFDictionarySetValue(result, key, copy);
+				CFRelease(copy);
+			}
+			CFRelease(newdeps);
+		}
+		CFRelease(keys);
+		CFRelease(deps);
+	}
+	return result;
+}
+
+static CFDictionaryRef _DBGetMergedDependencies(CFMutableDictionaryRef memo, CFArrayRef builds, CFStringRef project) {
+	CFDictionaryRef result = CFDictionaryGetValue(memo, project);
+	if (result == NULL) {
+		result = DBCopyMergedDependencies(builds, project);
+		CFDictionarySetValue(memo, project, result);
+		CFRelease(result);
+	}
+	return result;
+}
+
+static int _DBInsertDependencyClosure(sqlite3_stmt* stmt, const char* project, const char* kind, CFStringRef dep, int depth, int position) {
+	char* cdep = strdup_cfstr(dep);
+	sqlite3_bind_text(stmt, 2, project, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, kind, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, cdep, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 5, depth);
+	sqlite3_bind_int(stmt, 6, position);
+	int res = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	free(cdep);
+	return (res == SQLITE_DONE) ? 0 : -1;
+}
+
+// Breadth first, for the depth each dependency is first reached at.
+static CFDictionaryRef _DBCopyDependencyDepths(CFMutableDictionaryRef memo, CFArrayRef builds, CFStringRef project, CFStringRef* types, CFStringRef* recursiveTypes) {
+	CFMutableDictionaryRef depths = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+	CFMutableArrayRef queue = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	CFIndex head = 0, level = 0, levelEnd;
+
+	CFArrayAppendValue(queue, project);
+	while (head < CFArrayGetCount(queue)) {
+		CFStringRef* type = (level == 0) ? types : recursiveTypes;
+		++level;
+		levelEnd = CFArrayGetCount(queue);
+		for (; head < levelEnd; ++head) {
+			CFDictionaryRef deps = _DBGetMergedDependencies(memo, builds, CFArrayGetValueAtIndex(queue, head));
+			CFStringRef* t;
+			for (t = type; *t != NULL; ++t) {
+				CFArrayRef array = CFDictionaryGetValue(deps, *t);
+				CFIndex i, count = array ? CFArrayGetCount(array) : 0;
+				for (i = 0; i < count; ++i) {
+					CFStringRef dep = CFArrayGetValueAtIndex(array, i);
+					if (CFDictionaryContainsKey(depths, dep)) continue;
+					CFDictionarySetValue(depths, dep, (const void*)(intptr_t)level);
+					if (*recursiveTypes != NULL) CFArrayAppendValue(queue, dep);
+				}
+			}
+		}
+	}
+
+	CFRelease(queue);
+	return depths;
+}
+
+// Depth first in the order the dependencies are listed, like the
+// dependencies plugin, numbering each dependency as it is first reached.
+static int _DBComputeDependencyClosure(sqlite3_stmt* stmt, CFMutableDictionaryRef memo, CFArrayRef builds, CFStringRef project, const char* kind, CFStringRef* types, CFStringRef* recursiveTypes) {
+	int res = 0;
+	char* cproj = strdup_cfstr(project);
+	CFDictionaryRef depths = _DBCopyDependencyDepths(memo, builds, project, types, recursiveTypes);
+	CFMutableSetRef visited = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+	struct {
+		CFStringRef project;
+		CFStringRef* type;
+		CFIndex index;
+	} *stack;
+	CFIndex depth = 0, capacity = 16;
+	int position = 0;
+
+	res = _DBInsertDependencyClosure(stmt, cproj, kind, project, 0, position++);
+	stack = malloc(capacity * sizeof(*stack));
+	stack[0].project = project;
+	stack[0].type = types;
+	stack[0].index = 0;
+	while (res == 0 && depth >= 0) {
+		if (*stack[depth].type == NULL) {
+			--depth;
+			continue;
+		}
+		CFDictionaryRef deps = _DBGetMergedDependencies(memo, builds, stack[depth].project);
+		CFArrayRef array = CFDictionaryGetValue(deps, *stack[depth].type);
+		if (array == NULL || stack[depth].index >= CFArrayGetCount(array)) {
+			++stack[depth].type;
+			stack[depth].index = 0;
+			continue;
+		}
+
+		CFStringRef dep = CFArrayGetValueAtIndex(array, stack[depth].index++);
+		if (CFSetContainsValue(visited, dep)) continue;
+		CFSetAddValue(visited, dep);
+		res = _DBInsertDependencyClosure(stmt, cproj, kind, dep, (int)(intptr_t)CFDictionaryGetValue(depths, dep), position++);
+
+		if (*recursiveTypes == NULL) continue;
+		if (++depth == capacity) {
+			capacity *= 2;
+			stack = realloc(stack, capacity * sizeof(*stack));
+		}
+		stack[depth].project = dep;
+		stack[depth].type = recursiveTypes;
+		stack[depth].index = 0;
+	}
+
+	free(stack);
+	CFRelease(visited);
+	CFRelease(depths);
+	free(cproj);
+	return res;
+}
+
+static int _DBUpdateDependencyClosure(CFStringRef build, CFArrayRef projects, int force) {
+	int res = 0;
+	sqlite3* db = _DBPluginGetDataStorePtr();
+	sqlite3_stmt* stmt = NULL;
+	char* cbuild = strdup_cfstr(build);
+	CFArrayRef builds = DBCopyBuildInheritance(build);
+	CFMutableDictionaryRef memo = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+	CFStringRef runTypes[] = { CFSTR("lib"), CFSTR("run"), NULL };
+	CFStringRef buildTypes[] = { CFSTR("staticlib"), CFSTR("lib"), CFSTR("run"), CFSTR("build"), NULL };
+	CFStringRef headerTypes[] = { CFSTR("header"), NULL };
+	CFStringRef staticlibTypes[] = { CFSTR("staticlib"), NULL };
+	CFStringRef libTypes[] = { CFSTR("lib"), NULL };
+	CFStringRef none[] = { NULL };
+
+	res = DBBeginTransaction();
+	if (res == 0 && force) {
+		res = SQL("DELETE FROM dependency_closure WHERE build=%Q", cbuild);
+	}
+	if (res == 0 && sqlite3_prepare_v2(db, "INSERT INTO dependency_closure (build,project,kind,dep,depth,position) VALUES (?,?,?,?,?,?)", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+		res = -1;
+	}
+	if (stmt) sqlite3_bind_text(stmt, 1, cbuild, -1, SQLITE_STATIC);
+
+	CFIndex i, count = CFArrayGetCount(projects);
+	for (i = 0; res == 0 && i < count; ++i) {
+		CFStringRef project = CFArrayGetValueAtIndex(projects, i);
+		char* cproj = strdup_cfstr(project);
+		if (force || !SQL_BOOLEAN("SELECT 1 FROM dependency_closure WHERE build=%Q AND project=%Q AND depth=0 LIMIT 1", cbuild, cproj)) {
+			if (!force) res = SQL("DELETE FROM dependency_closure WHERE build=%Q AND project=%Q", cbuild, cproj);
+			if (res == 0) res = _DBComputeDependencyClosure(stmt, memo, builds, project, "run", runTypes, runTypes);
+			if (res == 0) res = _DBComputeDependencyClosure(stmt, memo, builds, project, "build", buildTypes, runTypes);
+			if (res == 0) res = _DBComputeDependencyClosure(stmt, memo, builds, project, "header", headerTypes, none);
+			if (res == 0) res = _DBComputeDependencyClosure(stmt, memo, builds, project, "staticlib", staticlibTypes, none);
+			if (res == 0) res = _DBComputeDependencyClosure(stmt, memo, builds, project, "lib", libTypes, none);
+			if (res != 0) fprintf(stderr, "Error: %s: %s\n", cproj, sqlite3_errmsg(db));
+		}
+		free(cproj);
+	}
+
+	if (stmt) sqlite3_finalize(stmt);
+	if (res == 0) {
+		res = DBCommitTransaction();
+	} else {
+		DBRollbackTransaction();
+	}
+	CFRelease(memo);
+	CFRelease(builds);
+	free(cbuild);
+	return res;
+}
+
+int DBUpdateDependencyClosure(CFStringRef build, CFStringRef project) {
+	int res;
+	if (project) {
+		CFArrayRef projects = CFArrayCreate(NULL, (const void**)&project, 1, &kCFTypeArrayCallBacks);
+		res = _DBUpdateDependencyClosure(build, projects, 0);
+		CFRelease(projects);
+	} else {
+		CFArrayRef projects = DBCopyProjectNames(build);
+		res = _DBUpdateDependencyClosure(build, projects, 0);
+		CFRelease(projects);
+	}
+	return res;
+}
+
+int DBRebuildDependencyClosure(CFStringRef build) {
+	CFArrayRef projects = DBCopyProjectNames(build);
+	int res = _DBUpdateDependencyClosure(build, projects, 1);
+	CFRelease(projects);
+	return res;
+}
+
 // NOT THREAD SAFE
 int DBBeginTransaction() {
 	++__nestedTransactions;
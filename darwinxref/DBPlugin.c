@@ -94,7 +94,7 @@ void DBPluginSetSubDictDataType(CFTypeID type) {
 //////
 // NOT THREAD SAFE
 // We currently operate under the assumption that there is only
-// one thread, with no plugin re-entrancy.
+// one thread, with no plugin re-entrancy other than DBPluginRun.
 //////
 const DBPlugin* __DBPluginCurrentPlugin;
 void _DBPluginSetCurrentPlugin(const DBPlugin* plugin) {
@@ -252,6 +252,18 @@ const DBPlugin* DBGetPluginWithName(CFStringRef name) {
 	return (DBPlugin*)plugin;
 }
 
+int DBPluginRun(CFStringRef name, CFArrayRef argv) {
+	int res = -1;
+	const DBPlugin* caller = __DBPluginCurrentPlugin;
+	const DBPlugin* plugin = DBGetPluginWithName(name);
+	if (plugin) {
+		_DBPluginSetCurrentPlugin(plugin);
+		res = plugin->run(argv);
+		_DBPluginSetCurrentPlugin(caller);
+	}
+	return res;
+}
+
 int run_plugin(int argc, char* argv[]) {
 	int res = -1;
 	int i;
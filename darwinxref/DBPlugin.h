@@ -136,6 +136,17 @@ CFStringRef DBPluginPropertyDefaultUsage(void);
 
 // generally available routines
 
+/*!
+	@function DBPluginRun
+	Runs the command of another plugin, as if it had been given on the
+	command line.
+	@param name The name of the plugin.
+	@param argv The arguments to the command.
+	@result The result of the plugin's run function, or -1 if there is
+	no such plugin.
+*/
+int DBPluginRun(CFStringRef name, CFArrayRef argv);
+
 CFStringRef DBGetCurrentBuild(void);
 int DBHasBuild(CFStringRef build);
 CFArrayRef DBCopyBuilds(void);
@@ -188,10 +199,32 @@ CFArrayRef DBCopyGroupNames(CFStringRef build);
 CFArrayRef DBCopyGroupMembers(CFStringRef build, CFStringRef group);
 int DBSetGroupMembers(CFStringRef build, CFStringRef group, CFArrayRef members);
 
+/*!
+	@function DBCopyMergedDependencies
+	Merges a project's dependencies property over a build inheritance,
+	applying the "+type" and "-type" entries of later builds.
+	@param builds The builds to merge, as returned by DBCopyBuildInheritance.
+	@param project The project whose dependencies to merge.
+	@result A dictionary mapping each type to an array of projects.
+*/
+CFDictionaryRef DBCopyMergedDependencies(CFArrayRef builds, CFStringRef project);
+
+/*!
+	@function DBUpdateDependencyClosure
+	Computes any missing rows of the dependency_closure table.
+	@param build The build number whose closures to update.
+	@param project The project whose closures to update, or if NULL, every
+	project in the build.
+	@result The status, 0 for success.
+*/
+int DBUpdateDependencyClosure(CFStringRef build, CFStringRef project);
+int DBRebuildDependencyClosure(CFStringRef build);
+
 int DBBeginTransaction(void);
 int DBCommitTransaction(void);
 int DBRollbackTransaction(void);
 
 #include "cfutils.h"
+#include "filedigest.h"
 
 #endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "batchpool.h"
+
+// Claims and processes entries of the current batch until none are left.
+static void batch_pool_work(struct batch_pool* p) {
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		void* e = (p->next < p->count) ? p->entries + p->next++ * p->size : NULL;
+		pthread_mutex_unlock(&p->lock);
+		if (e == NULL) break;
+		p->process(e);
+	}
+}
+
+static void* batch_pool_worker(void* arg) {
+	struct batch_pool* p = arg;
+	unsigned int seen = 0;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->quit && p->generation == seen) {
+			pthread_cond_wait(&p->start, &p->lock);
+		}
+		if (p->quit) break;
+		seen = p->generation;
+		++p->busy;
+		pthread_mutex_unlock(&p->lock);
+		batch_pool_work(p);
+		pthread_mutex_lock(&p->lock);
+		if (--p->busy == 0) pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+void batch_pool_init(struct batch_pool* p, int jobs, size_t size, void (*process)(void* entry)) {
+	int i;
+	memset(p, 0, sizeof(*p));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->process = process;
+	p->size = size;
+
+	// The calling thread works too, so one job starts no threads at all.
+	if (jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1) jobs = 1;
+	p->threads = calloc((size_t)jobs, sizeof(pthread_t));
+	for (i = 0; i < jobs - 1; ++i) {
+		if (pthread_create(&p->threads[p->nthreads], NULL, batch_pool_worker, p) == 0) {
+			++p->nthreads;
+		}
+	}
+}
+
+void batch_pool_destroy(struct batch_pool* p) {
+	int i;
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < p->nthreads; ++i) {
+		pthread_join(p->threads[i], NULL);
+	}
+	free(p->threads);
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->start);
+	pthread_mutex_destroy(&p->lock);
+}
+
+void batch_pool_run(struct batch_pool* p, void* entries, size_t count) {
+	pthread_mutex_lock(&p->lock);
+	p->entries = entries;
+	p->count = count;
+	p->next = 0;
+	++p->generation;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	batch_pool_work(p);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->busy > 0) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
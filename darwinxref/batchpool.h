@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef __batchpool_h__
+#define __batchpool_h__
+
+#include <pthread.h>
+#include <stddef.h>
+
+//
+// A pool of threads that processes one batch of entries at a time.
+// batch_pool_run() hands out the entries of a batch, works on them too,
+// and returns once all of them are processed, so the caller can go on
+// to use the batch in order.  Used by the manifest tool and by
+// "darwinxref register -stdin".
+//
+
+struct batch_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	void (*process)(void* entry);
+	char* entries;
+	size_t size;		// of an entry
+	size_t count;
+	size_t next;		// next entry to be claimed
+	int busy;		// threads working on the current batch
+	unsigned int generation;
+	int quit;
+	int nthreads;
+	pthread_t* threads;
+};
+
+// jobs counts the calling thread; 0 or less for one per CPU.
+void batch_pool_init(struct batch_pool* p, int jobs, size_t size, void (*process)(void* entry));
+void batch_pool_destroy(struct batch_pool* p);
+void batch_pool_run(struct batch_pool* p, void* entries, size_t count);
+
+#endif
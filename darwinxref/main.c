@@ -93,11 +93,14 @@ int main(int argc, char* argv[]) {
 	        fprintf(stderr, "Error: cannot load plugins!\n");
 		exit(2);
 	}
-	if (run_plugin(argc, argv) == -1) {
+	int res = run_plugin(argc, argv);
+	if (res == -1) {
 		print_usage(progname, argc, argv);
 		exit(1);
 	}
-	return 0;
+	// other failures are passed on as the exit status, so run functions
+	// return 0 on success and a small positive status otherwise
+	return (res > 0) ? res : 0;
 }
 
 char* readBuildFile() {
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "manifestindex.h"
+
+int mf_parse_digest(const char* str, unsigned char* md) {
+	int i;
+	memset(md, 0, CC_SHA1_DIGEST_LENGTH);
+	if (str[0] == ' ') return 0;	// blank checksum
+	for (i = 0; i < CC_SHA1_DIGEST_LENGTH * 2; ++i) {
+		int c = str[i];
+		int v;
+		if (c >= '0' && c <= '9') v = c - '0';
+		else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+		else return -1;
+		md[i / 2] |= (i % 2) ? v : v << 4;
+	}
+	return 0;
+}
+
+void mf_builder_init(struct mf_builder* b) {
+	b->nodes = NULL;
+	b->count = 0;
+	b->capacity = 0;
+}
+
+void mf_builder_free(struct mf_builder* b) {
+	uint32_t i;
+	for (i = 0; i < b->count; ++i) {
+		free(b->nodes[i].path);
+		free(b->nodes[i].link);
+	}
+	free(b->nodes);
+	mf_builder_init(b);
+}
+
+struct mf_node* mf_builder_add(struct mf_builder* b, const char* path, const char* link) {
+	if (b->count == b->capacity) {
+		b->capacity = b->capacity ? b->capacity * 2 : 1024;
+		b->nodes = realloc(b->nodes, b->capacity * sizeof(struct mf_node));
+		if (b->nodes == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	struct mf_node* node = &b->nodes[b->count++];
+	memset(node, 0, sizeof(struct mf_node));
+	node->path = strdup(path);
+	node->link = (link && link[0]) ? strdup(link) : NULL;
+	return node;
+}
+
+int mf_builder_add_line(struct mf_builder* b, const char* buf, size_t size) {
+	char line[MAXPATHLEN * 2 + 128];
+	if (size > 0 && buf[size - 1] == '\n') --size;
+	if (size >= sizeof(line)) size = sizeof(line) - 1;
+	memcpy(line, buf, size);
+	line[size] = 0;
+
+	unsigned char md[CC_SHA1_DIGEST_LENGTH];
+	char* p = line + CC_SHA1_DIGEST_LENGTH * 2;
+	if (size < CC_SHA1_DIGEST_LENGTH * 2 + 1 || *p != ' ' || mf_parse_digest(line, md) != 0) {
+		return -1;
+	}
+	uint32_t mode = (uint32_t)strtoul(p, &p, 8);
+	uint32_t uid = (uint32_t)strtol(p, &p, 10);
+	uint32_t gid = (uint32_t)strtol(p, &p, 10);
+	uint64_t sz = (uint64_t)strtoll(p, &p, 10);
+	if (strncmp(p, " ./", 3) != 0) {
+		return -1;
+	}
+	char* path = p + 2;
+	char* link = NULL;
+	if (S_ISLNK(mode) && (link = strstr(path, " -> ")) != NULL) {
+		*link = 0;
+		link += 4;
+	}
+	struct mf_node* node = mf_builder_add(b, path, link);
+	node->mode = mode;
+	node->uid = uid;
+	node->gid = gid;
+	node->size = sz;
+	memcpy(node->digest, md, CC_SHA1_DIGEST_LENGTH);
+	return 0;
+}
+
+// Orders paths as a sorted preorder walk would visit them, that is
+// component by component.  This is how fts is asked to walk roots
+// (see compare in manifest.c), and how tar listings are brought into line.
+static int compare_paths(const char* a, const char* b) {
+	while (*a && *a == *b) {
+		++a;
+		++b;
+	}
+	unsigned char ca = (*a == '/') ? 1 : (unsigned char)*a;
+	unsigned char cb = (*b == '/') ? 1 : (unsigned char)*b;
+	return (int)ca - (int)cb;
+}
+
+static int compare_nodes(const void* a, const void* b) {
+	return compare_paths(((const struct mf_node*)a)->path, ((const struct mf_node*)b)->path);
+}
+
+static void digest_children(struct mf_builder* b, struct mf_node* dir) {
+	CC_SHA1_CTX c;
+	CC_SHA1_Init(&c);
+	uint32_t i;
+	for (i = dir->child; i != 0; i = b->nodes[i].sibling) {
+		struct mf_node* node = &b->nodes[i];
+		const char* name = strrchr(node->path, '/') + 1;
+		char record[64];
+		int len = snprintf(record, sizeof(record), " %o %u %u %llu ",
+			node->mode, node->uid, node->gid, (unsigned long long)node->size);
+		CC_SHA1_Update(&c, name, (CC_LONG)strlen(name));
+		CC_SHA1_Update(&c, record, (CC_LONG)len);
+		CC_SHA1_Update(&c, node->digest, CC_SHA1_DIGEST_LENGTH);
+		if (node->link) CC_SHA1_Update(&c, node->link, (CC_LONG)strlen(node->link));
+		CC_SHA1_Update(&c, "\n", 1);
+	}
+	CC_SHA1_Final(dir->digest, &c);
+}
+
+static uint32_t add_string(char** strings, uint32_t* len, uint32_t* capacity, const char* str) {
+	uint32_t off = *len;
+	size_t n = strlen(str) + 1;
+	while (*len + n > *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 65536;
+		*strings = realloc(*strings, *capacity);
+		if (*strings == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	memcpy(*strings + *len, str, n);
+	*len += (uint32_t)n;
+	return off;
+}
+
+//
+// Arranges the collected entries into a tree.  Entries whose parent
+// directory was never listed are attached to their nearest listed
+// ancestor under their remaining relative path.
+//
+int mf_builder_finish(struct mf_builder* b, struct mf_tree* t) {
+	uint32_t i, n;
+
+	// Node 0 is the root
+	qsort(b->nodes + 1, b->count - 1, sizeof(struct mf_node), compare_nodes);
+
+	uint32_t* stack = malloc(b->count * sizeof(uint32_t));
+	uint32_t* order = malloc(b->count * sizeof(uint32_t));
+	uint32_t depth = 0;
+	stack[depth++] = 0;
+	for (i = 1; i < b->count; ++i) {
+		struct mf_node* node = &b->nodes[i];
+		for (;;) {
+			const char* parent = b->nodes[stack[depth - 1]].path;
+			size_t len = strlen(parent);
+			if (depth == 1 || (strncmp(node->path, parent, len) == 0 && node->path[len] == '/')) break;
+			--depth;
+		}
+		struct mf_node* parent = &b->nodes[stack[depth - 1]];
+		if (parent->last == 0) {
+			parent->child = i;
+		} else if (strcmp(b->nodes[parent->last].path, node->path) == 0) {
+			continue;	// duplicate entry
+		} else {
+			b->nodes[parent->last].sibling = i;
+		}
+		parent->last = i;
+		if (S_ISDIR(node->mode)) stack[depth++] = i;
+	}
+
+	// Children sort after their parents, so walking backwards visits
+	// every directory after all of its descendants.
+	for (i = b->count; i > 0; --i) {
+		struct mf_node* node = &b->nodes[i - 1];
+		if (i == 1 || S_ISDIR(node->mode)) digest_children(b, node);
+	}
+
+	// Lay the tree out breadth-first
+	t->entries = calloc(b->count, sizeof(struct mf_entry));
+	char* strings = NULL;
+	uint32_t strsize = 0, strcapacity = 0;
+	add_string(&strings, &strsize, &strcapacity, "");
+	order[0] = 0;
+	n = 1;
+	for (i = 0; i < n; ++i) {
+		struct mf_node* node = &b->nodes[order[i]];
+		struct mf_entry* entry = &t->entries[i];
+		memcpy(entry->digest, node->digest, CC_SHA1_DIGEST_LENGTH);
+		entry->mode = node->mode;
+		entry->uid = node->uid;
+		entry->gid = node->gid;
+		entry->size = node->size;
+		entry->name = (i == 0) ? 0 : add_string(&strings, &strsize, &strcapacity,
+			node->path + strlen(b->nodes[order[t->entries[i].parent]].path) + 1);
+		entry->link = node->link ? add_string(&strings, &strsize, &strcapacity, node->link) : 0;
+		entry->first = n;
+		uint32_t child;
+		for (child = node->child; child != 0; child = b->nodes[child].sibling) {
+			t->entries[n].parent = i;
+			order[n++] = child;
+		}
+		entry->nchildren = n - entry->first;
+	}
+	t->count = n;
+	t->strings = strings;
+	t->strsize = strsize;
+	t->map = NULL;
+	t->maplen = 0;
+
+	free(stack);
+	free(order);
+	return 0;
+}
+
+void mf_tree_free(struct mf_tree* t) {
+	if (t->map) {
+		munmap(t->map, t->maplen);
+	} else {
+		free(t->entries);
+		free((char*)t->strings);
+	}
+}
+
+int mf_write_index(struct mf_tree* t, const char* filename) {
+	struct mf_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MANIFEST_V2_MAGIC, sizeof(h.magic));
+	h.byteorder = MANIFEST_V2_BYTEORDER;
+	h.count = t->count;
+	h.strsize = t->strsize;
+
+	FILE* f = fopen(filename, "w");
+	if (f == NULL) {
+		perror(filename);
+		return -1;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(t->entries, sizeof(struct mf_entry), t->count, f);
+	fwrite(t->strings, 1, t->strsize, f);
+	if (ferror(f) | fclose(f)) {
+		perror(filename);
+		return -1;
+	}
+	return 0;
+}
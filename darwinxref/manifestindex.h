@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#ifndef __manifestindex_h__
+#define __manifestindex_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CommonCrypto/CommonDigest.h>
+
+//
+// Version 2 manifests
+//
+// The text manifest is a flat list of entries.  A version 2 manifest
+// is an index written next to it which arranges the same entries as a
+// tree.  Every directory carries a SHA-1 over the records of its
+// sorted children, so two trees whose directory digests match are
+// identical below that point and need not be examined any further.
+//
+// The index is a header, followed by one fixed-size record per entry,
+// followed by a string table holding entry names and symlink targets.
+// Entries are stored breadth-first so that the children of a directory
+// are contiguous and sorted by name; entry 0 is the root itself.
+// Integers are in host byte order.
+//
+// Shared by the manifest tool with darwinxref, whose register plugin
+// writes the index of a receipt as it writes the receipt.
+//
+#define MANIFEST_V2_MAGIC "DBMFSTv2"
+#define MANIFEST_V2_BYTEORDER 0x01020304
+
+struct mf_header {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t count;		// number of entries
+	uint32_t strsize;	// size of the string table
+	uint32_t reserved;
+};
+
+struct mf_entry {
+	unsigned char digest[CC_SHA1_DIGEST_LENGTH];	// contents, or children
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t name;		// offset into the string table
+	uint32_t link;		// offset into the string table, 0 if none
+	uint32_t parent;
+	uint32_t first;		// index of the first child
+	uint32_t nchildren;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+struct mf_tree {
+	struct mf_entry* entries;
+	uint32_t count;
+	const char* strings;
+	uint32_t strsize;
+	void* map;		// non-NULL if read from an index file
+	size_t maplen;
+};
+
+// Entries as they are collected, before being arranged into a tree.
+struct mf_node {
+	char* path;		// "" for the root, otherwise "/a/b"
+	char* link;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+	uint32_t child;		// first child, 0 if none
+	uint32_t sibling;	// next sibling, 0 if none
+	uint32_t last;		// last child, 0 if none
+};
+
+struct mf_builder {
+	struct mf_node* nodes;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+void mf_builder_init(struct mf_builder* b);
+void mf_builder_free(struct mf_builder* b);
+struct mf_node* mf_builder_add(struct mf_builder* b, const char* path, const char* link);
+
+// Adds a line of a text manifest, as printed by the manifest tool or by
+// darwinxref register; returns -1 if it is malformed.
+int mf_builder_add_line(struct mf_builder* b, const char* buf, size_t size);
+
+// Arranges the collected entries into a tree, to be freed with mf_tree_free.
+int mf_builder_finish(struct mf_builder* b, struct mf_tree* t);
+void mf_tree_free(struct mf_tree* t);
+
+int mf_write_index(struct mf_tree* t, const char* filename);
+
+// Parses 40 hex digits, or a blank checksum, into md.
+int mf_parse_digest(const char* str, unsigned char* md);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include "DBPlugin.h"
+#include "DBDataStore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Sequences a list of projects so that each one comes after the projects it
+// needs to build and whose headers it uses.  The whole graph is read from
+// dependency_closure in one query and ordered with Kahn's algorithm; when
+// several projects are ready, the one listed first goes first.  Projects in
+// the "nobuild" group are dropped, projects in the "compilertools" group are
+// not waited on, and the build's "dependency_exceptions" property lists
+// edges to ignore:
+//
+//	dependency_exceptions = {
+//		IOKitUser = ( configd );
+//	};
+//
+// The exceptions the buildorder script always had are kept as defaults,
+// so builds without the property still order the same way.
+//
+// Projects left over are on a dependency cycle or wait on one; each cycle
+// is reported as a strongly connected component.
+//
+// The progress messages and the "Build Order:" line go to stdout as they
+// always did; the order itself, one project per line, goes to the output
+// file if one is given.
+//
+
+static const char* kDefaultExceptions[][2] = {
+	{ "passwordserver_sasl", "Kerberos" },
+	{ "IOKitUser", "configd" },
+	{ "configd", "configd_plugins" },
+};
+
+struct graph {
+	CFIndex count;
+	CFStringRef* names;		// listing order
+	CFMutableDictionaryRef index;	// name -> position + 1
+	CFIndex** edges;		// edges[i] are the projects waiting on i
+	CFIndex* nedges;
+	CFIndex* indegree;
+};
+
+static CFIndex graphLookup(struct graph* g, const char* name) {
+	CFStringRef str = cfstr(name);
+	CFIndex i = (CFIndex)(intptr_t)CFDictionaryGetValue(g->index, str) - 1;
+	CFRelease(str);
+	return i;
+}
+
+static int isException(CFDictionaryRef exceptions, const char* project, CFStringRef proj, const char* dep, CFStringRef d) {
+	size_t i;
+	for (i = 0; i < sizeof(kDefaultExceptions) / sizeof(*kDefaultExceptions); ++i) {
+		if (strcmp(kDefaultExceptions[i][0], project) == 0 && strcmp(kDefaultExceptions[i][1], dep) == 0) return 1;
+	}
+	if (exceptions) {
+		CFArrayRef except = CFDictionaryGetValue(exceptions, proj);
+		if (except && CFGetTypeID(except) == CFArrayGetTypeID() &&
+		    CFArrayContainsValue(except, CFRangeMake(0, CFArrayGetCount(except)), d)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct load_context {
+	struct graph* graph;
+	CFSetRef compilers;
+	CFDictionaryRef exceptions;
+	char* last;			// remembers the previous edge, rows come sorted
+};
+
+static int addEdge(void* pArg, int argc, char **argv, char** columnNames) {
+	struct load_context* ctx = pArg;
+	struct graph* g = ctx->graph;
+
+	// closure rows for build and header repeat many edges
+	if (ctx->last && strcmp(ctx->last, argv[0]) == 0 && strcmp(ctx->last + strlen(ctx->last) + 1, argv[1]) == 0) return 0;
+	free(ctx->last);
+	size_t len0 = strlen(argv[0]), len1 = strlen(argv[1]);
+	ctx->last = malloc(len0 + len1 + 2);
+	memcpy(ctx->last, argv[0], len0 + 1);
+	memcpy(ctx->last + len0 + 1, argv[1], len1 + 1);
+
+	// don't depend on ourself, compilers, or projects not being built currently
+	if (strcmp(argv[0], argv[1]) == 0) return 0;
+	CFIndex from = graphLookup(g, argv[1]);
+	CFIndex to = graphLookup(g, argv[0]);
+	if (from < 0 || to < 0) return 0;
+	if (CFSetContainsValue(ctx->compilers, g->names[from])) return 0;
+	if (isException(ctx->exceptions, argv[0], g->names[to], argv[1], g->names[from])) return 0;
+
+	g->edges[from] = realloc(g->edges[from], (g->nedges[from] + 1) * sizeof(CFIndex));
+	g->edges[from][g->nedges[from]++] = to;
+	++g->indegree[to];
+	return 0;
+}
+
+// A binary min-heap of listing positions, so ties go to the earlier project.
+static void heapPush(CFIndex* heap, CFIndex* size, CFIndex value) {
+	CFIndex i = (*size)++;
+	while (i > 0 && heap[(i - 1) / 2] > value) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = value;
+}
+
+static CFIndex heapPop(CFIndex* heap, CFIndex* size) {
+	CFIndex top = heap[0];
+	CFIndex value = heap[--*size];
+	CFIndex i = 0;
+	for (;;) {
+		CFIndex child = 2 * i + 1;
+		if (child >= *size) break;
+		if (child + 1 < *size && heap[child + 1] < heap[child]) ++child;
+		if (heap[child] >= value) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (*size > 0) heap[i] = value;
+	return top;
+}
+
+//
+// Tarjan's algorithm over the projects that could not be ordered, with an
+// explicit stack.  Prints each component of more than one project.
+//
+static int reportCycles(struct graph* g, const char* ordered) {
+	CFIndex n = g->count, i, counter = 0, sp = 0, cp = 0;
+	int cycles = 0;
+	CFIndex* number = calloc(n, sizeof(CFIndex));	// visit order + 1, 0 if unvisited
+	CFIndex* low = calloc(n, sizeof(CFIndex));
+	char* onstack = calloc(n, 1);
+	CFIndex* stack = calloc(n, sizeof(CFIndex));
+	CFIndex* callNode = calloc(n, sizeof(CFIndex));
+	CFIndex* callEdge = calloc(n, sizeof(CFIndex));
+
+	for (i = 0; i < n; ++i) {
+		if (ordered[i] || number[i]) continue;
+		callNode[0] = i;
+		callEdge[0] = 0;
+		cp = 1;
+		number[i] = low[i] = ++counter;
+		stack[sp++] = i;
+		onstack[i] = 1;
+		while (cp > 0) {
+			CFIndex v = callNode[cp - 1];
+			if (callEdge[cp - 1] < g->nedges[v]) {
+				CFIndex w = g->edges[v][callEdge[cp - 1]++];
+				if (ordered[w]) continue;
+				if (number[w] == 0) {
+					number[w] = low[w] = ++counter;
+					stack[sp++] = w;
+					onstack[w] = 1;
+					callNode[cp] = w;
+					callEdge[cp] = 0;
+					++cp;
+				} else if (onstack[w] && number[w] < low[v]) {
+					low[v] = number[w];
+				}
+				continue;
+			}
+			--cp;
+			if (cp > 0 && low[v] < low[callNode[cp - 1]]) low[callNode[cp - 1]] = low[v];
+			if (low[v] != number[v]) continue;
+
+			// v is the root of a component
+			CFIndex start = sp;
+			do {
+				--start;
+			} while (stack[start] != v);
+			if (sp - start > 1) {
+				CFIndex j;
+				++cycles;
+				fprintf(stderr, "Error: dependency cycle:");
+				for (j = start; j < sp; ++j) cfprintf(stderr, " %@", g->names[stack[j]]);
+				fprintf(stderr, "\n");
+			}
+			for (; sp > start; --sp) onstack[stack[sp - 1]] = 0;
+		}
+	}
+
+	free(number);
+	free(low);
+	free(onstack);
+	free(stack);
+	free(callNode);
+	free(callEdge);
+	return cycles;
+}
+
+static CFArrayRef copyProjectList(const char* path) {
+	CFMutableArrayRef projects = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		CFRelease(projects);
+		return NULL;
+	}
+	char word[1024];
+	while (fscanf(f, "%1023s", word) == 1) {
+		CFStringRef str = cfstr(word);
+		CFArrayAppendValue(projects, str);
+		CFRelease(str);
+	}
+	fclose(f);
+	return projects;
+}
+
+// Prints the group's members, like the buildorder script did.
+static CFSetRef copyGroupSet(CFStringRef build, CFStringRef group, const char* label) {
+	CFMutableSetRef set = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+	CFArrayRef members = DBCopyGroupMembers(build, group);
+	CFIndex i, count = members ? CFArrayGetCount(members) : 0;
+	if (label) fprintf(stdout, "%s:", label);
+	for (i = 0; i < count; ++i) {
+		CFSetAddValue(set, CFArrayGetValueAtIndex(members, i));
+		if (label) cfprintf(stdout, " %@", CFArrayGetValueAtIndex(members, i));
+	}
+	if (label) fprintf(stdout, "\n");
+	if (members) CFRelease(members);
+	return set;
+}
+
+static int buildorder(CFStringRef build, CFArrayRef list, FILE* output) {
+	int res = 0;
+	CFIndex i, j, count = CFArrayGetCount(list);
+	CFSetRef nobuild = copyGroupSet(build, CFSTR("nobuild"), NULL);
+	CFDictionaryRef exceptions = DBCopyPropDictionary(build, NULL, CFSTR("dependency_exceptions"));
+
+	struct graph g;
+	memset(&g, 0, sizeof(g));
+	g.names = calloc(count + 1, sizeof(CFStringRef));
+	g.index = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+	for (i = 0; i < count; ++i) {
+		CFStringRef name = CFArrayGetValueAtIndex(list, i);
+		if (CFSetContainsValue(nobuild, name) || CFDictionaryContainsKey(g.index, name)) continue;
+		g.names[g.count++] = name;
+		CFDictionarySetValue(g.index, name, (const void*)(intptr_t)g.count);
+	}
+	fprintf(stdout, "Considering projects:");
+	for (i = 0; i < g.count; ++i) cfprintf(stdout, " %@", g.names[i]);
+	fprintf(stdout, "\n");
+	CFSetRef compilers = copyGroupSet(build, CFSTR("compilertools"), "Compilers");
+	fprintf(stdout, "Generating dependency graph...");
+	fflush(stdout);
+	g.edges = calloc(g.count + 1, sizeof(CFIndex*));
+	g.nedges = calloc(g.count + 1, sizeof(CFIndex));
+	g.indegree = calloc(g.count + 1, sizeof(CFIndex));
+
+	res = DBUpdateDependencyClosure(build, NULL);
+	if (res == 0) {
+		struct load_context ctx = { &g, compilers, exceptions, NULL };
+		char* cbuild = strdup_cfstr(build);
+		res = SQL_CALLBACK(&addEdge, &ctx,
+			"SELECT DISTINCT project, dep FROM dependency_closure WHERE build=%Q AND kind IN ('build', 'header') AND depth>0 ORDER BY project, dep",
+			cbuild);
+		free(ctx.last);
+		free(cbuild);
+	}
+
+	if (res == 0) {
+		fprintf(stdout, " done\n");
+		fprintf(stdout, "Sequencing based on dependencies...");
+		fflush(stdout);
+		CFIndex* heap = calloc(g.count + 1, sizeof(CFIndex));
+		CFIndex heapSize = 0, done = 0;
+		char* ordered = calloc(g.count + 1, 1);
+		CFIndex* order = calloc(g.count + 1, sizeof(CFIndex));
+		for (i = 0; i < g.count; ++i) {
+			if (g.indegree[i] == 0) heapPush(heap, &heapSize, i);
+		}
+		while (heapSize > 0) {
+			CFIndex v = heapPop(heap, &heapSize);
+			ordered[v] = 1;
+			order[done++] = v;
+			for (j = 0; j < g.nedges[v]; ++j) {
+				CFIndex w = g.edges[v][j];
+				if (--g.indegree[w] == 0) heapPush(heap, &heapSize, w);
+			}
+		}
+		if (done < g.count) {
+			fprintf(stdout, "\n");
+			fprintf(stderr, "Aborting, unmet dependency loop\n");
+			reportCycles(&g, ordered);
+			fprintf(stderr, "Remaining projects:");
+			for (i = 0; i < g.count; ++i) {
+				if (!ordered[i]) cfprintf(stderr, " %@", g.names[i]);
+			}
+			fprintf(stderr, "\n");
+			res = -1;
+		} else {
+			fprintf(stdout, " done\n");
+			fprintf(stdout, "Build Order:");
+			for (i = 0; i < done; ++i) cfprintf(stdout, " %@", g.names[order[i]]);
+			fprintf(stdout, "\n");
+			for (i = 0; output && i < done; ++i) cfprintf(output, "%@\n", g.names[order[i]]);
+		}
+		free(order);
+		free(ordered);
+		free(heap);
+	}
+
+	for (i = 0; i < g.count; ++i) free(g.edges[i]);
+	free(g.edges);
+	free(g.nedges);
+	free(g.indegree);
+	free(g.names);
+	CFRelease(g.index);
+	if (exceptions) CFRelease(exceptions);
+	CFRelease(compilers);
+	CFRelease(nobuild);
+	return res;
+}
+
+static int run(CFArrayRef argv) {
+	int res = 0;
+	CFIndex count = CFArrayGetCount(argv);
+	if (count < 1 || count > 2) return -1;
+
+	char* path = strdup_cfstr(CFArrayGetValueAtIndex(argv, 0));
+	CFArrayRef projects = copyProjectList(path);
+	free(path);
+	if (projects == NULL) return 1;
+
+	FILE* output = NULL;
+	if (count == 2) {
+		path = strdup_cfstr(CFArrayGetValueAtIndex(argv, 1));
+		output = fopen(path, "w");
+		if (output == NULL) perror(path);
+		free(path);
+	}
+	if (output || count == 1) {
+		res = buildorder(DBGetCurrentBuild(), projects, output);
+		if (output) fclose(output);
+	} else {
+		res = 1;
+	}
+	CFRelease(projects);
+	// -1 would mean a usage error to darwinxref
+	return res == 0 ? 0 : 1;
+}
+
+static CFStringRef usage() {
+	return CFRetain(CFSTR("<projects.txt> [<output.txt>]"));
+}
+
+int initialize(int version) {
+	//if ( version < kDBPluginCurrentVersion ) return -1;
+	
+	DBPluginSetType(kDBPluginBasicType);
+	DBPluginSetName(CFSTR("buildorder"));
+	DBPluginSetRunFunc(&run);
+	DBPluginSetUsageFunc(&usage);
+	return 0;
+}
@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include "DBPlugin.h"
+#include "DBDataStore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//
+// darwinbuild records how long each phase of a build took with
+//
+//	darwinxref buildstats -record <project> <version> <build_version>
+//		<action> <exit_status> fetch=12 extract=3 ... build=640
+//
+// into build_history (one row per build) and build_phases (one row per
+// phase).  The other modes estimate each project's build time from its
+// most recent successful build of the same action (install or installhdrs).
+//
+
+static int create_tables() {
+	char* table = "CREATE TABLE build_history (build TEXT, project TEXT, version TEXT, build_version INTEGER, action TEXT, exit_status INTEGER, finished INTEGER, duration INTEGER)";
+	char* index = "CREATE INDEX build_history_index ON build_history (project, action, exit_status, build_version)";
+	SQL_NOERR(table);
+	SQL_NOERR(index);
+
+	table = "CREATE TABLE build_phases (build TEXT, project TEXT, build_version INTEGER, action TEXT, phase TEXT, duration INTEGER)";
+	index = "CREATE INDEX build_phases_index ON build_phases (project, build_version, action)";
+	SQL_NOERR(table);
+	SQL_NOERR(index);
+	return 0;
+}
+
+static char* formatDuration(long seconds, char* buf, size_t size) {
+	if (seconds >= 3600) {
+		snprintf(buf, size, "%ldh %02ldm %02lds", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+	} else if (seconds >= 60) {
+		snprintf(buf, size, "%ldm %02lds", seconds / 60, seconds % 60);
+	} else {
+		snprintf(buf, size, "%lds", seconds);
+	}
+	return buf;
+}
+
+static int record(CFArrayRef argv) {
+	CFIndex i, count = CFArrayGetCount(argv);
+	if (count < 5) return -1;
+
+	char* build = strdup_cfstr(DBGetCurrentBuild());
+	char* project = strdup_cfstr(CFArrayGetValueAtIndex(argv, 0));
+	char* version = strdup_cfstr(CFArrayGetValueAtIndex(argv, 1));
+	char* build_version = strdup_cfstr(CFArrayGetValueAtIndex(argv, 2));
+	char* action = strdup_cfstr(CFArrayGetValueAtIndex(argv, 3));
+	char* exit_status = strdup_cfstr(CFArrayGetValueAtIndex(argv, 4));
+	long total = 0;
+	int res = 0;
+
+	create_tables();
+	SQL("BEGIN");
+	SQL("DELETE FROM build_history WHERE project=%Q AND build_version=%d AND action=%Q", project, atoi(build_version), action);
+	SQL("DELETE FROM build_phases WHERE project=%Q AND build_version=%d AND action=%Q", project, atoi(build_version), action);
+	for (i = 5; i < count && res == 0; ++i) {
+		char* phase = strdup_cfstr(CFArrayGetValueAtIndex(argv, i));
+		char* value = strchr(phase, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Error: expected <phase>=<seconds>: %s\n", phase);
+			res = 1;
+		} else {
+			*value++ = 0;
+			total += atol(value);
+			// a phase may be entered more than once
+			if (SQL_BOOLEAN("SELECT 1 FROM build_phases WHERE project=%Q AND build_version=%d AND action=%Q AND phase=%Q",
+					project, atoi(build_version), action, phase)) {
+				res = SQL("UPDATE build_phases SET duration=duration+%ld WHERE project=%Q AND build_version=%d AND action=%Q AND phase=%Q",
+					atol(value), project, atoi(build_version), action, phase);
+			} else {
+				res = SQL("INSERT INTO build_phases (build, project, build_version, action, phase, duration) VALUES (%Q, %Q, %d, %Q, %Q, %ld)",
+					build, project, atoi(build_version), action, phase, atol(value));
+			}
+		}
+		free(phase);
+	}
+	if (res == 0) {
+		res = SQL("INSERT INTO build_history (build, project, version, build_version, action, exit_status, finished, duration) VALUES (%Q, %Q, %Q, %d, %Q, %d, %ld, %ld)",
+			build, project, version, atoi(build_version), action, atoi(exit_status), (long)time(NULL), total);
+	}
+	SQL(res == 0 ? "COMMIT" : "ROLLBACK");
+
+	free(build);
+	free(project);
+	free(version);
+	free(build_version);
+	free(action);
+	free(exit_status);
+	return res;
+}
+
+// The duration of the latest successful build of every project and action.
+#define RECENT_DURATIONS \
+	"SELECT project, action, duration FROM build_history h WHERE exit_status=0 AND build_version=" \
+	"(SELECT MAX(build_version) FROM build_history WHERE project=h.project AND action=h.action AND exit_status=0)"
+
+static int printSlowest(void* pArg, int argc, char **argv, char** columnNames) {
+	char buf[32];
+	fprintf(stdout, "%14s  %s%s\n", formatDuration(atol(argv[2]), buf, sizeof(buf)), argv[0],
+		strcmp(argv[1], "installhdrs") == 0 ? " -headers" : "");
+	return 0;
+}
+
+static int printDuration(void* pArg, int argc, char **argv, char** columnNames) {
+	fprintf(stdout, "%s\t%s\t%s\n", argv[1], argv[0], argv[2]);
+	return 0;
+}
+
+static int slowest(int limit) {
+	return SQL_CALLBACK(&printSlowest, NULL, RECENT_DURATIONS " ORDER BY duration DESC, project LIMIT %d", limit);
+}
+
+//
+// The same graph darwinbuild-recursive schedules: a node for every
+// darwinbuild invocation, either a full build or a -headers build of a
+// project, depending on the nodes for the build and header closures of
+// the project.  Nodes are numbered in depth-first postorder, so every node
+// comes after the nodes it depends on; edges that would close a cycle are
+// dropped, as darwinbuild-recursive does.
+//
+
+struct node {
+	CFStringRef name;
+	int headers;
+	long weight;
+	int estimated;		// no history, weight is a guess
+	CFIndex* deps;
+	CFIndex ndeps;
+	CFIndex* dependents;
+	CFIndex ndependents;
+};
+
+struct graph {
+	struct node* nodes;
+	CFIndex count;
+	CFIndex capacity;
+	CFMutableDictionaryRef index[2];	// name -> index + 1, or -1 while visiting; [1] for -headers
+	CFMutableDictionaryRef closure[2];	// name -> build closure, [1] header closure
+	CFMutableDictionaryRef durations[2];	// name -> seconds, [1] for installhdrs
+};
+
+static int addClosureEdge(void* pArg, int argc, char **argv, char** columnNames) {
+	struct graph* g = pArg;
+	CFMutableDictionaryRef dict = g->closure[strcmp(argv[0], "header") == 0];
+	CFStringRef project = cfstr(argv[1]);
+	CFStringRef dep = cfstr(argv[2]);
+	CFMutableArrayRef deps = (CFMutableArrayRef)CFDictionaryGetValue(dict, project);
+	if (deps == NULL) {
+		deps = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+		CFDictionarySetValue(dict, project, deps);
+		CFRelease(deps);
+	}
+	CFArrayAppendValue(deps, dep);
+	CFRelease(project);
+	CFRelease(dep);
+	return 0;
+}
+
+static int addDuration(void* pArg, int argc, char **argv, char** columnNames) {
+	struct graph* g = pArg;
+	CFMutableDictionaryRef dict = g->durations[strcmp(argv[1], "installhdrs") == 0];
+	CFStringRef project = cfstr(argv[0]);
+	long seconds = atol(argv[2]);
+	CFNumberRef num = CFNumberCreate(NULL, kCFNumberLongType, &seconds);
+	CFDictionarySetValue(dict, project, num);
+	CFRelease(num);
+	CFRelease(project);
+	return 0;
+}
+
+static CFIndex visit(struct graph* g, CFStringRef name, int headers) {
+	intptr_t value = (intptr_t)CFDictionaryGetValue(g->index[headers], name);
+	if (value != 0) return value > 0 ? value - 1 : -1;
+	CFDictionarySetValue(g->index[headers], name, (const void*)(intptr_t)-1);
+
+	CFIndex* deps = NULL;
+	CFIndex ndeps = 0, i, j, kind;
+	for (kind = 1; kind >= 0; --kind) {
+		// header dependencies first, like darwinbuild-recursive
+		CFArrayRef closure = CFDictionaryGetValue(g->closure[kind], name);
+		CFIndex count = closure ? CFArrayGetCount(closure) : 0;
+		for (i = 0; i < count; ++i) {
+			CFIndex dep = visit(g, CFArrayGetValueAtIndex(closure, i), kind);
+			if (dep < 0) continue;
+			for (j = 0; j < ndeps && deps[j] != dep; ++j);
+			if (j < ndeps) continue;
+			deps = realloc(deps, (ndeps + 1) * sizeof(CFIndex));
+			deps[ndeps++] = dep;
+		}
+	}
+
+	if (g->count == g->capacity) {
+		g->capacity = g->capacity ? g->capacity * 2 : 64;
+		g->nodes = realloc(g->nodes, g->capacity * sizeof(struct node));
+	}
+	CFIndex index = g->count++;
+	struct node* n = &g->nodes[index];
+	memset(n, 0, sizeof(*n));
+	n->name = CFRetain(name);
+	n->headers = headers;
+	n->deps = deps;
+	n->ndeps = ndeps;
+	CFNumberRef num = CFDictionaryGetValue(g->durations[headers], name);
+	if (num) {
+		CFNumberGetValue(num, kCFNumberLongType, &n->weight);
+	} else {
+		n->estimated = 1;
+	}
+	CFDictionarySetValue(g->index[headers], name, (const void*)(intptr_t)(index + 1));
+	return index;
+}
+
+static int compareLong(const void* a, const void* b) {
+	long x = *(const long*)a, y = *(const long*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Projects without history are assumed to take as long as the median build.
+static long estimateUnknown(struct graph* g) {
+	CFIndex i, count = 0;
+	long median = 0;
+	long* known = calloc(g->count + 1, sizeof(long));
+	for (i = 0; i < g->count; ++i) {
+		if (!g->nodes[i].estimated) known[count++] = g->nodes[i].weight;
+	}
+	if (count > 0) {
+		qsort(known, count, sizeof(long), &compareLong);
+		median = known[count / 2];
+	}
+	for (i = 0; i < g->count; ++i) {
+		if (g->nodes[i].estimated) g->nodes[i].weight = median;
+	}
+	free(known);
+	return median;
+}
+
+//
+// Simulates darwinbuild-recursive with the given number of jobs: whenever a
+// job slot is free, the ready node with the longest remaining path (tail)
+// starts.  Returns the time the last job finishes.
+//
+static long simulate(struct graph* g, const long* tail, int jobs) {
+	CFIndex n = g->count, i, j;
+	CFIndex* pending = calloc(n + 1, sizeof(CFIndex));
+	char* ready = calloc(n + 1, 1);
+	long* finish = calloc(n + 1, sizeof(long));
+	char* running = calloc(n + 1, 1);
+	CFIndex nrunning = 0, remaining = n;
+	long now = 0;
+
+	for (i = 0; i < n; ++i) {
+		pending[i] = g->nodes[i].ndeps;
+		ready[i] = (pending[i] == 0);
+	}
+	while (remaining > 0) {
+		while (nrunning < jobs) {
+			CFIndex best = -1;
+			for (i = 0; i < n; ++i) {
+				if (ready[i] && (best < 0 || tail[i] > tail[best])) best = i;
+			}
+			if (best < 0) break;
+			ready[best] = 0;
+			running[best] = 1;
+			finish[best] = now + g->nodes[best].weight;
+			++nrunning;
+		}
+		if (nrunning == 0) break;
+
+		now = -1;
+		for (i = 0; i < n; ++i) {
+			if (running[i] && (now < 0 || finish[i] < now)) now = finish[i];
+		}
+		for (i = 0; i < n; ++i) {
+			if (!running[i] || finish[i] != now) continue;
+			running[i] = 0;
+			--nrunning;
+			--remaining;
+			for (j = 0; j < g->nodes[i].ndependents; ++j) {
+				CFIndex d = g->nodes[i].dependents[j];
+				if (--pending[d] == 0) ready[d] = 1;
+			}
+		}
+	}
+
+	free(pending);
+	free(ready);
+	free(finish);
+	free(running);
+	return now;
+}
+
+static int critical(CFStringRef build, CFArrayRef roots, int jobs) {
+	struct graph g;
+	CFIndex i, j;
+	int res, k;
+	char buf[32];
+
+	memset(&g, 0, sizeof(g));
+	for (k = 0; k < 2; ++k) {
+		g.index[k] = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+		g.closure[k] = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		g.durations[k] = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	}
+
+	res = DBUpdateDependencyClosure(build, NULL);
+	if (res == 0) {
+		char* cbuild = strdup_cfstr(build);
+		res = SQL_CALLBACK(&addClosureEdge, &g,
+			"SELECT DISTINCT kind, project, dep FROM dependency_closure WHERE build=%Q AND kind IN ('build', 'header') AND depth>0 ORDER BY project, kind, dep",
+			cbuild);
+		free(cbuild);
+	}
+	if (res == 0) res = SQL_CALLBACK(&addDuration, &g, RECENT_DURATIONS);
+
+	if (res == 0) {
+		CFIndex estimated = 0;
+		long total = 0;
+
+		for (i = 0; i < CFArrayGetCount(roots); ++i) {
+			visit(&g, CFArrayGetValueAtIndex(roots, i), 0);
+		}
+		for (i = 0; i < g.count; ++i) {
+			struct node* n = &g.nodes[i];
+			for (j = 0; j < n->ndeps; ++j) {
+				struct node* d = &g.nodes[n->deps[j]];
+				d->dependents = realloc(d->dependents, (d->ndependents + 1) * sizeof(CFIndex));
+				d->dependents[d->ndependents++] = i;
+			}
+			estimated += n->estimated;
+		}
+		long median = estimateUnknown(&g);
+
+		// longest path ending at each node, and from each node to the end
+		long* head = calloc(g.count + 1, sizeof(long));
+		CFIndex* pred = calloc(g.count + 1, sizeof(CFIndex));
+		long* tail = calloc(g.count + 1, sizeof(long));
+		CFIndex last = -1;
+		for (i = 0; i < g.count; ++i) {
+			struct node* n = &g.nodes[i];
+			pred[i] = -1;
+			for (j = 0; j < n->ndeps; ++j) {
+				if (pred[i] < 0 || head[n->deps[j]] > head[pred[i]]) pred[i] = n->deps[j];
+			}
+			head[i] = n->weight + (pred[i] < 0 ? 0 : head[pred[i]]);
+			if (last < 0 || head[i] > head[last]) last = i;
+			total += n->weight;
+		}
+		for (i = g.count - 1; i >= 0; --i) {
+			struct node* n = &g.nodes[i];
+			tail[i] = n->weight;
+			for (j = 0; j < n->ndependents; ++j) {
+				if (n->weight + tail[n->dependents[j]] > tail[i]) tail[i] = n->weight + tail[n->dependents[j]];
+			}
+		}
+
+		if (last >= 0) {
+			CFIndex length = 0;
+			CFIndex* path = calloc(g.count + 1, sizeof(CFIndex));
+			for (i = last; i >= 0; i = pred[i]) path[length++] = i;
+			fprintf(stdout, "Critical path: %s\n", formatDuration(head[last], buf, sizeof(buf)));
+			while (length > 0) {
+				struct node* n = &g.nodes[path[--length]];
+				fprintf(stdout, "%14s  ", formatDuration(n->weight, buf, sizeof(buf)));
+				cfprintf(stdout, "%@%s%s\n", n->name, n->headers ? " -headers" : "", n->estimated ? " (estimated)" : "");
+			}
+			free(path);
+		}
+		fprintf(stdout, "Total build time: %s in %ld builds", formatDuration(total, buf, sizeof(buf)), (long)g.count);
+		if (estimated) fprintf(stdout, " (%ld without history, estimated at %s each)", (long)estimated, formatDuration(median, buf, sizeof(buf)));
+		fprintf(stdout, "\n");
+		fprintf(stdout, "ETA with %d job%s: %s\n", jobs, jobs == 1 ? "" : "s", formatDuration(simulate(&g, tail, jobs), buf, sizeof(buf)));
+
+		free(head);
+		free(pred);
+		free(tail);
+	}
+
+	for (i = 0; i < g.count; ++i) {
+		CFRelease(g.nodes[i].name);
+		free(g.nodes[i].deps);
+		free(g.nodes[i].dependents);
+	}
+	free(g.nodes);
+	for (k = 0; k < 2; ++k) {
+		CFRelease(g.index[k]);
+		CFRelease(g.closure[k]);
+		CFRelease(g.durations[k]);
+	}
+	return res;
+}
+
+static int run(CFArrayRef argv) {
+	int res = 0;
+	CFIndex i = 0, count = CFArrayGetCount(argv);
+	CFStringRef mode = count > 0 ? CFArrayGetValueAtIndex(argv, 0) : CFSTR("-slowest");
+
+	if (CFEqual(mode, CFSTR("-record"))) {
+		CFMutableArrayRef rest = CFArrayCreateMutableCopy(NULL, 0, argv);
+		CFArrayRemoveValueAtIndex(rest, 0);
+		res = record(rest);
+		CFRelease(rest);
+		return res == -1 ? -1 : (res == 0 ? 0 : 1);
+	}
+
+	create_tables();
+	if (CFEqual(mode, CFSTR("-slowest"))) {
+		int limit = 20;
+		if (count > 2) return -1;
+		if (count == 2) {
+			char* str = strdup_cfstr(CFArrayGetValueAtIndex(argv, 1));
+			limit = atoi(str);
+			free(str);
+			if (limit <= 0) return -1;
+		}
+		res = slowest(limit);
+	} else if (CFEqual(mode, CFSTR("-durations"))) {
+		// "action<TAB>project<TAB>seconds" lines for darwinbuild-recursive
+		if (count != 1) return -1;
+		res = SQL_CALLBACK(&printDuration, NULL, RECENT_DURATIONS " ORDER BY project, action");
+	} else if (CFEqual(mode, CFSTR("-critical"))) {
+		int jobs = 1;
+		CFStringRef build = DBGetCurrentBuild();
+		CFMutableArrayRef roots = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+		for (i = 1; i < count; ++i) {
+			CFStringRef arg = CFArrayGetValueAtIndex(argv, i);
+			if (CFEqual(arg, CFSTR("-jobs")) && i + 1 < count) {
+				char* str = strdup_cfstr(CFArrayGetValueAtIndex(argv, ++i));
+				jobs = atoi(str);
+				free(str);
+			} else if (CFEqual(arg, CFSTR("-group")) && i + 1 < count) {
+				CFArrayRef members = DBCopyGroupMembers(build, CFArrayGetValueAtIndex(argv, ++i));
+				if (members) {
+					CFArrayAppendArray(roots, members, CFRangeMake(0, CFArrayGetCount(members)));
+					CFRelease(members);
+				}
+			} else {
+				CFArrayAppendValue(roots, arg);
+			}
+		}
+		if (jobs <= 0 || CFArrayGetCount(roots) == 0) {
+			CFRelease(roots);
+			return -1;
+		}
+		res = critical(build, roots, jobs);
+		CFRelease(roots);
+	} else {
+		return -1;
+	}
+	return res == 0 ? 0 : 1;
+}
+
+static CFStringRef usage() {
+	return CFRetain(CFSTR("[-slowest [<count>]] | -durations | -critical [-jobs <n>] [-group <group>] [<project> ...] | -record <project> <version> <build_version> <action> <exit_status> [<phase>=<seconds> ...]"));
+}
+
+int initialize(int version) {
+	//if ( version < kDBPluginCurrentVersion ) return -1;
+	
+	DBPluginSetType(kDBPluginBasicType);
+	DBPluginSetName(CFSTR("buildstats"));
+	DBPluginSetRunFunc(&run);
+	DBPluginSetUsageFunc(&usage);
+	return 0;
+}
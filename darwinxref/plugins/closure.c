@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include "DBPlugin.h"
+#include "DBDataStore.h"
+
+static int printDep(void* pArg, int argc, char **argv, char** columnNames) {
+	fprintf(stdout, "%s\n", argv[0]);
+	return 0;
+}
+
+static int printEdge(void* pArg, int argc, char **argv, char** columnNames) {
+	fprintf(stdout, "%s\t%s\t%s\n", argv[0], argv[1], argv[2]);
+	return 0;
+}
+
+static int run(CFArrayRef argv) {
+	int res = 0;
+	CFIndex count = CFArrayGetCount(argv);
+	if (count == 1 && CFEqual(CFArrayGetValueAtIndex(argv, 0), CFSTR("-rebuild"))) {
+		return DBRebuildDependencyClosure(DBGetCurrentBuild()) == 0 ? 0 : 1;
+	}
+	if (count == 1 && CFEqual(CFArrayGetValueAtIndex(argv, 0), CFSTR("-edges"))) {
+		// Dump every closure of the build as "kind<TAB>project<TAB>dep" lines,
+		// so callers can assemble the whole dependency graph with one query.
+		res = DBUpdateDependencyClosure(DBGetCurrentBuild(), NULL);
+		if (res == 0) {
+			char* build = strdup_cfstr(DBGetCurrentBuild());
+			res = SQL_CALLBACK(&printEdge, NULL,
+				"SELECT DISTINCT kind, project, dep FROM dependency_closure WHERE build=%Q AND depth>0 ORDER BY project, kind, dep",
+				build);
+			free(build);
+		}
+		return res == 0 ? 0 : 1;
+	}
+	if (count != 2) return -1;
+
+	CFStringRef type = CFArrayGetValueAtIndex(argv, 0);
+	CFStringRef project = CFArrayGetValueAtIndex(argv, 1);
+	const char* kind;
+	if (CFEqual(type, CFSTR("-run"))) {
+		kind = "run";
+	} else if (CFEqual(type, CFSTR("-build"))) {
+		kind = "build";
+	} else if (CFEqual(type, CFSTR("-header"))) {
+		kind = "header";
+	} else if (CFEqual(type, CFSTR("-staticlib"))) {
+		kind = "staticlib";
+	} else if (CFEqual(type, CFSTR("-lib"))) {
+		kind = "lib";
+	} else {
+		return -1;
+	}
+
+	res = DBUpdateDependencyClosure(DBGetCurrentBuild(), project);
+	if (res == 0) {
+		char* build = strdup_cfstr(DBGetCurrentBuild());
+		char* cproj = strdup_cfstr(project);
+		res = SQL_CALLBACK(&printDep, NULL,
+			"SELECT dep FROM dependency_closure WHERE build=%Q AND project=%Q AND kind=%Q AND depth>0 ORDER BY position",
+			build, cproj, kind);
+		free(build);
+		free(cproj);
+	}
+	return res == 0 ? 0 : 1;
+}
+
+static CFStringRef usage() {
+	return CFRetain(CFSTR("-rebuild | -edges | -run | -build | -header | -staticlib | -lib <project>"));
+}
+
+int initialize(int version) {
+	//if ( version < kDBPluginCurrentVersion ) return -1;
+	
+	DBPluginSetType(kDBPluginBasicType);
+	DBPluginSetName(CFSTR("closure"));
+	DBPluginSetRunFunc(&run);
+	DBPluginSetUsageFunc(&usage);
+	return 0;
+}
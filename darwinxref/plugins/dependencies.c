@@ -32,44 +32,67 @@
 
 #include "DBPlugin.h"
 
+struct dependencies_memo;
+static struct dependencies_memo* createDependenciesMemo(CFStringRef build);
+static void destroyDependenciesMemo(struct dependencies_memo* memo);
 void printDependencies(CFStringRef* types, CFStringRef* recursiveTypes, CFMutableSetRef visited, CFStringRef build, CFStringRef project, int indentLevel);
-
-
+static void walkDependencies(struct dependencies_memo* memo, CFStringRef* types, CFStringRef* recursiveTypes, CFMutableSetRef visited, CFStringRef project, int print);
+static void printClosure(CFSetRef closure);
 
 static int run(CFArrayRef argv) {
+	int closure = 0;
 	CFIndex count = CFArrayGetCount(argv);
-	if (count != 2) return -1;
+	if (count == 3 && CFEqual(CFArrayGetValueAtIndex(argv, 0), CFSTR("-closure"))) {
+		closure = 1;
+	} else if (count != 2) {
+		return -1;
+	}
 
-	CFStringRef project = CFArrayGetValueAtIndex(argv, 1);
+	CFStringRef project = CFArrayGetValueAtIndex(argv, count - 1);
 
-	CFStringRef type = CFArrayGetValueAtIndex(argv, 0);
+	CFStringRef type = CFArrayGetValueAtIndex(argv, count - 2);
+	CFStringRef* types;
+	CFStringRef* recursive;
+	CFStringRef runTypes[] = { CFSTR("lib"), CFSTR("run"), NULL };
+	CFStringRef buildTypes[] = { CFSTR("staticlib"), CFSTR("lib"), CFSTR("run"), CFSTR("build"), NULL };
+	CFStringRef headerTypes[] = { CFSTR("header"), NULL };
+	CFStringRef staticlibTypes[] = { CFSTR("staticlib"), NULL };
+	CFStringRef libTypes[] = { CFSTR("lib"), NULL };
+	CFStringRef none[] = { NULL };
 	if (CFEqual(type, CFSTR("-run"))) {
-		CFStringRef types[] = { CFSTR("lib"), CFSTR("run"), NULL };
-		printDependencies(types, types, NULL, DBGetCurrentBuild(), project, 0);
+		types = runTypes;
+		recursive = runTypes;
 	} else if (CFEqual(type, CFSTR("-build"))) {
-		CFStringRef types[] = { CFSTR("staticlib"), CFSTR("lib"), CFSTR("run"), CFSTR("build"), NULL };
-		CFStringRef recursive[] = { CFSTR("lib"), CFSTR("run"), NULL };
-		printDependencies(types, recursive, NULL, DBGetCurrentBuild(), project, 0);
+		types = buildTypes;
+		recursive = runTypes;
 	} else if (CFEqual(type, CFSTR("-header"))) {
-		CFStringRef types[] = { CFSTR("header"), NULL };
-		CFStringRef recursive[] = { NULL };
-		printDependencies(types, recursive, NULL, DBGetCurrentBuild(), project, 0);
+		types = headerTypes;
+		recursive = none;
 	} else if (CFEqual(type, CFSTR("-staticlib"))) {
-		CFStringRef types[] = { CFSTR("staticlib"), NULL };
-		CFStringRef recursive[] = { NULL };
-		printDependencies(types, recursive, NULL, DBGetCurrentBuild(), project, 0);
+		types = staticlibTypes;
+		recursive = none;
 	} else if (CFEqual(type, CFSTR("-lib"))) {
-		CFStringRef types[] = { CFSTR("lib"), NULL };
-		CFStringRef recursive[] = { NULL };
-		printDependencies(types, recursive, NULL, DBGetCurrentBuild(), project, 0);
+		types = libTypes;
+		recursive = none;
 	} else {
 		return -1;
 	}
+
+	if (closure) {
+		struct dependencies_memo* memo = createDependenciesMemo(DBGetCurrentBuild());
+		CFMutableSetRef visited = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+		walkDependencies(memo, types, recursive, visited, project, 0);
+		printClosure(visited);
+		CFRelease(visited);
+		destroyDependenciesMemo(memo);
+	} else {
+		printDependencies(types, recursive, NULL, DBGetCurrentBuild(), project, 0);
+	}
 	return 0;
 }
 
 static CFStringRef usage() {
-	return CFRetain(CFSTR("-run | -build | -header | -staticlib | -lib <project>"));
+	return CFRetain(CFSTR("[-closure] -run | -build | -header | -staticlib | -lib <project>"));
 }
 
 int initialize(int version) {
@@ -84,7 +107,8 @@ int initialize(int version) {
 	return 0;
 }
 
-// Dependencies are special, so we can't use a simple DBCopyPropDictionary() call.
+// Dependencies are special, so we can't use a simple DBCopyPropDictionary() call;
+// DBCopyMergedDependencies() merges them, for the closure table as well.
 //
 // We support additive and subtractive dependencies like so:
 //
@@ -121,93 +145,140 @@ int initialize(int version) {
 // gcc_select
 // gnumake
 
-static CFDictionaryRef copyDependenciesDictionary(CFStringRef build, CFStringRef project) {
-	CFArrayRef builds = DBCopyBuildInheritance(build);
-	CFMutableDictionaryRef result = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-	CFIndex i, count = CFArrayGetCount(builds);
-	
-	for (i = 0; i < count; ++i) {
-		build = CFArrayGetValueAtIndex(builds, i);
-		CFDictionaryRef deps = DBCopyOnePropDictionary(build, project, CFSTR("dependencies"));
-		if (deps == NULL) continue;
-		CFArrayRef keys = dictionaryGetSortedKeys(deps);
-		CFIndex k, kcount = CFArrayGetCount(keys);
-		// iterate through the array backwards, since we want to process these in the order:
-		// "foo", "-foo", "+foo".
-		for (k = kcount - 1; k >= 0; k--) {
-			CFStringRef key = CFArrayGetValueAtIndex(keys, k);
-			CFArrayRef newdeps = CFDictionaryGetValue(deps, key);
-			
-			UniChar first = CFStringGetCharacterAtIndex(key, 0);
-			if (first == '+') {
-				// add in these dependencies (if they don't already exist)
-				CFStringRef base = CFStringCreateWithSubstring(NULL, key, CFRangeMake(1, CFStringGetLength(key)-1));
-				CFMutableArrayRef olddeps = (CFMutableArrayRef)CFDictionaryGetValue(result, base);
-				if (olddeps != NULL) arrayAppendArrayDistinct(olddeps, newdeps);
-				CFRelease(base);
-			} else if (first == '-') {
-				// subtract these dependencies (if they exist)
-				CFStringRef base = CFStringCreateWithSubstring(NULL, key, CFRangeMake(1, CFStringGetLength(key)-1));
-				CFMutableArrayRef olddeps = (CFMutableArrayRef)CFDictionaryGetValue(result, base);
-				if (olddeps != NULL) {
-					CFIndex i, count = CFArrayGetCount(newdeps);
-					CFRange range = CFRangeMake(0, CFArrayGetCount(olddeps));
-					for (i = 0; i < count; ++i) {
-						CFStringRef item = CFArrayGetValueAtIndex(newdeps, i);
-						// XXX: assumes there's only one occurrance of the value
-						CFIndex idx = CFArrayGetFirstIndexOfValue(olddeps, range, item);
-						if (idx != kCFNotFound) {
-							CFArrayRemoveValueAtIndex(olddeps, idx);
-							--range.length;
-						}
-					}
-				}
-				CFRelease(base);
-			} else {
-				// replace the entire list of dependencies
-				CFDictionarySetValue(result, key, newdeps);
-			}
-		}
-		CFRelease(keys);
+//
+// Walking the dependency graph asks for the same projects' dependencies
+// over and over, so the merged dictionaries are kept for the duration of
+// one invocation, along with the build inheritance they are merged over.
+//
+
+struct dependencies_memo {
+	CFArrayRef builds;
+	CFMutableDictionaryRef projects;	// project -> merged dependencies
+};
+
+static struct dependencies_memo* createDependenciesMemo(CFStringRef build) {
+	struct dependencies_memo* memo = malloc(sizeof(struct dependencies_memo));
+	memo->builds = DBCopyBuildInheritance(build);
+	memo->projects = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	return memo;
+}
+
+static void destroyDependenciesMemo(struct dependencies_memo* memo) {
+	CFRelease(memo->builds);
+	CFRelease(memo->projects);
+	free(memo);
+}
+
+static CFDictionaryRef getDependenciesDictionary(struct dependencies_memo* memo, CFStringRef project) {
+	CFDictionaryRef result = CFDictionaryGetValue(memo->projects, project);
+	if (result == NULL) {
+		result = DBCopyMergedDependencies(memo->builds, project);
+		CFDictionarySetValue(memo->projects, project, result);
+		CFRelease(result);
 	}
-	CFRelease(builds);
 	return result;
 }
 
-void printDependencies(CFStringRef* types, CFStringRef* recursiveTypes, CFMutableSetRef visited, CFStringRef build, CFStringRef project, int indentLevel) {
-	if (!visited) visited = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
-	
-	CFDictionaryRef dependencies = copyDependenciesDictionary(build, project);
-	if (dependencies) {
-		CFStringRef* type = types;
-		while (*type != NULL) {
-			CFArrayRef array = CFDictionaryGetValue(dependencies, *type);
-			if (array) {
-				// if it's a single string, make it an array
-				if (CFGetTypeID(array) == CFStringGetTypeID()) {
-					array = CFArrayCreate(NULL, (const void**)&array, 1, &kCFTypeArrayCallBacks);
-				} else {
-					CFRetain(array);
-				}
-
-				CFIndex i, count = CFArrayGetCount(array);
-				for (i = 0; i < count; ++i) {
-					CFStringRef newproject = CFArrayGetValueAtIndex(array, i);
-					if (!CFSetContainsValue(visited, newproject)) {
-					  // use the indent level as a minimum
-					  // precision for the string ""
-						cfprintf(stdout, "%*s%@\n",
-							 indentLevel, "",
-							 newproject);
-						CFSetAddValue(visited, newproject);
-						printDependencies(recursiveTypes, recursiveTypes, visited, build, newproject, indentLevel+1);
-					}
-				}
-				
-				CFRelease(array);
+// Returns the dependencies of the given type, retained, as an array.
+static CFArrayRef copyDependenciesOfType(struct dependencies_memo* memo, CFStringRef project, CFStringRef type) {
+	CFArrayRef array = CFDictionaryGetValue(getDependenciesDictionary(memo, project), type);
+	if (array == NULL) return NULL;
+	return CFRetain(array);
+}
+
+//
+// The graph is walked depth first with an explicit stack, in the same
+// order the dependencies are listed, so that long chains don't exhaust
+// the C stack.  Each project is visited once; the first visit prints it
+// at its depth when printing a tree.
+//
+
+struct dependencies_frame {
+	CFStringRef project;
+	CFStringRef* types;
+	CFStringRef* type;	// the type being walked
+	CFArrayRef array;	// its dependencies, or NULL before it is fetched
+	CFIndex index;
+};
+
+static void walkDependencies(struct dependencies_memo* memo, CFStringRef* types, CFStringRef* recursiveTypes, CFMutableSetRef visited, CFStringRef project, int print) {
+	CFIndex depth = 0, capacity = 16;
+	struct dependencies_frame* stack = malloc(capacity * sizeof(struct dependencies_frame));
+	stack[0].project = project;
+	stack[0].types = types;
+	stack[0].type = types;
+	stack[0].array = NULL;
+	stack[0].index = 0;
+
+	while (depth >= 0) {
+		struct dependencies_frame* frame = &stack[depth];
+		if (*frame->type == NULL) {
+			--depth;
+			continue;
+		}
+		if (frame->array == NULL) {
+			frame->array = copyDependenciesOfType(memo, frame->project, *frame->type);
+			frame->index = 0;
+			if (frame->array == NULL) {
+				++frame->type;
+				continue;
 			}
-			++type;
 		}
-		CFRelease(dependencies);
+		if (frame->index >= CFArrayGetCount(frame->array)) {
+			CFRelease(frame->array);
+			frame->array = NULL;
+			++frame->type;
+			continue;
+		}
+
+		CFStringRef newproject = CFArrayGetValueAtIndex(frame->array, frame->index++);
+		if (CFSetContainsValue(visited, newproject)) continue;
+		if (print) {
+			// use the indent level as a minimum
+			// precision for the string ""
+			cfprintf(stdout, "%*s%@\n", (int)(print - 1 + depth), "", newproject);
+		}
+		CFSetAddValue(visited, newproject);
+
+		if (*recursiveTypes == NULL) continue;
+		if (depth + 1 == capacity) {
+			capacity *= 2;
+			stack = realloc(stack, capacity * sizeof(struct dependencies_frame));
+		}
+		frame = &stack[++depth];
+		frame->project = newproject;
+		frame->types = recursiveTypes;
+		frame->type = recursiveTypes;
+		frame->array = NULL;
+		frame->index = 0;
+	}
+	free(stack);
+}
+
+static void printClosure(CFSetRef closure) {
+	CFIndex i, count = CFSetGetCount(closure);
+	const void** values = malloc(count * sizeof(void*));
+	CFSetGetValues(closure, values);
+	CFMutableArrayRef array = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
+	for (i = 0; i < count; ++i) {
+		CFArrayAppendValue(array, values[i]);
+	}
+	free(values);
+	CFArraySortValues(array, CFRangeMake(0, count), (CFComparatorFunction)CFStringCompare, NULL);
+	for (i = 0; i < count; ++i) {
+		cfprintf(stdout, "%@\n", CFArrayGetValueAtIndex(array, i));
+	}
+	CFRelease(array);
+}
+
+void printDependencies(CFStringRef* types, CFStringRef* recursiveTypes, CFMutableSetRef visited, CFStringRef build, CFStringRef project, int indentLevel) {
+	struct dependencies_memo* memo = createDependenciesMemo(build);
+	if (visited) {
+		CFRetain(visited);
+	} else {
+		visited = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
 	}
+	walkDependencies(memo, types, recursiveTypes, visited, project, indentLevel + 1);
+	CFRelease(visited);
+	destroyDependenciesMemo(memo);
 }
@@ -46,7 +46,7 @@ static int run(CFArrayRef argv) {
 	if (count >= 1) build = CFArrayGetValueAtIndex(argv, 0);
 	if (count >= 2) project = CFArrayGetValueAtIndex(argv, 1);
 	int res = editPlist(build, project);
-	return res;
+	return (res == 0) ? 0 : 1;
 }
 
 static CFStringRef usage() {
@@ -98,7 +98,8 @@ static int run(CFArrayRef argv) {
 	} else {
 		res = writePlist(stdout, plist, 0);
 	}
-	return (int)res;
+	// res is the number of bytes written, not an exit status
+	return (res < 0) ? 1 : 0;
 }
 
 static CFStringRef usage() {
@@ -34,26 +34,58 @@
 #include "DBDataStore.h"
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <regex.h>
 
-static int findFile(char* file, char* build);
+enum {
+	kFindSuffix,	// path ends with <file>, case-insensitively
+	kFindExact,	// path is <file>
+	kFindBasename,	// last path component is <file>
+	kFindGlob,	// path matches the glob(7) pattern <file>
+};
+
+//
+// The last component of files.path.  rtrim() strips everything after the
+// last slash, since every character of the path other than a slash is in
+// its second argument.  Queries must spell the expression exactly the
+// same way for files_basename_index to be used.
+//
+#define FILES_BASENAME "substr(path, length(rtrim(path, replace(path, '/', ''))) + 1)"
+
+static int findFile(char* file, char* build, int mode);
 
 static int run(CFArrayRef argv) {
 	int res = 0;
+	int mode = kFindSuffix;
 	CFIndex count = CFArrayGetCount(argv);
-	if (count != 1)  return -1;
+	if (count == 2) {
+		CFStringRef opt = CFArrayGetValueAtIndex(argv, 0);
+		if (CFEqual(opt, CFSTR("-exact"))) {
+			mode = kFindExact;
+		} else if (CFEqual(opt, CFSTR("-basename"))) {
+			mode = kFindBasename;
+		} else if (CFEqual(opt, CFSTR("-glob"))) {
+			mode = kFindGlob;
+		} else {
+			return -1;
+		}
+	} else if (count != 1) {
+		return -1;
+	}
 
-	char* file = strdup_cfstr(CFArrayGetValueAtIndex(argv, 0));	
+	char* file = strdup_cfstr(CFArrayGetValueAtIndex(argv, count - 1));
 	char* build = strdup_cfstr(DBGetCurrentBuild());
 	
-	findFile(file, build);
+	findFile(file, build, mode);
 
 	if (file) free(file);
+	free(build);
 	return res;
 }
 
 static CFStringRef usage() {
-	return CFRetain(CFSTR("<file>"));
+	return CFRetain(CFSTR("[-exact | -basename | -glob] <file>"));
 }
 
 int initialize(int version) {
@@ -76,12 +108,43 @@ int printFiles(void* pArg, int argc, char **argv, char** columnNames) {
 	return 0;
 }
 
-static int findFile(char* file, char* build) {
+static int findFile(char* file, char* build, int mode) {
 	char project[BUFSIZ];
 	project[0] = 0;
-	asprintf(&file, "%%%s", file);
-	SQL_CALLBACK(&printFiles, project,
-		     "SELECT project,path FROM files WHERE build=%Q AND path LIKE %Q ORDER BY project, path",
-		     build, file);
+
+	// Both indexes are cheap to keep up and are otherwise only created
+	// by register and resolveDeps, so make sure they exist.
+	SQL_NOERR("CREATE INDEX files_path_index ON files (path)");
+	SQL_NOERR("CREATE INDEX files_basename_index ON files (" FILES_BASENAME ")");
+
+	if (mode == kFindExact) {
+		SQL_CALLBACK(&printFiles, project,
+			     "SELECT project,path FROM files WHERE build=%Q AND path=%Q ORDER BY project, path",
+			     build, file);
+	} else if (mode == kFindBasename) {
+		SQL_CALLBACK(&printFiles, project,
+			     "SELECT project,path FROM files WHERE build=%Q AND " FILES_BASENAME "=%Q ORDER BY project, path",
+			     build, file);
+	} else if (mode == kFindGlob) {
+		// A literal prefix is matched on files_path_index by sqlite
+		// itself.  A literal last component is matched on the basename.
+		char* name = strrchr(file, '/');
+		name = name ? name + 1 : file;
+		if (name[0] != 0 && strpbrk(name, "*?[") == NULL) {
+			SQL_CALLBACK(&printFiles, project,
+				     "SELECT project,path FROM files WHERE build=%Q AND " FILES_BASENAME "=%Q AND path GLOB %Q ORDER BY project, path",
+				     build, name, file);
+		} else {
+			SQL_CALLBACK(&printFiles, project,
+				     "SELECT project,path FROM files WHERE build=%Q AND path GLOB %Q ORDER BY project, path",
+				     build, file);
+		}
+	} else {
+		asprintf(&file, "%%%s", file);
+		SQL_CALLBACK(&printFiles, project,
+			     "SELECT project,path FROM files WHERE build=%Q AND path LIKE %Q ORDER BY project, path",
+			     build, file);
+		free(file);
+	}
 	return 0;
 }
@@ -35,24 +35,49 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sqlite3.h"
+#include "../../darwintrace/darwintrace.h"
 
-int loadDeps(const char* build, const char* project, const char *root);
+int loadDeps(const char* build, const char* project, const char *root, FILE* trace, int binary);
 
 static int run(CFArrayRef argv) {
 	int res = 0;
-	CFIndex count = CFArrayGetCount(argv);
-	if (count != 2)  return -1;
-	char* project = strdup_cfstr(CFArrayGetValueAtIndex(argv, 0));
-	char* root = strdup_cfstr(CFArrayGetValueAtIndex(argv, 1));
-	
-	char* build = strdup_cfstr(DBGetCurrentBuild());
-	loadDeps(build, project, root);
+	int binary = 0;
+	CFIndex i = 0, count = CFArrayGetCount(argv);
+	if (count > 0 && CFEqual(CFArrayGetValueAtIndex(argv, 0), CFSTR("-binary"))) {
+		binary = 1;
+		i = 1;
+	}
+	if (count - i != 2 && count - i != 3)  return -1;
+	char* project = strdup_cfstr(CFArrayGetValueAtIndex(argv, i));
+	char* root = strdup_cfstr(CFArrayGetValueAtIndex(argv, i + 1));
+	char* path = (count - i == 3) ? strdup_cfstr(CFArrayGetValueAtIndex(argv, i + 2)) : NULL;
+
+	FILE* trace = path ? fopen(path, "r") : stdin;
+	if (trace == NULL) {
+		fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+		res = 1;
+	} else {
+		char* build = strdup_cfstr(DBGetCurrentBuild());
+		if (loadDeps(build, project, root, trace, binary) != 0) res = 1;
+		if (trace != stdin) fclose(trace);
+		free(build);
+	}
 	free(project);
+	free(root);
+	free(path);
 	return res;
 }
 
 static CFStringRef usage() {
-	return CFRetain(CFSTR("<project> <buildroot>"));
+	return CFRetain(CFSTR("[-binary] <project> <buildroot> [<trace>]"));
 }
 
 int initialize(int version) {
@@ -65,74 +90,492 @@ int initialize(int version) {
 	return 0;
 }
 
-static int has_suffix(const char* big, const char* little) {
-	char* found = NULL;
-	while (1) {
-		char* next = strcasestr(found ? found+1 : big, little);
-		if (next) { found = next; } else { break; }
+//
+// The trace is read in full before anything is inserted.  Each line is
+// classified in place and added to a hash set of (type, path) pairs, so
+// a path that was opened a thousand times during the build is stat'ed
+// and inserted once.  The distinct paths are then stat'ed relative to
+// the buildroot by a few threads, and the survivors are inserted through
+// a single prepared statement, in the order they first appeared.
+//
+// With -binary the input is a darwintrace log in the binary format, read
+// as is; the process name and the other record fields are ignored.
+//
+// stat and access probes are dependencies just like opens of the same
+// path.  opendir records are dropped: resolveDeps only knows the files
+// projects install, so a directory would never resolve.
+//
+// The SHA-1 of every regular file the project read is stored along with
+// its size and mtime in input_digests, replacing the project's previous
+// inputs, so that darwinxref stale can tell whether any of them changed.
+// A file whose size and mtime match its row in file_digests, which
+// register fills in for every file it installs, is not read again; the
+// digests computed here are added to it in turn.
+//
+
+static const char* kTypeBuild = "build";
+static const char* kTypeHeader = "header";
+static const char* kTypeStaticLib = "staticlib";
+
+struct dep {
+	const char* type;
+	char* file;		// points into the arena
+	size_t len;
+	unsigned int hash;
+	int keep;		// set once the path is known not to be a directory
+	long long size;		// of a regular file, with its mtime and digest
+	long long mtime;
+	char* digest;		// from file_digests, or computed by stat_worker
+	int computed;
+};
+
+struct deps {
+	struct dep* items;
+	size_t count;
+	size_t capacity;
+	size_t* buckets;	// index+1 into items, 0 if empty
+	size_t nbuckets;
+	char* arena;		// the current chunk of path storage
+	size_t arena_used;
+	size_t arena_size;
+	char** chunks;
+	size_t nchunks;
+	char** types;		// record types other than the ones above
+	size_t ntypes;
+};
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+static int has_suffix(const char* str, size_t len, const char* suffix, size_t suffixlen) {
+	return len >= suffixlen && memcmp(str + len - suffixlen, suffix, suffixlen) == 0;
+}
+
+static const char* classify(const char* type, size_t typelen, const char* file, size_t len) {
+	if ((typelen == 4 && memcmp(type, "open", 4) == 0)
+	    || (typelen == 4 && memcmp(type, "stat", 4) == 0)
+	    || (typelen == 6 && memcmp(type, "access", 6) == 0)) {
+		if (has_suffix(file, len, ".h", 2)) {
+			return kTypeHeader;
+		} else if (has_suffix(file, len, ".a", 2)
+			   || has_suffix(file, len, ".o", 2)) {
+			return kTypeStaticLib;
+		}
+		return kTypeBuild;
+	} else if (typelen == 6 && memcmp(type, "execve", 6) == 0) {
+		return kTypeBuild;
+	} else if (typelen == 8 && memcmp(type, "readlink", 8) == 0) {
+		return kTypeBuild;
 	}
-	return found ? (strcmp(found, little) == 0) : 0;
+	return NULL;
 }
 
+static int ignored(const char* type, size_t typelen) {
+	return typelen == 7 && memcmp(type, "opendir", 7) == 0;
+}
 
-int loadDeps(const char* build, const char* project, const char *root) {
-	size_t size;
-	char* line;
-	int count = 0;
+// FNV-1a
+static unsigned int hash_dep(const char* type, const char* file, size_t len) {
+	unsigned int h = 2166136261U;
+	size_t i;
+	for (i = 0; type[i]; ++i) h = (h ^ (unsigned char)type[i]) * 16777619U;
+	for (i = 0; i < len; ++i) h = (h ^ (unsigned char)file[i]) * 16777619U;
+	return h;
+}
 
-	char* table = "CREATE TABLE unresolved_dependencies (build TEXT, project TEXT, type TEXT, dependency TEXT)";
-	char* index = "CREATE INDEX unresolved_dependencies_index ON unresolved_dependencies (build, project, type, dependency)";
+static char* deps_store(struct deps* d, const char* file, size_t len) {
+	if (d->arena == NULL || d->arena_used + len + 1 > d->arena_size) {
+		size_t size = len + 1 > ARENA_CHUNK_SIZE ? len + 1 : ARENA_CHUNK_SIZE;
+		char** chunks = realloc(d->chunks, (d->nchunks + 1) * sizeof(char*));
+		char* arena = malloc(size);
+		if (chunks == NULL || arena == NULL) {
+			free(arena);
+			if (chunks) d->chunks = chunks;
+			return NULL;
+		}
+		d->chunks = chunks;
+		d->chunks[d->nchunks++] = arena;
+		d->arena = arena;
+		d->arena_used = 0;
+		d->arena_size = size;
+	}
+	char* str = d->arena + d->arena_used;
+	memcpy(str, file, len);
+	str[len] = 0;
+	d->arena_used += len + 1;
+	return str;
+}
 
-	SQL_NOERR(table);
-	SQL_NOERR(index);
+// Record types are compared by pointer, so any type that classify() does
+// not know is kept under its own name, stored once.
+static const char* intern_type(struct deps* d, const char* type, size_t len) {
+	size_t i;
+	for (i = 0; i < d->ntypes; ++i) {
+		if (strlen(d->types[i]) == len && memcmp(d->types[i], type, len) == 0) {
+			return d->types[i];
+		}
+	}
+	char** types = realloc(d->types, (d->ntypes + 1) * sizeof(char*));
+	if (types == NULL) return NULL;
+	d->types = types;
+	char* str = deps_store(d, type, len);
+	if (str) d->types[d->ntypes++] = str;
+	return str;
+}
+
+static int deps_grow(struct deps* d) {
+	size_t i;
+	size_t nbuckets = d->nbuckets ? d->nbuckets * 2 : 4096;
+	size_t* buckets = calloc(nbuckets, sizeof(size_t));
+	struct dep* items = realloc(d->items, (nbuckets / 2) * sizeof(struct dep));
+	if (buckets == NULL || items == NULL) {
+		free(buckets);
+		if (items) d->items = items;
+		return -1;
+	}
+	d->items = items;
+	d->capacity = nbuckets / 2;
+	for (i = 0; i < d->count; ++i) {
+		size_t b = d->items[i].hash & (nbuckets - 1);
+		while (buckets[b]) b = (b + 1) & (nbuckets - 1);
+		buckets[b] = i + 1;
+	}
+	free(d->buckets);
+	d->buckets = buckets;
+	d->nbuckets = nbuckets;
+	return 0;
+}
+
+// Returns 1 if the pair was added, 0 if it was already present.
+static int deps_add(struct deps* d, const char* type, const char* file, size_t len) {
+	if (d->count >= d->capacity && deps_grow(d) != 0) return -1;
+
+	unsigned int hash = hash_dep(type, file, len);
+	size_t b = hash & (d->nbuckets - 1);
+	while (d->buckets[b]) {
+		struct dep* dep = &d->items[d->buckets[b] - 1];
+		if (dep->hash == hash && dep->type == type && dep->len == len &&
+		    memcmp(dep->file, file, len) == 0) {
+			return 0;
+		}
+		b = (b + 1) & (d->nbuckets - 1);
+	}
+
+	char* str = deps_store(d, file, len);
+	if (str == NULL) return -1;
+	struct dep* dep = &d->items[d->count];
+	dep->type = type;
+	dep->file = str;
+	dep->len = len;
+	dep->hash = hash;
+	dep->keep = 0;
+	dep->size = dep->mtime = -1;
+	dep->digest = NULL;
+	dep->computed = 0;
+	d->buckets[b] = ++d->count;
+	return 1;
+}
+
+static void deps_free(struct deps* d) {
+	size_t i;
+	for (i = 0; i < d->count; ++i) free(d->items[i].digest);
+	for (i = 0; i < d->nchunks; ++i) free(d->chunks[i]);
+	free(d->chunks);
+	free(d->types);
+	free(d->buckets);
+	free(d->items);
+}
+
+// the types of dependency whose content is digested
+static int has_content(const struct dep* dep) {
+	return dep->type == kTypeBuild || dep->type == kTypeHeader || dep->type == kTypeStaticLib;
+}
+
+// Looks up the digests already known for the paths to be digested.
+static int lookup_digests(const char* build, struct deps* d) {
+	size_t i;
+	sqlite3* db = (sqlite3*)_DBPluginGetDataStorePtr();
+	sqlite3_stmt* stmt = NULL;
+
+	if (sqlite3_prepare_v2(db, "SELECT size, mtime, digest FROM file_digests WHERE build=? AND path=?", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, build, -1, SQLITE_STATIC);
+	for (i = 0; i < d->count; ++i) {
+		struct dep* dep = &d->items[i];
+		if (!has_content(dep)) continue;
+		sqlite3_bind_text(stmt, 2, dep->file, (int)dep->len, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char* digest = (const char*)sqlite3_column_text(stmt, 2);
+			dep->size = sqlite3_column_int64(stmt, 0);
+			dep->mtime = sqlite3_column_int64(stmt, 1);
+			dep->digest = digest ? strdup(digest) : NULL;
+		}
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
+// Keeps the digest from file_digests if the file still matches it.
+static void digest_dep(struct dep* dep, int rootfd, const char* relpath, const struct stat* sb) {
+	if (dep->digest && dep->size == (long long)sb->st_size && dep->mtime == (long long)sb->st_mtime) {
+		return;
+	}
+	free(dep->digest);
+	dep->digest = NULL;
+	dep->size = sb->st_size;
+	dep->mtime = sb->st_mtime;
+	int fd = openat(rootfd, relpath, O_RDONLY);
+	if (fd == -1) return;
+	dep->digest = calculate_digest(fd);
+	dep->computed = (dep->digest != NULL);
+	close(fd);
+}
+
+struct stat_pool {
+	pthread_mutex_t lock;
+	struct deps* deps;
+	size_t next;		// next entry to be claimed
+	int rootfd;
+};
+
+#define STAT_BATCH_SIZE 256
+
+static void* stat_worker(void* arg) {
+	struct stat_pool* p = arg;
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		size_t start = p->next;
+		if (p->next < p->deps->count) p->next += STAT_BATCH_SIZE;
+		pthread_mutex_unlock(&p->lock);
+		if (start >= p->deps->count) break;
+
+		size_t end = start + STAT_BATCH_SIZE;
+		if (end > p->deps->count) end = p->deps->count;
+		for (; start < end; ++start) {
+			struct dep* dep = &p->deps->items[start];
+			struct stat sb;
+			// paths in the trace are absolute; look them up under the buildroot
+			const char* relpath = dep->file;
+			while (*relpath == '/') ++relpath;
+			if (*relpath == 0) continue;	// the root itself is a directory
+			int res = fstatat(p->rootfd, relpath, &sb, AT_SYMLINK_NOFOLLOW);
+			// for now, skip if the path points to a directory
+			dep->keep = (res == 0 && !S_ISDIR(sb.st_mode));
+			if (dep->keep && has_content(dep) && S_ISREG(sb.st_mode)) {
+				digest_dep(dep, p->rootfd, relpath, &sb);
+			} else {
+				free(dep->digest);
+				dep->digest = NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void stat_deps(struct deps* d, int rootfd) {
+	int i, nthreads = 0;
+	struct stat_pool pool;
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.deps = d;
+	pool.next = 0;
+	pool.rootfd = rootfd;
+
+	// The calling thread works too.
+	int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1) jobs = 1;
+	if ((size_t)jobs > d->count / STAT_BATCH_SIZE + 1) jobs = (int)(d->count / STAT_BATCH_SIZE + 1);
+	pthread_t* threads = calloc((size_t)jobs, sizeof(pthread_t));
+	for (i = 0; threads && i < jobs - 1; ++i) {
+		if (pthread_create(&threads[nthreads], NULL, stat_worker, &pool) == 0) {
+			++nthreads;
+		}
+	}
+	stat_worker(&pool);
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+static int insert_deps(const char* build, const char* project, struct deps* d, int* loaded) {
+	int res = 0;
+	size_t i;
+	sqlite3* db = (sqlite3*)_DBPluginGetDataStorePtr();
+	sqlite3_stmt* stmt = NULL;
+
+	if (sqlite3_prepare_v2(db, "INSERT INTO unresolved_dependencies (build,project,type,dependency) VALUES (?,?,?,?)", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, build, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, project, -1, SQLITE_STATIC);
+
+	for (i = 0; i < d->count; ++i) {
+		struct dep* dep = &d->items[i];
+		if (!dep->keep) continue;
+		sqlite3_bind_text(stmt, 3, dep->type, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, dep->file, (int)dep->len, SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "%s: %s\n", dep->file, sqlite3_errmsg(db));
+			res = -1;
+			break;
+		}
+		sqlite3_reset(stmt);
+		++*loaded;
+	}
+	sqlite3_finalize(stmt);
+	return res;
+}
+
+// Replaces the project's inputs, and adds the new digests to file_digests.
+static int insert_digests(const char* build, const char* project, struct deps* d) {
+	int res = 0;
+	size_t i;
+	sqlite3* db = (sqlite3*)_DBPluginGetDataStorePtr();
+	sqlite3_stmt* input = NULL;
+	sqlite3_stmt* cache = NULL;
 
-	if (SQL("BEGIN")) { return -1; }
+	if (SQL("DELETE FROM input_digests WHERE build=%Q AND project=%Q", build, project)) {
+		return -1;
+	}
+	if (sqlite3_prepare_v2(db, "INSERT INTO input_digests (build,project,path,size,mtime,digest) VALUES (?,?,?,?,?,?)", -1, &input, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO file_digests (build,path,size,mtime,digest) VALUES (?,?,?,?,?)", -1, &cache, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		sqlite3_finalize(input);
+		return -1;
+	}
+	sqlite3_bind_text(input, 1, build, -1, SQLITE_STATIC);
+	sqlite3_bind_text(input, 2, project, -1, SQLITE_STATIC);
+	sqlite3_bind_text(cache, 1, build, -1, SQLITE_STATIC);
 
-	while ((line = fgetln(stdin, &size)) != NULL) {
-		if (line[size-1] == '\n') line[size-1] = 0; // chomp newline
+	for (i = 0; res == 0 && i < d->count; ++i) {
+		struct dep* dep = &d->items[i];
+		if (!dep->keep || dep->digest == NULL) continue;
+		sqlite3_bind_text(input, 3, dep->file, (int)dep->len, SQLITE_STATIC);
+		sqlite3_bind_int64(input, 4, dep->size);
+		sqlite3_bind_int64(input, 5, dep->mtime);
+		sqlite3_bind_text(input, 6, dep->digest, -1, SQLITE_STATIC);
+		if (sqlite3_step(input) != SQLITE_DONE) res = -1;
+		sqlite3_reset(input);
+		if (res == 0 && dep->computed) {
+			sqlite3_bind_text(cache, 2, dep->file, (int)dep->len, SQLITE_STATIC);
+			sqlite3_bind_int64(cache, 3, dep->size);
+			sqlite3_bind_int64(cache, 4, dep->mtime);
+			sqlite3_bind_text(cache, 5, dep->digest, -1, SQLITE_STATIC);
+			if (sqlite3_step(cache) != SQLITE_DONE) res = -1;
+			sqlite3_reset(cache);
+		}
+		if (res != 0) fprintf(stderr, "%s: %s\n", dep->file, sqlite3_errmsg(db));
+	}
+	sqlite3_finalize(input);
+	sqlite3_finalize(cache);
+	return res;
+}
+
+// Returns the number of records read, or -1.
+static int read_text(struct deps* d, FILE* trace) {
+	size_t size;
+	char* line;
+	int count = 0;
+
+	while ((line = fgetln(trace, &size)) != NULL) {
+		if (size > 0 && line[size-1] == '\n') --size; // chomp newline
 		char* tab = memchr(line, '\t', size);
 		if (tab) {
-		  	char fullpath[MAXPATHLEN];
-			char *type, *file;
-			struct stat sb;
-			int typesize = (int)((intptr_t)tab - (intptr_t)line);
-			asprintf(&type, "%.*s", typesize, line);
-			asprintf(&file, "%.*s", (int)size - typesize - 1, tab+1);
-			if (strcmp(type, "open") == 0) {
-				free(type);
-				if (has_suffix(file, ".h")) {
-					type = "header";
-				} else if (has_suffix(file, ".a")
-					   || has_suffix(file, ".o")) {
-					type = "staticlib";
-				} else {
-					type = "build";
-				}
-			} else if (strcmp(type, "execve") == 0) {
-				free(type);
-				type = "build";
-			} else if (strcmp(type, "readlink") == 0) {
-				free(type);
-				type = "build";
+			size_t typesize = (size_t)(tab - line);
+			const char* file = tab + 1;
+			size_t filesize = size - typesize - 1;
+			if (ignored(line, typesize)) {
+				++count;
+				continue;
 			}
-			
-			sprintf(fullpath, "%s/%s", root, file);
-			int res = lstat(fullpath, &sb);
-			// for now, skip if the path points to a directory
-			if (res == 0 && !S_ISDIR(sb.st_mode)) {
-				SQL("INSERT INTO unresolved_dependencies (build,project,type,dependency) VALUES (%Q,%Q,%Q,%Q)",
-					build, project, type, file);
+			const char* type = classify(line, typesize, file, filesize);
+			if (type == NULL) type = intern_type(d, line, typesize);
+			if (type == NULL || deps_add(d, type, file, filesize) < 0) {
+				fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+				return -1;
 			}
-			free(file);
 		} else {
 			fprintf(stderr, "Error: syntax error in input.  no tab delimiter found.\n");
 		}
 		++count;
 	}
+	return count;
+}
 
-	if (SQL("COMMIT")) { return -1; }
+static int read_binary(struct deps* d, FILE* trace) {
+	struct darwintrace_reader reader;
+	struct darwintrace_record rec;
+	const char* name;
+	const char* file;
+	int count = 0, res;
 
-	fprintf(stderr, "loaded %d unresolved dependencies.\n", count);
+	darwintrace_reader_init(&reader, trace);
+	while ((res = darwintrace_read(&reader, &rec, &name, &file)) > 0) {
+		const char* tag = darwintrace_op_name(rec.op);
+		if (tag == NULL || DARWINTRACE_OP_PROCESS(rec.op)) continue;
+		size_t typesize = strlen(tag);
+		size_t filesize = strlen(file);
+		if (ignored(tag, typesize)) continue;
+		const char* type = classify(tag, typesize, file, filesize);
+		if (type == NULL) type = intern_type(d, tag, typesize);
+		if (type == NULL || deps_add(d, type, file, filesize) < 0) {
+			fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+			count = -1;
+			break;
+		}
+		++count;
+	}
+	if (res < 0) {
+		fprintf(stderr, "Error: malformed binary trace after %d records.\n", count);
+		count = -1;
+	}
+	darwintrace_reader_free(&reader);
+	return count;
+}
 
-	return 0;
+int loadDeps(const char* build, const char* project, const char *root, FILE* trace, int binary) {
+	int count, loaded = 0;
+	int res = 0;
+	struct deps deps;
+	memset(&deps, 0, sizeof(deps));
+
+	char* table = "CREATE TABLE unresolved_dependencies (build TEXT, project TEXT, type TEXT, dependency TEXT)";
+	char* index = "CREATE INDEX unresolved_dependencies_index ON unresolved_dependencies (build, project, type, dependency)";
+
+	SQL_NOERR(table);
+	SQL_NOERR(index);
+
+	int rootfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (rootfd == -1) {
+		fprintf(stderr, "Error: %s: %s\n", root, strerror(errno));
+		return -1;
+	}
+
+	count = binary ? read_binary(&deps, trace) : read_text(&deps, trace);
+	if (count < 0) res = -1;
+
+	if (res == 0 && lookup_digests(build, &deps) != 0) res = -1;
+
+	if (res == 0) {
+		stat_deps(&deps, rootfd);
+		if (SQL("BEGIN")) {
+			res = -1;
+		} else {
+			res = insert_deps(build, project, &deps, &loaded);
+			if (res == 0) res = insert_digests(build, project, &deps);
+			if (SQL(res == 0 ? "COMMIT" : "ROLLBACK")) res = -1;
+		}
+	}
+	close(rootfd);
+	deps_free(&deps);
+
+	if (res == 0) {
+		fprintf(stderr, "loaded %d unresolved dependencies (%d trace records).\n", loaded, count);
+	}
+
+	return res;
 }
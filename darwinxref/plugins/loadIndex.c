@@ -43,7 +43,7 @@ static int run(CFArrayRef argv) {
 		res = DBSetPlist(NULL, NULL, plist);
 	}
 	free(filename);
-	return res;
+	return (res == 0) ? 0 : 1;
 }
 
 static CFStringRef usage() {
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include "DBPlugin.h"
+#include "DBDataStore.h"
+#include <sys/param.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "../../darwintrace/darwintrace.h"
+
+//
+// darwinbuild -logdeps hands the raw darwintrace log of a build to
+//
+//	darwinxref processTrace <project> <trace> <buildroot> [<root> ...]
+//
+// which reads it once, in either format, and turns each record into a
+// "<type>\t<path>" line for loadDeps:
+//
+//	- the process name and pid are dropped,
+//	- the longest of the buildroot, the other roots and their real paths
+//	  is stripped from the front of the path, then a leading /Developer,
+//	- relative paths and those under /SourceCache, /tmp, /var/tmp, /dev
+//	  and /XCD are dropped,
+//	- and each (type, path) pair is passed on once.
+//
+// The result is loaded with loadDeps and committed with resolveDeps, in
+// this process. With -print, the lines are written to stdout instead.
+// A trace of "-" is read from stdin.
+//
+
+struct roots {
+	char** paths;		// longest first
+	size_t count;
+};
+
+struct seen {
+	uint64_t* hashes;	// 0 if empty
+	size_t count;
+	size_t nbuckets;
+};
+
+int processTrace(const char* project, const char* tracepath, const char* buildroot, struct roots* roots, FILE* out);
+
+static void roots_add(struct roots* r, const char* path) {
+	char* copy = strdup(path);
+	if (copy == NULL) return;
+	size_t len = strlen(copy);
+	while (len > 1 && copy[len - 1] == '/') copy[--len] = 0;
+
+	size_t i;
+	for (i = 0; i < r->count; ++i) {
+		if (strcmp(r->paths[i], copy) == 0) {
+			free(copy);
+			return;
+		}
+	}
+	char** paths = realloc(r->paths, (r->count + 1) * sizeof(char*));
+	if (paths == NULL) {
+		free(copy);
+		return;
+	}
+	r->paths = paths;
+	for (i = r->count; i > 0 && strlen(r->paths[i - 1]) < len; --i) {
+		r->paths[i] = r->paths[i - 1];
+	}
+	r->paths[i] = copy;
+	++r->count;
+}
+
+static void roots_free(struct roots* r) {
+	size_t i;
+	for (i = 0; i < r->count; ++i) free(r->paths[i]);
+	free(r->paths);
+}
+
+static int run(CFArrayRef argv) {
+	int res = 0;
+	int print = 0;
+	CFIndex i = 0, count = CFArrayGetCount(argv);
+	if (count > 0 && CFEqual(CFArrayGetValueAtIndex(argv, 0), CFSTR("-print"))) {
+		print = 1;
+		i = 1;
+	}
+	// -print has no project
+	if (count - i < 3 - print)  return -1;
+	char* project = print ? NULL : strdup_cfstr(CFArrayGetValueAtIndex(argv, i++));
+	char* trace = strdup_cfstr(CFArrayGetValueAtIndex(argv, i++));
+	char* buildroot = strdup_cfstr(CFArrayGetValueAtIndex(argv, i));
+
+	// paths in the trace may be under any of these, or their real paths
+	struct roots roots;
+	memset(&roots, 0, sizeof(roots));
+	for (; i < count; ++i) {
+		char* root = strdup_cfstr(CFArrayGetValueAtIndex(argv, i));
+		char resolved[MAXPATHLEN];
+		roots_add(&roots, root);
+		if (realpath(root, resolved)) roots_add(&roots, resolved);
+		free(root);
+	}
+
+	if (processTrace(project, trace, buildroot, &roots, print ? stdout : NULL) != 0) res = 1;
+
+	roots_free(&roots);
+	free(project);
+	free(trace);
+	free(buildroot);
+	return res;
+}
+
+static CFStringRef usage() {
+	return CFRetain(CFSTR("-print <trace> <buildroot> [<root> ...] | <project> <trace> <buildroot> [<root> ...]"));
+}
+
+int initialize(int version) {
+	//if ( version < kDBPluginCurrentVersion ) return -1;
+
+	DBPluginSetType(kDBPluginBasicType);
+	DBPluginSetName(CFSTR("processTrace"));
+	DBPluginSetRunFunc(&run);
+	DBPluginSetUsageFunc(&usage);
+	return 0;
+}
+
+// FNV-1a of the type and path; the pair is only ever compared by hash
+static uint64_t hash_record(const char* type, const char* path) {
+	uint64_t h = 14695981039346656037ULL;
+	const char* p;
+	for (p = type; *p; ++p) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+	h = (h ^ '\t') * 1099511628211ULL;
+	for (p = path; *p; ++p) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+	return h ? h : 1;
+}
+
+// Returns 1 if the hash was added, 0 if it was already present.
+static int seen_add(struct seen* s, uint64_t hash) {
+	size_t b;
+	if ((s->count + 1) * 2 > s->nbuckets) {
+		size_t i, nbuckets = s->nbuckets ? s->nbuckets * 2 : 4096;
+		uint64_t* hashes = calloc(nbuckets, sizeof(uint64_t));
+		if (hashes == NULL) return -1;
+		for (i = 0; i < s->nbuckets; ++i) {
+			if (s->hashes[i] == 0) continue;
+			b = s->hashes[i] & (nbuckets - 1);
+			while (hashes[b]) b = (b + 1) & (nbuckets - 1);
+			hashes[b] = s->hashes[i];
+		}
+		free(s->hashes);
+		s->hashes = hashes;
+		s->nbuckets = nbuckets;
+	}
+	b = hash & (s->nbuckets - 1);
+	while (s->hashes[b]) {
+		if (s->hashes[b] == hash) return 0;
+		b = (b + 1) & (s->nbuckets - 1);
+	}
+	s->hashes[b] = hash;
+	++s->count;
+	return 1;
+}
+
+static int has_prefix(const char* path, const char* prefix, int nocase) {
+	size_t len = strlen(prefix);
+	return (nocase ? strncasecmp(path, prefix, len) : strncmp(path, prefix, len)) == 0;
+}
+
+// the path with its root stripped, or NULL if it isn't a dependency
+static const char* filter_path(struct roots* roots, const char* path) {
+	size_t i;
+	for (i = 0; i < roots->count; ++i) {
+		size_t len = strlen(roots->paths[i]);
+		if (strncmp(path, roots->paths[i], len) == 0 && (path[len] == '/' || path[len] == 0)) {
+			path += len;
+			break;
+		}
+	}
+	if (has_prefix(path, "/Developer/", 0)) path += strlen("/Developer");
+
+	if (path[0] != '/') return NULL;
+	if (has_prefix(path, "/SourceCache/", 0)) return NULL;
+	if (has_prefix(path, "/tmp/", 1)
+	    || has_prefix(path, "/var/tmp/", 1)
+	    || has_prefix(path, "/private/tmp/", 1)
+	    || has_prefix(path, "/private/var/tmp/", 1)
+	    || has_prefix(path, "/dev/", 1)
+	    || has_prefix(path, "/XCD/", 1)) {
+		return NULL;
+	}
+	return path;
+}
+
+// Returns 1 if the record was passed on, 0 if it was dropped.
+static int add_record(struct roots* roots, struct seen* seen, FILE* out, const char* type, const char* path) {
+	path = filter_path(roots, path);
+	if (path == NULL) return 0;
+	int res = seen_add(seen, hash_record(type, path));
+	if (res > 0) fprintf(out, "%s\t%s\n", type, path);
+	return res;
+}
+
+// the file record types darwintrace writes, NULL for anything else
+static const char* trace_type(const char* type, size_t len) {
+	unsigned int op;
+	for (op = 1; op < DARWINTRACE_OP_COUNT; ++op) {
+		const char* name = darwintrace_op_name(op);
+		if (DARWINTRACE_OP_PROCESS(op)) continue;
+		if (strlen(name) == len && memcmp(name, type, len) == 0) return name;
+	}
+	return NULL;
+}
+
+//
+// A text trace is read line by line.  The bytes already read to tell the
+// format apart are the start of the first line.
+//
+struct text_input {
+	FILE* fp;
+	char head[4];
+	size_t headlen;
+	char* line;
+	size_t linesize;
+};
+
+static char* text_line(struct text_input* in, size_t len) {
+	if (in->linesize < len + 1) {
+		char* line = realloc(in->line, len + 1);
+		if (line == NULL) return NULL;
+		in->line = line;
+		in->linesize = len + 1;
+	}
+	return in->line;
+}
+
+// the next line, NUL-terminated and without its newline
+static char* read_line(struct text_input* in) {
+	size_t size = 0, len = in->headlen;
+	char* rest = NULL;
+	char* nl = memchr(in->head, '\n', in->headlen);
+	if (nl) {
+		len = (size_t)(nl - in->head) + 1;
+	} else {
+		rest = fgetln(in->fp, &size);
+		if (rest == NULL && in->headlen == 0) return NULL;
+	}
+	char* line = text_line(in, len + size);
+	if (line == NULL) return NULL;
+	memcpy(line, in->head, len);
+	if (size > 0) memcpy(line + len, rest, size);
+	in->headlen -= len;
+	memmove(in->head, in->head + len, in->headlen);
+	len += size;
+	if (len > 0 && line[len - 1] == '\n') --len;
+	line[len] = 0;
+	return line;
+}
+
+static int read_text(struct text_input* in, struct roots* roots, struct seen* seen, FILE* out, int* count) {
+	char* line;
+	while ((line = read_line(in)) != NULL) {
+		// [<procname>[<pid>]\t]<type>\t<path>
+		char* type = line;
+		char* tab = strchr(type, '\t');
+		if (tab && tab > type && tab[-1] == ']' && strchr(tab + 1, '\t')) {
+			type = tab + 1;
+			tab = strchr(type, '\t');
+		}
+		if (tab == NULL) {
+			fprintf(stderr, "Error: syntax error in input.  no tab delimiter found.\n");
+			continue;
+		}
+		const char* name = trace_type(type, (size_t)(tab - type));
+		if (name && add_record(roots, seen, out, name, tab + 1) < 0) return -1;
+		++*count;
+	}
+	return ferror(in->fp) ? -1 : 0;
+}
+
+static int read_binary(FILE* fp, struct roots* roots, struct seen* seen, FILE* out, int* count) {
+	struct darwintrace_reader reader;
+	struct darwintrace_record rec;
+	const char* name;
+	const char* path;
+	int res;
+
+	darwintrace_reader_init(&reader, fp);
+	while ((res = darwintrace_read(&reader, &rec, &name, &path)) > 0) {
+		const char* type = darwintrace_op_name(rec.op);
+		if (DARWINTRACE_OP_PROCESS(rec.op)) continue;
+		if (type && add_record(roots, seen, out, type, path) < 0) {
+			res = -1;
+			break;
+		}
+		++*count;
+	}
+	darwintrace_reader_free(&reader);
+	if (res < 0) {
+		fprintf(stderr, "Error: malformed binary trace after %d records.\n", *count);
+	}
+	return res;
+}
+
+int processTrace(const char* project, const char* tracepath, const char* buildroot, struct roots* roots, FILE* out) {
+	int res = 0, count = 0;
+	struct seen seen;
+	struct text_input in;
+	memset(&seen, 0, sizeof(seen));
+	memset(&in, 0, sizeof(in));
+
+	in.fp = strcmp(tracepath, "-") == 0 ? stdin : fopen(tracepath, "r");
+	if (in.fp == NULL) {
+		fprintf(stderr, "Error: %s: %s\n", tracepath, strerror(errno));
+		return -1;
+	}
+
+	// the records are handed to loadDeps through a temporary file
+	FILE* deps = out ? out : tmpfile();
+	if (deps == NULL) {
+		fprintf(stderr, "Error: %s\n", strerror(errno));
+		if (in.fp != stdin) fclose(in.fp);
+		return -1;
+	}
+
+	in.headlen = fread(in.head, 1, sizeof(in.head), in.fp);
+	if (in.headlen == sizeof(in.head) && memcmp(in.head, DARWINTRACE_MAGIC, 4) == 0) {
+		uint32_t version;
+		if (fread(&version, sizeof(version), 1, in.fp) != 1 || version != DARWINTRACE_VERSION) {
+			fprintf(stderr, "Error: %s: unsupported binary trace version\n", tracepath);
+			res = -1;
+		} else {
+			res = read_binary(in.fp, roots, &seen, deps, &count);
+		}
+	} else {
+		res = read_text(&in, roots, &seen, deps, &count);
+	}
+	if (in.fp != stdin) fclose(in.fp);
+	free(in.line);
+	free(seen.hashes);
+
+	if (res == 0 && fflush(deps) != 0) res = -1;
+	if (res == 0 && out == NULL) {
+		fprintf(stderr, "processed %d trace records.\n", count);
+
+		char fdpath[32];
+		snprintf(fdpath, sizeof(fdpath), "/dev/fd/%d", fileno(deps));
+		rewind(deps);
+
+		CFStringRef cfproject = cfstr(project);
+		CFStringRef cfbuildroot = cfstr(buildroot);
+		CFStringRef cffdpath = cfstr(fdpath);
+		const void* loadArgs[] = { cfproject, cfbuildroot, cffdpath };
+		const void* resolveArgs[] = { CFSTR("-commit"), cfproject };
+		CFArrayRef args = CFArrayCreate(NULL, loadArgs, 3, &kCFTypeArrayCallBacks);
+		if (DBPluginRun(CFSTR("loadDeps"), args) != 0) res = -1;
+		CFRelease(args);
+		if (res == 0) {
+			args = CFArrayCreate(NULL, resolveArgs, 2, &kCFTypeArrayCallBacks);
+			if (DBPluginRun(CFSTR("resolveDeps"), args) != 0) res = -1;
+			CFRelease(args);
+		}
+		CFRelease(cfproject);
+		CFRelease(cfbuildroot);
+		CFRelease(cffdpath);
+	}
+	if (out == NULL) fclose(deps);
+	return res;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include "DBPlugin.h"
+#include "DBDataStore.h"
+
+//
+// Reverse dependencies are read from dependency_closure (see the closure
+// plugin), which is indexed on the dependency.  The run and build closures
+// are already transitive, so everything that must be rebuilt or reinstalled
+// when a project changes is one lookup.  The lib, header and staticlib
+// closures only hold direct dependencies; their transitive reverse
+// dependencies are found by following those edges backwards.
+//
+
+static int addToArray(void* pArg, int argc, char **argv, char** columnNames) {
+	CFMutableArrayRef array = pArg;
+	CFStringRef str = cfstr(argv[0]);
+	if (str) {
+		CFArrayAppendValue(array, str);
+		CFRelease(str);
+	}
+	return 0;
+}
+
+static CFArrayRef copyReverseDependencies(const char* build, const char* kind, CFStringRef project, int direct) {
+	CFMutableArrayRef res = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	char* cproj = strdup_cfstr(project);
+	SQL_CALLBACK(&addToArray, res,
+		"SELECT DISTINCT project FROM dependency_closure WHERE dep=%Q AND build=%Q AND kind=%Q AND %s ORDER BY project",
+		cproj, build, kind, direct ? "depth=1" : "depth>0");
+	free(cproj);
+	return res;
+}
+
+static CFArrayRef copyReverseClosure(const char* build, const char* kind, CFStringRef project) {
+	CFMutableSetRef visited = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+	CFMutableArrayRef queue = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	CFIndex i;
+
+	CFArrayAppendValue(queue, project);
+	for (i = 0; i < CFArrayGetCount(queue); ++i) {
+		CFArrayRef rdeps = copyReverseDependencies(build, kind, CFArrayGetValueAtIndex(queue, i), 1);
+		CFIndex j, count = CFArrayGetCount(rdeps);
+		for (j = 0; j < count; ++j) {
+			CFStringRef rdep = CFArrayGetValueAtIndex(rdeps, j);
+			if (!CFSetContainsValue(visited, rdep)) {
+				CFSetAddValue(visited, rdep);
+				CFArrayAppendValue(queue, rdep);
+			}
+		}
+		CFRelease(rdeps);
+	}
+
+	// the starting project is only listed if it depends on itself
+	CFArrayRemoveValueAtIndex(queue, 0);
+	CFArraySortValues(queue, CFRangeMake(0, CFArrayGetCount(queue)), (CFComparatorFunction)CFStringCompare, NULL);
+	CFRelease(visited);
+	return queue;
+}
+
+static int run(CFArrayRef argv) {
+	int res = 0;
+	int direct = 0;
+	CFIndex count = CFArrayGetCount(argv);
+	if (count == 3 && CFEqual(CFArrayGetValueAtIndex(argv, 0), CFSTR("-direct"))) {
+		direct = 1;
+	} else if (count != 2) {
+		return -1;
+	}
+
+	CFStringRef type = CFArrayGetValueAtIndex(argv, count - 2);
+	CFStringRef project = CFArrayGetValueAtIndex(argv, count - 1);
+	const char* kind;
+	int recursive = 0;	// whether the closure of this kind is already transitive
+	if (CFEqual(type, CFSTR("-run"))) {
+		kind = "run";
+		recursive = 1;
+	} else if (CFEqual(type, CFSTR("-build"))) {
+		kind = "build";
+		recursive = 1;
+	} else if (CFEqual(type, CFSTR("-header"))) {
+		kind = "header";
+	} else if (CFEqual(type, CFSTR("-staticlib"))) {
+		kind = "staticlib";
+	} else if (CFEqual(type, CFSTR("-lib"))) {
+		kind = "lib";
+	} else {
+		return -1;
+	}
+
+	res = DBUpdateDependencyClosure(DBGetCurrentBuild(), NULL);
+	if (res != 0) return 1;
+
+	char* build = strdup_cfstr(DBGetCurrentBuild());
+	CFArrayRef rdeps;
+	if (direct || recursive) {
+		rdeps = copyReverseDependencies(build, kind, project, direct);
+	} else {
+		rdeps = copyReverseClosure(build, kind, project);
+	}
+	CFIndex i;
+	for (i = 0; i < CFArrayGetCount(rdeps); ++i) {
+		cfprintf(stdout, "%@\n", CFArrayGetValueAtIndex(rdeps, i));
+	}
+	CFRelease(rdeps);
+	free(build);
+	return res;
+}
+
+static CFStringRef usage() {
+	return CFRetain(CFSTR("[-direct] -run | -build | -header | -staticlib | -lib <project>"));
+}
+
+int initialize(int version) {
+	//if ( version < kDBPluginCurrentVersion ) return -1;
+	
+	DBPluginSetType(kDBPluginBasicType);
+	DBPluginSetName(CFSTR("rdeps"));
+	DBPluginSetRunFunc(&run);
+	DBPluginSetUsageFunc(&usage);
+	return 0;
+}
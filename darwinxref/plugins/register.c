@@ -32,6 +32,8 @@
 
 #include "DBPlugin.h"
 #include "DBDataStore.h"
+#include "batchpool.h"
+#include "manifestindex.h"
 #include <sys/syslimits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -49,38 +51,54 @@
 
 extern char** environ;
 
-int register_files(char* build, char* project, char* path);
-int register_files_from_stdin(char* build, char* project, char* path);
+int register_files(char* build, char* project, char* path, char* receipt, int index);
+int register_files_from_stdin(char* build, char* project, char* path, char* receipt, int index);
 
 static int run(CFArrayRef argv) {
 	int res = 0;
-       int i = 0, doStdin = 0;
+       int i = 0, doStdin = 0, doIndex = 0;
+	char* receipt = NULL;
 	CFIndex count = CFArrayGetCount(argv);
-       if (count < 2 || count > 3)  return -1;
-	char* build = strdup_cfstr(DBGetCurrentBuild());
 
-       CFStringRef stdinArg = CFArrayGetValueAtIndex(argv, 0);
-       if(CFEqual(stdinArg, CFSTR("-stdin"))) {
-         i++;
-         doStdin = 1;
+       while (i < count) {
+         CFStringRef arg = CFArrayGetValueAtIndex(argv, i);
+         if (CFEqual(arg, CFSTR("-stdin"))) {
+           i++;
+           doStdin = 1;
+         } else if (CFEqual(arg, CFSTR("-receipt")) && i + 1 < count) {
+           free(receipt);
+           receipt = strdup_cfstr(CFArrayGetValueAtIndex(argv, i + 1));
+           i += 2;
+         } else if (CFEqual(arg, CFSTR("-index"))) {
+           i++;
+           doIndex = 1;
+         } else {
+           break;
+         }
+       }
+       if (count - i != 2 || (doIndex && receipt == NULL)) {
+         free(receipt);
+         return -1;
        }
+	char* build = strdup_cfstr(DBGetCurrentBuild());
 
        char* project = strdup_cfstr(CFArrayGetValueAtIndex(argv, i++));
        char* dstroot = strdup_cfstr(CFArrayGetValueAtIndex(argv, i++));
 
        if(doStdin)
-         res = register_files_from_stdin(build, project, dstroot);
+         res = register_files_from_stdin(build, project, dstroot, receipt, doIndex);
        else
-         res = register_files(build, project, dstroot);
+         res = register_files(build, project, dstroot, receipt, doIndex);
 
 	free(build);
 	free(project);
 	free(dstroot);
-	return res;
+	free(receipt);
+	return (res == 0) ? 0 : 1;
 }
 
 static CFStringRef usage() {
-       return CFRetain(CFSTR("[-stdin] <project> <dstroot>"));
+       return CFRetain(CFSTR("[-stdin] [-receipt <name> [-index]] <project> <dstroot>"));
 }
 
 int initialize(int version) {
@@ -93,24 +111,6 @@ int initialize(int version) {
 	return 0;
 }
 
-static char* format_digest(const unsigned char* m) {
-        char* result = NULL;
-		// SHA-1
-		asprintf(&result,
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x"
-                "%02x%02x%02x%02x",
-                m[0], m[1], m[2], m[3],
-                m[4], m[5], m[6], m[7],
-                m[8], m[9], m[10], m[11],
-                m[12], m[13], m[14], m[15],
-				m[16], m[17], m[18], m[19]
-				);
-        return result;
-}
-
 static int compare(const FTSENT **a, const FTSENT **b) {
 	return strcmp((*a)->fts_name, (*b)->fts_name);
 }
@@ -129,29 +129,172 @@ static size_t ent_filename(FTSENT* ent, char* filename, size_t bufsiz) {
 	return bufsiz;
 }
 
-static char* calculate_digest(int fd) {
-	unsigned char md[CC_SHA1_DIGEST_LENGTH];
-	CC_SHA1_CTX c;
-	CC_SHA1_Init(&c);
-	
-	memset(md, 0, CC_SHA1_DIGEST_LENGTH);
-	
-	ssize_t len;
-	const unsigned int blocklen = 8192;
-	static unsigned char* block = NULL;
-	if (block == NULL) {
-		block = malloc(blocklen);
+//
+// The manifest is always printed to stdout.  When a receipt is requested,
+// it is also written to a temporary file and hashed as it is printed, so
+// that the receipt can be installed under its SHA-1 without reading the
+// manifest back.  The temporary file lives outside of the DSTROOT so it
+// does not turn up in the manifest itself.  With -index, the entries are
+// collected too, and the version 2 index the manifest tool would make of
+// the receipt is written next to it as <sha1>.idx.
+//
+struct manifest {
+	FILE* file;
+	char* filename;
+	CC_SHA1_CTX sha1;
+	int index;
+	struct mf_builder builder;
+};
+
+static int manifest_open(struct manifest* m, const char* receipt, int index) {
+	m->file = NULL;
+	m->filename = NULL;
+	m->index = 0;
+	mf_builder_init(&m->builder);
+	if (receipt == NULL) return 0;
+
+	const char* tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL || tmpdir[0] == 0) tmpdir = "/tmp";
+	asprintf(&m->filename, "%s/%s.XXXXXX", tmpdir, receipt);
+	int fd = mkstemp(m->filename);
+	if (fd == -1 || (m->file = fdopen(fd, "w")) == NULL) {
+		perror(m->filename);
+		free(m->filename);
+		m->filename = NULL;
+		return -1;
 	}
-	while(1) {
-		len = read(fd, block, blocklen);
-		if (len == 0) { close(fd); break; }
-		if ((len < 0) && (errno == EINTR)) continue;
-		if (len < 0) { close(fd); return NULL; }
-		CC_SHA1_Update(&c, block, (CC_LONG)len);
+	CC_SHA1_Init(&m->sha1);
+	if (index) {
+		m->index = 1;
+		mf_builder_add(&m->builder, "", NULL)->mode = S_IFDIR;
 	}
-	
-	CC_SHA1_Final(md, &c);
-	return format_digest(md);
+	return 0;
+}
+
+static void manifest_print(struct manifest* m, const char* checksum, struct stat* sb, const char* filename, const char* symlink) {
+	char* line = NULL;
+	int len = asprintf(&line, "%s %o %d %d %lld .%s%s%s\n",
+		checksum,
+		sb->st_mode,
+		sb->st_uid,
+		sb->st_gid,
+		!S_ISDIR(sb->st_mode) ? (long long)sb->st_size : 0LL,
+		filename,
+		symlink[0] ? " -> " : "",
+		symlink[0] ? symlink : "");
+	if (len < 0) return;
+	fwrite(line, 1, (size_t)len, stdout);
+	if (m->file) {
+		fwrite(line, 1, (size_t)len, m->file);
+		CC_SHA1_Update(&m->sha1, line, (CC_LONG)len);
+	}
+	if (m->index) mf_builder_add_line(&m->builder, line, (size_t)len);
+	free(line);
+}
+
+static int copy_file(const char* from, const char* to) {
+	int res = 0;
+	int in = open(from, O_RDONLY);
+	int out = (in == -1) ? -1 : open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (in == -1 || out == -1) {
+		perror(in == -1 ? from : to);
+		res = -1;
+	}
+	while (res == 0) {
+		char block[8192];
+		ssize_t len = read(in, block, sizeof(block));
+		if (len == 0) break;
+		if (len < 0 && errno == EINTR) continue;
+		if (len < 0 || write(out, block, (size_t)len) != len) {
+			perror(len < 0 ? from : to);
+			res = -1;
+		}
+	}
+	if (in != -1) close(in);
+	if (out != -1) close(out);
+	return res;
+}
+
+static int mkdir_p(char* path) {
+	char* p;
+	for (p = path + 1; *p; ++p) {
+		if (*p != '/') continue;
+		*p = 0;
+		int res = mkdir(path, 0755);
+		*p = '/';
+		if (res == -1 && errno != EEXIST) return -1;
+	}
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) return -1;
+	return 0;
+}
+
+//
+// Moves the manifest into <dstroot>/usr/local/darwinbuild/receipts under
+// its SHA-1, writes its index if asked to, and points the receipt symlink
+// at it, or just discards it if registration failed.
+//
+static int manifest_close(struct manifest* m, const char* dstroot, const char* receipt, int res) {
+	if (m->file == NULL) return res;
+	if (fclose(m->file) != 0 && res == 0) {
+		perror(m->filename);
+		res = -1;
+	}
+
+	if (res == 0) {
+		unsigned char md[CC_SHA1_DIGEST_LENGTH];
+		CC_SHA1_Final(md, &m->sha1);
+		char* hash = format_digest(md);
+		char* receipts = NULL;
+		char* target = NULL;
+		char* link = NULL;
+		asprintf(&receipts, "%s/usr/local/darwinbuild/receipts", dstroot);
+		asprintf(&target, "%s/%s", receipts, hash);
+		asprintf(&link, "%s/%s", receipts, receipt);
+
+		if (mkdir_p(receipts) == -1) {
+			perror(receipts);
+			res = -1;
+		} else if (rename(m->filename, target) == -1) {
+			if (errno != EXDEV) {
+				perror(target);
+				res = -1;
+			} else {
+				res = copy_file(m->filename, target);
+			}
+		}
+		if (res == 0) {
+			chmod(target, 0644);
+		}
+		if (res == 0 && m->index) {
+			struct mf_tree t;
+			char* index = NULL;
+			asprintf(&index, "%s.idx", target);
+			res = mf_builder_finish(&m->builder, &t);
+			if (res == 0) {
+				res = mf_write_index(&t, index);
+				mf_tree_free(&t);
+			}
+			free(index);
+		}
+		if (res == 0) {
+			unlink(link);
+			if (symlink(hash, link) == -1) {
+				perror(link);
+				res = -1;
+			}
+		}
+		free(hash);
+		free(receipts);
+		free(target);
+		free(link);
+	}
+
+	unlink(m->filename);
+	free(m->filename);
+	mf_builder_free(&m->builder);
+	m->filename = NULL;
+	m->file = NULL;
+	return res;
 }
 
 // If the path points to a Mach-O file, records all dylib
@@ -163,7 +306,91 @@ static char* calculate_digest(int fd) {
 #include <mach-o/fat.h>
 #include <mach-o/swap.h>
 
-static int register_mach_header(const char* build, const char* project, const char* path, struct fat_arch* fa, int fd, int* isMachO) {
+//
+// Mach-O images are parsed into memory first and inserted into the
+// database afterwards, so that files can be parsed on several threads
+// while the database is only ever touched from one.
+//
+struct mach_o_symbol {
+	char type;
+	uint64_t value;
+	uint32_t name;		// offset into strings, or strsize for ""
+};
+
+struct mach_o_object {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t cputype;
+	uint32_t cpusubtype;
+	uint32_t flags;
+	char** libs;
+	uint32_t nlibs;
+	struct mach_o_symbol* symbols;
+	uint32_t nsymbols;
+	uint8_t* strings;
+	uint32_t strsize;
+	struct mach_o_object* next;
+};
+
+static void mach_o_object_add_lib(struct mach_o_object* obj, char* lib) {
+	obj->libs = realloc(obj->libs, (obj->nlibs + 1) * sizeof(char*));
+	obj->libs[obj->nlibs++] = lib;
+}
+
+static void free_mach_o_objects(struct mach_o_object* obj) {
+	while (obj) {
+		struct mach_o_object* next = obj->next;
+		uint32_t i;
+		for (i = 0; i < obj->nlibs; ++i) free(obj->libs[i]);
+		free(obj->libs);
+		free(obj->symbols);
+		free(obj->strings);
+		free(obj);
+		obj = next;
+	}
+}
+
+static int insert_mach_o_objects(const char* build, const char* project, const char* path, struct mach_o_object* obj) {
+	int res = 0;
+	sqlite3* db = (sqlite3*)_DBPluginGetDataStorePtr();
+	sqlite3_stmt* stmt = NULL;
+
+	for (; obj; obj = obj->next) {
+		res = SQL("INSERT INTO mach_o_objects (magic, type, cputype, cpusubtype, flags, build, project, path) VALUES (%u, %u, %u, %u, %u, %Q, %Q, %Q)",
+			obj->magic, obj->type, obj->cputype, obj->cpusubtype, obj->flags,
+			build, project, path);
+		sqlite3_int64 serial = sqlite3_last_insert_rowid(db);
+
+		uint32_t i;
+		for (i = 0; i < obj->nlibs; ++i) {
+			res = SQL("INSERT INTO unresolved_dependencies (build,project,type,dependency) VALUES (%Q,%Q,%Q,%Q)",
+			build, project, "lib", obj->libs[i]);
+		}
+
+		if (obj->nsymbols == 0) continue;
+		if (stmt == NULL && sqlite3_prepare_v2(db, "INSERT INTO mach_o_symbols VALUES (?, ?, ?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+			return -1;
+		}
+		for (i = 0; i < obj->nsymbols; ++i) {
+			struct mach_o_symbol* sym = &obj->symbols[i];
+			const char* name = (sym->name < obj->strsize) ? (const char*)obj->strings + sym->name : "";
+			sqlite3_bind_int64(stmt, 1, serial);
+			sqlite3_bind_text(stmt, 2, &sym->type, 1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 3, (sqlite3_int64)sym->value);
+			sqlite3_bind_text(stmt, 4, name, -1, SQLITE_STATIC);
+			if (sqlite3_step(stmt) != SQLITE_DONE) {
+				fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+				res = -1;
+			}
+			sqlite3_reset(stmt);
+		}
+	}
+	if (stmt) sqlite3_finalize(stmt);
+	return res;
+}
+
+static int register_mach_header(struct fat_arch* fa, int fd, int* isMachO, struct mach_o_object*** objects) {
 	ssize_t res;
 	uint32_t magic;
 	int swap = 0;
@@ -224,14 +451,15 @@ static int register_mach_header(const char* build, const char* project, const ch
 			return 0;
 	}
 
-	res = SQL("INSERT INTO mach_o_objects (magic, type, cputype, cpusubtype, flags, build, project, path) VALUES (%u, %u, %u, %u, %u, %Q, %Q, %Q)",
-		mh64 ? mh64->magic : mh->magic,
-		mh64 ? mh64->filetype : mh->filetype,
-		mh64 ? mh64->cputype : mh->cputype,
-		mh64 ? mh64->cpusubtype : mh->cpusubtype,
-		mh64 ? mh64->flags : mh->flags,
-		build, project, path);
-	uint64_t serial = sqlite3_last_insert_rowid((sqlite3*)_DBPluginGetDataStorePtr());
+	struct mach_o_object* obj = calloc(1, sizeof(struct mach_o_object));
+	if (obj == NULL) return -1;
+	obj->magic = mh64 ? mh64->magic : mh->magic;
+	obj->type = mh64 ? mh64->filetype : mh->filetype;
+	obj->cputype = mh64 ? mh64->cputype : mh->cputype;
+	obj->cpusubtype = mh64 ? mh64->cpusubtype : mh->cpusubtype;
+	obj->flags = mh64 ? mh64->flags : mh->flags;
+	**objects = obj;
+	*objects = &obj->next;
 
 	//
 	// Information needed to parse the symbol table
@@ -289,10 +517,7 @@ static int register_mach_header(const char* build, const char* project, const ch
 			strncpy(str, (char*)((uint8_t*)dylib + dylib->dylib.name.offset), strsize);
 			str[strsize] = 0; // NUL-terminate
 
-			res = SQL("INSERT INTO unresolved_dependencies (build,project,type,dependency) VALUES (%Q,%Q,%Q,%Q)",
-			build, project, "lib", str);
-			
-			free(str);
+			mach_o_object_add_lib(obj, str);
 		
 		//
 		// LC_LOAD_DYLINKER
@@ -310,10 +535,7 @@ static int register_mach_header(const char* build, const char* project, const ch
 			strncpy(str, (char*)((uint8_t*)dylinker + dylinker->name.offset), strsize);
 			str[strsize] = 0; // NUL-terminate
 
-			res = SQL("INSERT INTO unresolved_dependencies (build,project,type,dependency) VALUES (%Q,%Q,%Q,%Q)",
-			build, project, "lib", str);
-			
-			free(str);
+			mach_o_object_add_lib(obj, str);
 		
 		//
 		// LC_SYMTAB
@@ -331,6 +553,8 @@ static int register_mach_header(const char* build, const char* project, const ch
 			strsize = symtab->strsize;
 			// XXX: check strsize != 0
 			strings = malloc(strsize);
+			obj->strings = strings;
+			obj->strsize = strsize;
 
 			off_t save = lseek(fd, 0, SEEK_CUR);
 
@@ -402,8 +626,9 @@ static int register_mach_header(const char* build, const char* project, const ch
 	}
 
 	//
-	// Finished processing the load commands, now insert symbols into the database.
+	// Finished processing the load commands, now collect the symbols.
 	//
+	obj->symbols = malloc(nsyms * sizeof(struct mach_o_symbol));
 	int j;
 	for (j = 0; j < nsyms; ++j) {
 		struct nlist_64 symbol;
@@ -452,22 +677,20 @@ static int register_mach_header(const char* build, const char* project, const ch
 		}
 
 		if (type != '?' && type != 'u' && type != 'c') {
-			const uint8_t* name = (const uint8_t*)"";
-			if (symbol.n_un.n_strx != 0) {
-				name = (uint8_t*)(strings + symbol.n_un.n_strx);
-			}
-			res = SQL("INSERT INTO mach_o_symbols VALUES (%lld, \'%c\', %lld, %Q)",
-				serial,
-				type,
-				symbol.n_value,
-				name);
+			struct mach_o_symbol* sym = &obj->symbols[obj->nsymbols++];
+			sym->type = type;
+			sym->value = symbol.n_value;
+			sym->name = (symbol.n_un.n_strx != 0) ? symbol.n_un.n_strx : strsize;
 		}
 	}
 
+	free(symbols);
+	free(mh);
+	free(mh64);
 	return 0;
 }
 
-static int register_libraries(int fd, const char* build, const char* project, const char* filename, int* isMachO) {
+static int register_libraries(int fd, int* isMachO, struct mach_o_object** objects) {
 	ssize_t res;
 		
 	uint32_t magic;
@@ -498,13 +721,13 @@ static int register_libraries(int fd, const char* build, const char* project, co
 			off_t save = lseek(fd, 0, SEEK_CUR);
 			lseek(fd, (off_t)fa.offset, SEEK_SET);
 
-			register_mach_header(build, project, filename, &fa, fd, isMachO);
+			register_mach_header(&fa, fd, isMachO, &objects);
 			
 			lseek(fd, save, SEEK_SET);
 		}
 	} else {
 		lseek(fd, 0, SEEK_SET);
-		register_mach_header(build, project, filename, NULL, fd, isMachO);
+		register_mach_header(NULL, fd, isMachO, &objects);
 	}
 error_out:
 	return 0;
@@ -516,18 +739,31 @@ static int create_tables() {
 	char* index = "CREATE INDEX files_index ON files (build, project, path)";
 	SQL_NOERR(table);
 	SQL_NOERR(index);
+	index = "CREATE INDEX files_path_index ON files (path)";
+	SQL_NOERR(index);
 
 	table = "CREATE TABLE unresolved_dependencies (build text, project text, type text, dependency)";
+	index = "CREATE INDEX unresolved_dependencies_index ON unresolved_dependencies (build, project, type, dependency)";
 	SQL_NOERR(table);
+	SQL_NOERR(index);
 
 	table = "CREATE TABLE mach_o_objects (serial INTEGER PRIMARY KEY AUTOINCREMENT, magic INTEGER, type INTEGER, cputype INTEGER, cpusubtype INTEGER, flags INTEGER, build TEXT, project TEXT, path TEXT)";
+	index = "CREATE INDEX mach_o_objects_index ON mach_o_objects (build, project)";
 	SQL_NOERR(table);
+	SQL_NOERR(index);
 
 	table = "CREATE TABLE mach_o_symbols (mach_o_object INTEGER, type INTEGER, value INTEGER, name TEXT)";
+	index = "CREATE INDEX mach_o_symbols_index ON mach_o_symbols (mach_o_object)";
 	SQL_NOERR(table);
+	SQL_NOERR(index);
 	return 0;
 }
 
+static int insert_digest(const char* build, const char* path, const struct stat* sb, const char* checksum) {
+	return SQL("INSERT OR REPLACE INTO file_digests (build,path,size,mtime,digest) VALUES (%Q,%Q,%lld,%lld,%Q)",
+		build, path, (long long)sb->st_size, (long long)sb->st_mtime, checksum);
+}
+
 static int prune_old_entries(const char* build, const char* project) {
 	SQL("DELETE FROM files WHERE build=%Q AND project=%Q",
 		  build, project);
@@ -535,20 +771,28 @@ static int prune_old_entries(const char* build, const char* project) {
 	SQL("DELETE FROM unresolved_dependencies WHERE build=%Q AND project=%Q", 
 		build, project);
 
+	// Symbols must go first, while their objects are still around to
+	// identify them.  Only this project's objects are consulted so the
+	// cost is proportional to what is being replaced, not to the size
+	// of the whole database.
+	SQL("DELETE FROM mach_o_symbols WHERE mach_o_object IN (SELECT serial FROM mach_o_objects WHERE build=%Q AND project=%Q)",
+		build, project);
+
 	SQL("DELETE FROM mach_o_objects WHERE build=%Q AND project=%Q", build, project);
-	
-	SQL("DELETE FROM mach_o_symbols WHERE mach_o_object NOT IN (SELECT serial FROM mach_o_objects)");
 
 	return 0;
 }
 
-int register_files(char* build, char* project, char* path) {
+int register_files(char* build, char* project, char* path, char* receipt, int index) {
 	ssize_t res = 0;
 	int loaded = 0;
+	struct manifest manifest;
 	
 	create_tables();
 
-	if (SQL("BEGIN")) { return -1; }
+	if (manifest_open(&manifest, receipt, index) != 0) { return -1; }
+
+	if (SQL("BEGIN")) { return manifest_close(&manifest, path, receipt, -1); }
 
 	prune_old_entries(build, project);
 	
@@ -588,11 +832,15 @@ int register_files(char* build, char* project, char* path) {
 			int fd = open(ent->fts_accpath, O_RDONLY);
 			if (fd == -1) {
 				perror(filename);
-				return -1;
+				return manifest_close(&manifest, path, receipt, -1);
 			}
 			int isMachO;
-			res = register_libraries(fd, build, project, filename, &isMachO);
+			struct mach_o_object* objects = NULL;
+			register_libraries(fd, &isMachO, &objects);
+			res = insert_mach_o_objects(build, project, filename, objects);
+			free_mach_o_objects(objects);
 			lseek(fd, (off_t)0, SEEK_SET);
+			free(checksum);
 			checksum = calculate_digest(fd);
 			close(fd);
 		}
@@ -603,128 +851,193 @@ int register_files(char* build, char* project, char* path) {
 				build, project, filename);
 			++loaded;
 		}
+		if (ent->fts_info == FTS_F && checksum && insert_digest(build, filename, ent->fts_statp, checksum) != 0) {
+			free(checksum);
+			fts_close(fts);
+			return manifest_close(&manifest, path, receipt, -1);
+		}
 		
 		// add all regular files, directories, and symlinks to the manifest
 		if (ent->fts_info == FTS_F || ent->fts_info == FTS_D ||
 			ent->fts_info == FTS_SL || ent->fts_info == FTS_SLNONE) {
-			fprintf(stdout, "%s %o %d %d %lld .%s%s%s\n",
-				checksum,
-				ent->fts_statp->st_mode,
-				ent->fts_statp->st_uid,
-				ent->fts_statp->st_gid,
-				(ent->fts_info != FTS_D) ? ent->fts_statp->st_size : (off_t)0,
-				filename,
-				symlink[0] ? " -> " : "",
-				symlink[0] ? symlink : "");
+			manifest_print(&manifest, checksum, ent->fts_statp, filename, symlink);
 		}
 		free(checksum);
 	}
 	fts_close(fts);
 	
-	if (SQL("COMMIT")) { return -1; }
+	if (SQL("COMMIT")) { return manifest_close(&manifest, path, receipt, -1); }
 
 	fprintf(stderr, "%s - %d files registered.\n", project, loaded);
 	
-	return (int)res;
+	return manifest_close(&manifest, path, receipt, (int)res);
+}
+
+//
+// -stdin registration
+//
+// The paths listed on stdin are gathered in batches.  Each entry of a
+// batch is stat'ed, parsed for Mach-O load commands and checksummed by
+// a pool of threads; the batch is then inserted into the database and
+// printed from this thread, in the order the paths were listed.
+//
+#define STDIN_BATCH_SIZE 1024
+
+struct stdin_entry {
+	char* fullpath;
+	char* filename;		// points into fullpath
+	struct stat sb;
+	char* symlink;
+	char* checksum;
+	struct mach_o_object* objects;
+	int error;		// errno, if the entry could not be read
+	const char* failed;	// the path that error applies to
+};
+
+static void process_stdin_entry(void* arg) {
+	struct stdin_entry* e = arg;
+	if (lstat(e->fullpath, &e->sb) != 0) {
+		e->error = errno;
+		e->failed = e->fullpath;
+		return;
+	}
+
+	// Symlinks
+	if (S_ISLNK(e->sb.st_mode)) {
+		char symlink[MAXPATHLEN+1];
+		ssize_t len = readlink(e->fullpath, symlink, MAXPATHLEN);
+		if (len >= 0) {
+			symlink[len] = 0;
+			e->symlink = strdup(symlink);
+		}
+	}
+
+	// Checksum regular files
+	if (S_ISREG(e->sb.st_mode)) {
+		int fd = open(e->fullpath, O_RDONLY);
+		if (fd == -1) {
+			e->error = errno;
+			e->failed = e->filename;
+			return;
+		}
+		register_libraries(fd, NULL, &e->objects);
+		lseek(fd, (off_t)0, SEEK_SET);
+		e->checksum = calculate_digest(fd);
+		close(fd);
+	}
+}
+
+// Inserts and prints a processed batch, in the order it was listed.
+static int flush_stdin_entries(const char* build, const char* project, struct stdin_entry* entries, size_t count, struct manifest* manifest, int* loaded) {
+	int res = 0;
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		struct stdin_entry* e = &entries[i];
+		if (res == 0 && e->error) {
+			errno = e->error;
+			perror(e->failed);
+			res = -1;
+		}
+		if (res == 0) {
+			mode_t mode = e->sb.st_mode;
+			if (S_ISREG(mode) && insert_mach_o_objects(build, project, e->filename, e->objects) != 0) {
+				res = -1;
+			}
+
+			// register regular files and symlinks in the DB
+			if (S_ISREG(mode) || S_ISLNK(mode)) {
+				if (SQL("INSERT INTO files (build,project, path) VALUES (%Q,%Q,%Q)",
+					build, project, e->filename)) {
+					res = -1;
+				}
+				++*loaded;
+			}
+			if (S_ISREG(mode) && e->checksum && insert_digest(build, e->filename, &e->sb, e->checksum)) {
+				res = -1;
+			}
+
+			// add all regular files, directories, and symlinks to the manifest
+			if (S_ISREG(mode) || S_ISLNK(mode) || S_ISDIR(mode)) {
+				manifest_print(manifest,
+					e->checksum ? e->checksum : "                                        ",
+					&e->sb, e->filename, e->symlink ? e->symlink : "");
+			}
+		}
+		free(e->fullpath);
+		free(e->symlink);
+		free(e->checksum);
+		free_mach_o_objects(e->objects);
+	}
+	return res;
 }
 
-int register_files_from_stdin(char* build, char* project, char* path) {
+int register_files_from_stdin(char* build, char* project, char* path, char* receipt, int index) {
 	int res = 0;
 	int loaded = 0;
 	char *line;
 	size_t size;
+	struct manifest manifest;
 
 	create_tables();
 	
-	if (SQL("BEGIN")) { return -1; }
+	if (manifest_open(&manifest, receipt, index) != 0) { return -1; }
+
+	if (SQL("BEGIN")) { return manifest_close(&manifest, path, receipt, -1); }
 	
 	prune_old_entries(build, project);
 
+	struct batch_pool pool;
+	batch_pool_init(&pool, 0, sizeof(struct stdin_entry), process_stdin_entry);
+	struct stdin_entry* entries = calloc(STDIN_BATCH_SIZE, sizeof(struct stdin_entry));
+	size_t count = 0;
+
 	//
 	// Enumerate the files in the path (DSTROOT) and associate them
 	// with the project name and version in the sqlite database.
 	//
 	// Skip the first result, since that is . of the DSTROOT itself.
-        while ((line = fgetln(stdin, &size)) != NULL) {
+        while (res == 0 && (line = fgetln(stdin, &size)) != NULL) {
 		char filename[MAXPATHLEN+1];
-		char fullpath[MAXPATHLEN+1];
-		char symlink[MAXPATHLEN+1];
-		ssize_t len;
-		struct stat sb;
 		char *lastpathcomp = NULL;
 
-		if (size > 0 && line[size-1] == '\n') line[--size] = 0; // chomp newline
-		if (size > 0 && line[size-1] == '/') line[--size] = 0; // chomp trailing slash
+		if (size > 0 && line[size-1] == '\n') --size; // chomp newline
+		if (size > 0 && line[size-1] == '/') --size; // chomp trailing slash
+		if (size > MAXPATHLEN) size = MAXPATHLEN;
+		memcpy(filename, line, size);
+		filename[size] = 0;
 
-		if(0 == strcmp(line, "."))
+		if(0 == strcmp(filename, "."))
 		  continue;
 
-		// Filename
-		filename[0] = 0;
-		strcpy(filename, line+1); /* skip over leading "." */
-
 		lastpathcomp = strrchr(filename, '/');
 		if(lastpathcomp && 0 == strncmp(lastpathcomp+1, "._", 2))
 		  continue;
 
+		// Filename, skipping over the leading "."
+		struct stdin_entry* e = &entries[count++];
+		memset(e, 0, sizeof(*e));
+		asprintf(&e->fullpath, "%s/%s", path, filename + 1);
+		e->filename = e->fullpath + strlen(path) + 1;
 
-		sprintf(fullpath, "%s/%s", path, filename);
-		res = lstat(fullpath, &sb);
-		if(res != 0) {
-		  perror(fullpath);
-		  return -1;
+		if (count == STDIN_BATCH_SIZE) {
+			batch_pool_run(&pool, entries, count);
+			res = flush_stdin_entries(build, project, entries, count, &manifest, &loaded);
+			count = 0;
 		}
-		  
-		// Symlinks
-		symlink[0] = 0;
-		if (S_ISLNK(sb.st_mode)) {
-			len = readlink(fullpath, symlink, MAXPATHLEN);
-			if (len >= 0) symlink[len] = 0;
-		}
-		
-		// Default to empty SHA-1 checksum
-		char* checksum = strdup("                                        ");
-		
-		// Checksum regular files
-		if (S_ISREG(sb.st_mode)) {
-			int fd = open(fullpath, O_RDONLY);
-			if (fd == -1) {
-				perror(filename);
-				return -1;
-			}
-			res = register_libraries(fd, build, project, filename, NULL);
-			/* For -stdin mode, we don't calculate checksums
-			lseek(fd, (off_t)0, SEEK_SET);
-			checksum = calculate_digest(fd);
-			*/
-			close(fd);
-		}
-
-		// register regular files and symlinks in the DB
-		if (S_ISREG(sb.st_mode) || S_ISLNK(sb.st_mode)) {
-			res = SQL("INSERT INTO files (build,project, path) VALUES (%Q,%Q,%Q)",
-				build, project, filename);
-			++loaded;
-		}
-		
-		// add all regular files, directories, and symlinks to the manifest
-		if (S_ISREG(sb.st_mode) || S_ISLNK(sb.st_mode) || S_ISDIR(sb.st_mode)) {
-			fprintf(stdout, "%s %o %d %d %lld .%s%s%s\n",
-				checksum,
-				sb.st_mode,
-				sb.st_uid,
-				sb.st_gid,
-				!S_ISDIR(sb.st_mode) ? sb.st_size : (off_t)0,
-				filename,
-				symlink[0] ? " -> " : "",
-				symlink[0] ? symlink : "");
-		}
-		free(checksum);
 	}
-	
-	if (SQL("COMMIT")) { return -1; }
+	if (res == 0) {
+		batch_pool_run(&pool, entries, count);
+		res = flush_stdin_entries(build, project, entries, count, &manifest, &loaded);
+	}
+
+	batch_pool_destroy(&pool);
+	free(entries);
+
+	if (res != 0) { return manifest_close(&manifest, path, receipt, -1); }
+
+	if (SQL("COMMIT")) { return manifest_close(&manifest, path, receipt, -1); }
 
 	fprintf(stderr, "%s - %d files registered.\n", project, loaded);
 	
-	return res;
+	return manifest_close(&manifest, path, receipt, res);
 }
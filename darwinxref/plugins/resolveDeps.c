@@ -34,6 +34,8 @@
 #include "DBDataStore.h"
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
 
 int resolve_dependencies(const char* build, const char* project, int commit);
 
@@ -85,132 +87,195 @@ static int addToCStrArrays(void* pArg, int argc, char** argv, char** columnNames
 	return 0;
 }
 
-int resolve_project_dependencies( const char* build, const char* project, int* resolvedCount, int* unresolvedCount, int commit) {
-	CFMutableArrayRef files = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
-	CFMutableArrayRef types = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
-	CFMutableArrayRef params[2] = { files, types };
-
-        char* table = "CREATE TABLE dependencies (build TEXT, project TEXT, type TEXT, dependency TEXT)";
-        char* index = "CREATE INDEX dependencies_index ON unresolved_dependencies (build, project, type, dependency)";
+static int printResolved(void* pArg, int argc, char** argv, char** columnNames) {
+	char** last = (char**)pArg;
+	// argv: build, project, type, dependency
+	if (last[0] == NULL || strcmp(last[0], argv[0]) != 0 || strcmp(last[1], argv[1]) != 0) {
+		free(last[0]);
+		free(last[1]);
+		last[0] = strdup(argv[0]);
+		last[1] = strdup(argv[1]);
+		fprintf(stderr, "%s (%s)\n", argv[1], argv[0]);
+	}
+	fprintf(stderr, "\t%s (%s)\n", argv[3], argv[2]);
+	return 0;
+}
 
-        SQL_NOERR(table);
-        SQL_NOERR(index);
+static int getCount(void* pArg, int argc, char** argv, char** columnNames) {
+	*(int*)pArg = (argc > 0 && argv[0]) ? atoi(argv[0]) : 0;
+	return 0;
+}
 
-	if (SQL("BEGIN")) { return -1; }
+//
+// Merges the resolved dependencies of one project into its dependencies
+// property, in a single read and write of the property.
+//
+static void commit_project_dependencies(const char* build, const char* project, CFArrayRef types, CFArrayRef deps, CFIndex start, CFIndex end) {
+	CFStringRef cfbuild = cfstr(build);
+	CFStringRef cfproject = cfstr(project);
+	CFMutableDictionaryRef dependencies = CFDictionaryCreateMutable(NULL, 0,
+							     &kCFCopyStringDictionaryKeyCallBacks,
+							     &kCFTypeDictionaryValueCallBacks);
+	// per-type set of the dependencies already present
+	CFMutableDictionaryRef present = CFDictionaryCreateMutable(NULL, 0,
+							     &kCFCopyStringDictionaryKeyCallBacks,
+							     &kCFTypeDictionaryValueCallBacks);
 
-	// Convert from unresolved_dependencies (i.e. path names) to resolved dependencies (i.e. project names)
-	// Deletes unresolved_dependencies after they are processed.
-	SQL_CALLBACK(&addToCStrArrays, params,
-		"SELECT DISTINCT dependency,type FROM unresolved_dependencies WHERE build=%Q AND project=%Q",
-		build, project);
-
-	CFIndex i, count = CFArrayGetCount(files);
-	for (i = 0; i < count; ++i) {
-		const char* file = CFArrayGetValueAtIndex(files, i);
-		const char* type = CFArrayGetValueAtIndex(types, i);
-		// XXX
-		// This assumes a 1-to-1 mapping between files and projects.
-		char* dep = (char*)SQL_STRING("SELECT project FROM files WHERE path=%Q", file);
-		if (dep) {
-			// don't add duplicates
-			int exists = SQL_BOOLEAN("SELECT 1 FROM dependencies WHERE build=%Q AND project=%Q AND type=%Q AND dependency=%Q",
-				build, project, type, dep);
-			if (!exists) {
-				SQL("INSERT INTO dependencies (build,project,type,dependency) VALUES (%Q,%Q,%Q,%Q)",
-					build, project, type, dep);
-				*resolvedCount += 1;
-				fprintf(stderr, "\t%s (%s)\n", dep, type);
+	CFDictionaryRef current = DBCopyPropDictionary(cfbuild, cfproject, CFSTR("dependencies"));
+	if (current) {
+		CFArrayRef keys = dictionaryGetSortedKeys(current);
+		CFIndex i, count = CFArrayGetCount(keys);
+		for (i = 0; i < count; ++i) {
+			CFStringRef type = CFArrayGetValueAtIndex(keys, i);
+			CFArrayRef array = CFDictionaryGetValue(current, type);
+			if (CFGetTypeID(array) != CFArrayGetTypeID()) {
+				CFDictionarySetValue(dependencies, type, array);
+				continue;
+			}
+			CFMutableArrayRef deparray = CFArrayCreateMutableCopy(NULL, 0, array);
+			CFMutableSetRef set = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+			CFIndex j, depcount = CFArrayGetCount(deparray);
+			for (j = 0; j < depcount; ++j) {
+				CFSetAddValue(set, CFArrayGetValueAtIndex(deparray, j));
 			}
-			SQL("DELETE FROM unresolved_dependencies WHERE build=%Q AND project=%Q AND type=%Q AND dependency=%Q",
-				build, project, type, file);
-		} else {
-			*unresolvedCount += 1;
+			CFDictionarySetValue(dependencies, type, deparray);
+			CFDictionarySetValue(present, type, set);
+			CFRelease(deparray);
+			CFRelease(set);
+		}
+		CFRelease(keys);
+		CFRelease(current);
+	}
+
+	CFIndex i;
+	for (i = start; i < end; ++i) {
+		CFStringRef type = cfstr(CFArrayGetValueAtIndex(types, i));
+		CFStringRef proj = cfstr(CFArrayGetValueAtIndex(deps, i));
+
+		CFMutableArrayRef deparray = (CFMutableArrayRef)CFDictionaryGetValue(dependencies, type);
+		CFMutableSetRef set = (CFMutableSetRef)CFDictionaryGetValue(present, type);
+		if (deparray == NULL || set == NULL) {
+			deparray = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+			set = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+			CFDictionarySetValue(dependencies, type, deparray);
+			CFDictionarySetValue(present, type, set);
+			CFRelease(deparray); // still retained by dict
+			CFRelease(set);
+		}
+		if (!CFSetContainsValue(set, proj)) {
+			CFArrayAppendValue(deparray, proj);
+			CFSetAddValue(set, proj);
 		}
+		CFRelease(proj);
+		CFRelease(type);
 	}
 
-	CFRelease(files);
-	CFRelease(types);
+	DBSetProp(cfbuild, cfproject, CFSTR("dependencies"), dependencies);
+	CFRelease(dependencies);
+	CFRelease(present);
+	CFRelease(cfbuild);
+	CFRelease(cfproject);
+}
+
+//
+// Resolves the unresolved dependencies of one project (in all builds), or
+// of every project if project is NULL, with a handful of set-based
+// statements rather than a lookup per path.
+//
+int resolve_dependencies(const char* build, const char* project, int commit) {
+	int resolvedCount = 0, unresolvedCount = 0;
+
+	char* table = "CREATE TABLE dependencies (build TEXT, project TEXT, type TEXT, dependency TEXT)";
+	char* index = "CREATE INDEX dependencies_index ON dependencies (build, project, type, dependency)";
+	SQL_NOERR(table);
+	SQL_NOERR(index);
+
+	table = "CREATE TABLE unresolved_dependencies (build text, project text, type text, dependency)";
+	index = "CREATE INDEX unresolved_dependencies_index ON unresolved_dependencies (build, project, type, dependency)";
+	SQL_NOERR(table);
+	SQL_NOERR(index);
+
+	table = "CREATE TABLE files (build text, project text, path text)";
+	index = "CREATE INDEX files_path_index ON files (path)";
+	SQL_NOERR(table);
+	SQL_NOERR(index);
+
+	// Restricts statements on unresolved_dependencies u to the project, if any
+	char* scope = project ? sqlite3_mprintf("u.project=%Q", project) : sqlite3_mprintf("1");
+
+	if (SQL("BEGIN")) { sqlite3_free(scope); return -1; }
+
+	// Convert from unresolved_dependencies (i.e. path names) to resolved dependencies (i.e. project names)
+	// XXX
+	// This assumes paths are only ever owned by one project; if they are
+	// not, a dependency on each owner is recorded.
+	SQL_NOERR("DROP TABLE temp.resolved_dependencies");
+	SQL("CREATE TEMP TABLE resolved_dependencies (build TEXT, project TEXT, type TEXT, dependency TEXT)");
+	SQL("INSERT INTO temp.resolved_dependencies "
+		"SELECT DISTINCT u.build, u.project, u.type, f.project "
+		"FROM unresolved_dependencies AS u JOIN files AS f ON f.path=u.dependency "
+		"WHERE %s AND NOT EXISTS (SELECT 1 FROM dependencies AS d "
+			"WHERE d.build=u.build AND d.project=u.project AND d.type=u.type AND d.dependency=f.project)",
+		scope);
+
+	char* last[2] = { NULL, NULL };
+	SQL_CALLBACK(&printResolved, last,
+		"SELECT build, project, type, dependency FROM temp.resolved_dependencies ORDER BY build, project, type, dependency");
+	free(last[0]);
+	free(last[1]);
+	SQL_CALLBACK(&getCount, &resolvedCount, "SELECT COUNT(*) FROM temp.resolved_dependencies");
+
+	SQL("INSERT INTO dependencies (build, project, type, dependency) "
+		"SELECT build, project, type, dependency FROM temp.resolved_dependencies");
+	SQL("DROP TABLE temp.resolved_dependencies");
+
+	// Deletes unresolved_dependencies once they are resolved.
+	SQL("DELETE FROM unresolved_dependencies WHERE rowid IN (SELECT u.rowid FROM unresolved_dependencies AS u "
+		"WHERE %s AND EXISTS (SELECT 1 FROM files AS f WHERE f.path=u.dependency))",
+		scope);
+
+	SQL_CALLBACK(&getCount, &unresolvedCount,
+		"SELECT COUNT(*) FROM (SELECT DISTINCT u.build, u.project, u.type, u.dependency FROM unresolved_dependencies AS u WHERE %s)",
+		scope);
 
 	// If committing, merge resolved dependencies to the dependencies property dictionary.
 	// Deletes resolved dependencies after they are processed.
 	if (commit) {
+		CFMutableArrayRef builds = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
+		CFMutableArrayRef projects = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
 		CFMutableArrayRef types = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
-		CFMutableArrayRef projs = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
-		CFMutableArrayRef params[2] = { projs, types };
-		CFMutableDictionaryRef dependencies = (CFMutableDictionaryRef)DBCopyPropDictionary(cfstr(build), cfstr(project), CFSTR("dependencies"));
-		if (dependencies == NULL) {
-			dependencies = CFDictionaryCreateMutable(NULL, 0,
-								     &kCFCopyStringDictionaryKeyCallBacks,
-								     &kCFTypeDictionaryValueCallBacks);
-		}
-		
+		CFMutableArrayRef deps = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
+		CFMutableArrayRef params[4] = { builds, projects, types, deps };
+
 		SQL_CALLBACK(&addToCStrArrays, params,
-			"SELECT DISTINCT dependency,type FROM dependencies WHERE build=%Q AND project=%Q",
-			build, project);
-		
-		CFIndex i, count = CFArrayGetCount(projs);
-		for (i = 0; i < count; ++i) {
-			CFStringRef proj = cfstr(CFArrayGetValueAtIndex(projs, i));
-			CFStringRef type = cfstr(CFArrayGetValueAtIndex(types, i));
-			
-			CFMutableArrayRef deparray = (CFMutableArrayRef)CFDictionaryGetValue(dependencies, type);
-			if (deparray == NULL) {
-				deparray = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
-				CFDictionarySetValue(dependencies, type, deparray);
-				CFRelease(deparray); // still retained by dict
-			}
-			if (!CFArrayContainsValue(deparray,
-							CFRangeMake(0, CFArrayGetCount(deparray)),
-							proj)) {
-				CFArrayAppendValue(deparray, proj);
+			"SELECT DISTINCT u.build, u.project, u.type, u.dependency FROM dependencies AS u WHERE %s "
+			"ORDER BY u.build, u.project", scope);
+
+		// rows are grouped by (build, project)
+		CFIndex i, start = 0, count = CFArrayGetCount(projects);
+		for (i = 1; i <= count; ++i) {
+			if (i == count ||
+			    strcmp(CFArrayGetValueAtIndex(builds, i), CFArrayGetValueAtIndex(builds, start)) != 0 ||
+			    strcmp(CFArrayGetValueAtIndex(projects, i), CFArrayGetValueAtIndex(projects, start)) != 0) {
+				commit_project_dependencies(CFArrayGetValueAtIndex(builds, start),
+							    CFArrayGetValueAtIndex(projects, start),
+							    types, deps, start, i);
+				start = i;
 			}
-			CFRelease(proj);
-			CFRelease(type);
 		}
-		
-		DBSetProp(cfstr(build), cfstr(project), CFSTR("dependencies"), dependencies);
-		CFRelease(dependencies);
+
+		CFRelease(builds);
+		CFRelease(projects);
 		CFRelease(types);
-		CFRelease(projs);
+		CFRelease(deps);
 
-		SQL("DELETE FROM dependencies WHERE build=%Q AND project=%Q", build, project);
+		SQL("DELETE FROM dependencies WHERE rowid IN (SELECT u.rowid FROM dependencies AS u WHERE %s)", scope);
 	}
 
-	if (SQL("COMMIT")) { return -1; }
-
-	return 0;
-}
-
-int resolve_dependencies(const char* build, const char* project, int commit) {
-	CFMutableArrayRef builds = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
-	CFMutableArrayRef projects = CFArrayCreateMutable(NULL, 0, &cfArrayCStringCallBacks);
-	int resolvedCount = 0, unresolvedCount = 0;
-	CFMutableArrayRef params[2] = { builds, projects };
-
-	// if committing, use all projects, otherwise use unresolved projects
-	char *table = ( commit ? "properties" : "unresolved_dependencies" );
-
-	//
-	// If no project, version specified, resolve everything.
-	// Otherwise, resolve only that project or version.
-	//
-	if (project == NULL) {
-		SQL_CALLBACK(&addToCStrArrays, params, "SELECT DISTINCT build,project FROM %Q WHERE project IS NOT NULL", table);
-	} else {
-		SQL_CALLBACK(&addToCStrArrays, params, "SELECT DISTINCT build,project FROM %Q WHERE project=%Q", table, project);
-	}
-	CFIndex i, count = CFArrayGetCount(projects);
-	for (i = 0; i < count; ++i) {
-		const char* build = CFArrayGetValueAtIndex(builds, i);
-		const char* project = CFArrayGetValueAtIndex(projects, i);
-		fprintf(stderr, "%s (%s)\n", project, build);
-		resolve_project_dependencies(build, project, &resolvedCount, &unresolvedCount, commit);
-	}
+	if (SQL("COMMIT")) { sqlite3_free(scope); return -1; }
+	sqlite3_free(scope);
 
 	fprintf(stderr, "%d dependencies resolved, %d remaining.\n", resolvedCount, unresolvedCount);
 
-	CFRelease(builds);
-	CFRelease(projects);
-	
 	return 0;
 }
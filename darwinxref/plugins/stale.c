@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2005 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ */
+
+#include "DBPlugin.h"
+#include "DBDataStore.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sqlite3.h"
+
+//
+// Tells whether a project has to be rebuilt because something it read
+// during its last traced build has changed since.  loadDeps records the
+// SHA-1 of every file the build read in input_digests; each of them is
+// compared with the file under the BuildRoot as it is now.
+//
+// A file with the size and mtime it had when it was recorded is taken to
+// be unchanged.  Otherwise its digest comes from file_digests if that
+// matches the file, or is computed and added there.  Files that were
+// only touched are not reported.
+//
+// Prints the inputs that are missing or differ, and exits with 0 if the
+// project is up to date, 1 if it is stale, or 2 on error.  A project
+// without recorded inputs is stale, since nothing is known about it.
+//
+
+struct input {
+	char* path;
+	long long size;
+	long long mtime;
+	char* digest;
+};
+
+struct inputs {
+	struct input* items;
+	size_t count;
+	size_t capacity;
+};
+
+static int addInput(void* pArg, int argc, char **argv, char** columnNames) {
+	struct inputs* in = pArg;
+	if (argv[0] == NULL || argv[3] == NULL) return 0;
+	if (in->count == in->capacity) {
+		size_t capacity = in->capacity ? in->capacity * 2 : 256;
+		struct input* items = realloc(in->items, capacity * sizeof(struct input));
+		if (items == NULL) return 1;
+		in->items = items;
+		in->capacity = capacity;
+	}
+	struct input* i = &in->items[in->count];
+	i->path = strdup(argv[0]);
+	i->size = argv[1] ? strtoll(argv[1], NULL, 10) : -1;
+	i->mtime = argv[2] ? strtoll(argv[2], NULL, 10) : -1;
+	i->digest = strdup(argv[3]);
+	if (i->path == NULL || i->digest == NULL) {
+		free(i->path);
+		free(i->digest);
+		return 1;
+	}
+	++in->count;
+	return 0;
+}
+
+// The current digest of a file that isn't known to be unchanged.
+static char* current_digest(const char* build, int rootfd, const char* relpath, const char* path, const struct stat* sb) {
+	char* digest = SQL_STRING("SELECT digest FROM file_digests WHERE build=%Q AND path=%Q AND size=%lld AND mtime=%lld",
+		build, path, (long long)sb->st_size, (long long)sb->st_mtime);
+	if (digest) return digest;
+
+	int fd = openat(rootfd, relpath, O_RDONLY);
+	if (fd == -1) return NULL;
+	digest = calculate_digest(fd);
+	close(fd);
+	if (digest) {
+		SQL("INSERT OR REPLACE INTO file_digests (build,path,size,mtime,digest) VALUES (%Q,%Q,%lld,%lld,%Q)",
+			build, path, (long long)sb->st_size, (long long)sb->st_mtime, digest);
+	}
+	return digest;
+}
+
+// Returns 0 if the input is unchanged, 1 if it is not, or -1 on error.
+static int check_input(const char* build, int rootfd, struct input* i) {
+	struct stat sb;
+	// paths are absolute within the buildroot, like the trace
+	const char* relpath = i->path;
+	while (*relpath == '/') ++relpath;
+
+	if (fstatat(rootfd, relpath, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+		if (errno != ENOENT && errno != ENOTDIR) {
+			fprintf(stderr, "Error: %s: %s\n", i->path, strerror(errno));
+			return -1;
+		}
+		fprintf(stdout, "missing\t%s\n", i->path);
+		return 1;
+	}
+	if (!S_ISREG(sb.st_mode) || (long long)sb.st_size != i->size) {
+		fprintf(stdout, "changed\t%s\n", i->path);
+		return 1;
+	}
+	if ((long long)sb.st_mtime == i->mtime) return 0;
+
+	char* digest = current_digest(build, rootfd, relpath, i->path, &sb);
+	if (digest == NULL) {
+		fprintf(stderr, "Error: %s: %s\n", i->path, strerror(errno));
+		return -1;
+	}
+	int res = (strcmp(digest, i->digest) != 0);
+	if (res) fprintf(stdout, "changed\t%s\n", i->path);
+	free(digest);
+	return res;
+}
+
+static int stale(const char* build, const char* project, const char* root) {
+	struct inputs inputs;
+	size_t i;
+	int res = 0, changed = 0, began = 0;
+	memset(&inputs, 0, sizeof(inputs));
+
+	int rootfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (rootfd == -1) {
+		fprintf(stderr, "Error: %s: %s\n", root, strerror(errno));
+		return 2;
+	}
+
+	if (SQL_CALLBACK(&addInput, &inputs,
+		"SELECT path, size, mtime, digest FROM input_digests WHERE build=%Q AND project=%Q ORDER BY path",
+		build, project)) {
+		res = 2;
+	} else if (inputs.count == 0) {
+		fprintf(stderr, "%s: no inputs recorded, build it with -logdeps\n", project);
+		res = 1;
+	}
+
+	// newly computed digests are cached in one go
+	if (res == 0) {
+		if (SQL("BEGIN")) res = 2;
+		else began = 1;
+	}
+	for (i = 0; res == 0 && i < inputs.count; ++i) {
+		int c = check_input(build, rootfd, &inputs.items[i]);
+		if (c < 0) res = 2;
+		if (c > 0) ++changed;
+	}
+	if (res == 0) {
+		SQL("COMMIT");
+		fprintf(stderr, "%s: %zu of %zu inputs changed\n", project, (size_t)changed, inputs.count);
+		if (changed > 0) res = 1;
+	} else if (began) {
+		SQL("ROLLBACK");
+	}
+
+	for (i = 0; i < inputs.count; ++i) {
+		free(inputs.items[i].path);
+		free(inputs.items[i].digest);
+	}
+	free(inputs.items);
+	close(rootfd);
+	return res;
+}
+
+static int run(CFArrayRef argv) {
+	CFIndex count = CFArrayGetCount(argv);
+	if (count != 1 && count != 2) return -1;
+
+	char* build = strdup_cfstr(DBGetCurrentBuild());
+	char* project = strdup_cfstr(CFArrayGetValueAtIndex(argv, 0));
+	char* root = (count == 2) ? strdup_cfstr(CFArrayGetValueAtIndex(argv, 1)) : strdup("BuildRoot");
+	int res = stale(build, project, root);
+	free(build);
+	free(project);
+	free(root);
+	return res;
+}
+
+static CFStringRef usage() {
+	return CFRetain(CFSTR("<project> [<buildroot>]"));
+}
+
+int initialize(int version) {
+	//if ( version < kDBPluginCurrentVersion ) return -1;
+	
+	DBPluginSetType(kDBPluginBasicType);
+	DBPluginSetName(CFSTR("stale"));
+	DBPluginSetRunFunc(&run);
+	DBPluginSetUsageFunc(&usage);
+	return 0;
+}
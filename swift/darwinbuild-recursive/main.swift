@@ -55,48 +55,356 @@ fileprivate func splitLines(_ input: String) -> [String] {
 	return retval
 }
 
-fileprivate struct RecursiveBuildContext {
-	fileprivate var completedDependencies = Set<String>()
-	fileprivate var completedHeaderDependencies = Set<String>()
-
-	fileprivate mutating func buildProject(projectName: String, isHeaderDependency: Bool = false) {
-		if isHeaderDependency {
-			if completedHeaderDependencies.contains(projectName) {
-				return
-			} else {
-				completedHeaderDependencies.insert(projectName)
+fileprivate struct BuildNode: Hashable {
+	let projectName: String
+	let isHeaderDependency: Bool
+
+	var arguments: [String] {
+		return isHeaderDependency ? ["-headers", projectName] : [projectName]
+	}
+
+	var label: String {
+		return isHeaderDependency ? "\(projectName) -headers" : projectName
+	}
+}
+
+/// The build and header dependency closures of every project in the current
+/// build, as reported by a single `darwinxref closure -edges` query.
+fileprivate struct DependencyEdges {
+	private var buildDependencies: [String: [String]] = [:]
+	private var headerDependencies: [String: [String]] = [:]
+
+	init() {
+		let output = readProcessOutput(commandName: "/usr/local/bin/darwinxref", arguments: ["closure", "-edges"])
+		for line in splitLines(output) {
+			let fields = line.components(separatedBy: "\t")
+			if fields.count != 3 {
+				continue
 			}
-		} else {
-			if completedDependencies.contains(projectName) {
-				return
-			} else {
-				completedDependencies.insert(projectName)
+
+			if fields[0] == "build" {
+				buildDependencies[fields[1], default: []].append(fields[2])
+			} else if fields[0] == "header" {
+				headerDependencies[fields[1], default: []].append(fields[2])
 			}
 		}
+	}
 
-		let buildDependencies = splitLines(readProcessOutput(commandName: "/usr/local/bin/darwinxref", arguments: ["dependencies", "-build", projectName]))
-		let headerDependencies = splitLines(readProcessOutput(commandName: "/usr/local/bin/darwinxref", arguments: ["dependencies", "-header", projectName]))
+	func build(_ projectName: String) -> [String] {
+		return buildDependencies[projectName] ?? []
+	}
 
-		for dep in headerDependencies {
-			buildProject(projectName: dep, isHeaderDependency: true)
+	func header(_ projectName: String) -> [String] {
+		return headerDependencies[projectName] ?? []
+	}
+}
+
+/// How long each project took to build the last time it succeeded, as
+/// recorded by darwinbuild in `darwinxref buildstats`. Builds without any
+/// history are assumed to take as long as the median build, or one second
+/// if nothing has been recorded yet.
+fileprivate struct BuildDurations {
+	private var durations: [BuildNode: Int] = [:]
+	private var median = 1
+
+	init() {
+		let output = readProcessOutput(commandName: "/usr/local/bin/darwinxref", arguments: ["buildstats", "-durations"])
+		for line in splitLines(output) {
+			let fields = line.components(separatedBy: "\t")
+			if fields.count != 3 {
+				continue
+			}
+
+			if let seconds = Int(fields[2]) {
+				let node = BuildNode(projectName: fields[1], isHeaderDependency: fields[0] == "installhdrs")
+				durations[node] = max(seconds, 1)
+			}
 		}
-		for dep in buildDependencies {
-			buildProject(projectName: dep, isHeaderDependency: false)
+
+		let sorted = durations.values.sorted()
+		if !sorted.isEmpty {
+			median = sorted[sorted.count / 2]
 		}
+	}
+
+	func seconds(for node: BuildNode) -> Int {
+		return durations[node] ?? median
+	}
+}
+
+/// The set of darwinbuild invocations needed to build the requested projects,
+/// with an edge from every node to each node that must finish before it starts.
+fileprivate struct BuildGraph {
+	private(set) var nodes: [BuildNode] = []
+	private(set) var dependencies: [[Int]] = []
+	private(set) var dependents: [[Int]] = []
+	private var indexes: [BuildNode: Int] = [:]
+	private let edges = DependencyEdges()
 
-		let task = Task(executable: "/usr/local/bin/darwinbuild", arguments: isHeaderDependency ? ["-headers", projectName] : [projectName], stdout: WriteStream.stdout, stderr: WriteStream.stderr)
-		let exitCode = task.runSync()
-		if exitCode != 0 {
-			print("darwinbuild \(isHeaderDependency ? "-headers " : "")\(projectName) failed with code \(exitCode)", to: &standardError)
-			exit(1)
+	/// Nodes are numbered in the order the old depth-first builder would have
+	/// run them. A dependency on a node that is still being visited closes a
+	/// cycle; like the depth-first builder, that edge is dropped.
+	mutating func addProject(_ projectName: String) {
+		_ = visit(BuildNode(projectName: projectName, isHeaderDependency: false))
+	}
+
+	/// Returns the index of the node, or -1 if it is still being visited.
+	private mutating func visit(_ node: BuildNode) -> Int {
+		if let index = indexes[node] {
+			return index
+		}
+		indexes[node] = -1
+
+		var nodeDependencies: [Int] = []
+		for dep in edges.header(node.projectName) {
+			let index = visit(BuildNode(projectName: dep, isHeaderDependency: true))
+			if index >= 0 {
+				nodeDependencies.append(index)
+			}
 		}
+		for dep in edges.build(node.projectName) {
+			let index = visit(BuildNode(projectName: dep, isHeaderDependency: false))
+			if index >= 0 {
+				nodeDependencies.append(index)
+			}
+		}
+
+		let index = nodes.count
+		nodes.append(node)
+		dependencies.append(Array(Set(nodeDependencies)).sorted())
+		dependents.append([])
+		for dep in dependencies[index] {
+			dependents[dep].append(index)
+		}
+		indexes[node] = index
+		return index
+	}
+
+	/// The time taken by the longest chain of jobs that cannot start before
+	/// each node finishes, counting the node itself.
+	func criticalPaths(durations: BuildDurations) -> [Int] {
+		let weights = nodes.map { durations.seconds(for: $0) }
+		var lengths = weights
+		for index in nodes.indices.reversed() {
+			for dependent in dependents[index] {
+				lengths[index] = max(lengths[index], lengths[dependent] + weights[index])
+			}
+		}
+		return lengths
 	}
 }
 
+/// Copies the combined output of one darwinbuild job into its log file and,
+/// prefixed with the project name, onto our standard output.
+fileprivate final class JobOutput {
+	private static let outputLock = NSLock()
+
+	private let prefix: Data
+	private let logFile: FileHandle?
+	private var partialLine = Data()
+
+	init(node: BuildNode, logPath: String, prefixLines: Bool) {
+		prefix = prefixLines ? "[\(node.label)] ".data(using: .utf8)! : Data()
+		FileManager.default.createFile(atPath: logPath, contents: nil)
+		logFile = FileHandle(forWritingAtPath: logPath)
+	}
+
+	func append(_ data: Data) {
+		logFile?.write(data)
+
+		partialLine.append(data)
+		var lines = Data()
+		while let newline = partialLine.firstIndex(of: UInt8(ascii: "\n")) {
+			lines.append(prefix)
+			lines.append(partialLine[partialLine.startIndex...newline])
+			partialLine.removeSubrange(partialLine.startIndex...newline)
+		}
+		write(lines)
+	}
+
+	func close() {
+		if !partialLine.isEmpty {
+			partialLine.append(UInt8(ascii: "\n"))
+			write(prefix + partialLine)
+			partialLine.removeAll()
+		}
+		logFile?.closeFile()
+	}
+
+	private func write(_ data: Data) {
+		if data.isEmpty {
+			return
+		}
+		JobOutput.outputLock.lock()
+		FileHandle.standardOutput.write(data)
+		JobOutput.outputLock.unlock()
+	}
+}
+
+/// Runs the nodes of a BuildGraph with up to `jobCount` darwinbuild processes
+/// at once. Of the nodes whose dependencies have all finished, the one with
+/// the longest critical path is started first.
+fileprivate final class BuildScheduler {
+	private let graph: BuildGraph
+	private let jobCount: Int
+	private let keepGoing: Bool
+	private let logDirectory: String
+	private let criticalPaths: [Int]
+
+	private var pendingDependencies: [Int]
+	private var ready: [Int] = []
+	private var running = 0
+	private var succeeded = 0
+	private var failed: [(BuildNode, Int32)] = []
+
+	private let completionLock = NSLock()
+	private let completionSignal = DispatchSemaphore(value: 0)
+	private var completions: [(Int, Int32)] = []
+
+	init(graph: BuildGraph, jobCount: Int, keepGoing: Bool, logDirectory: String) {
+		self.graph = graph
+		self.jobCount = jobCount
+		self.keepGoing = keepGoing
+		self.logDirectory = logDirectory
+		criticalPaths = graph.criticalPaths(durations: BuildDurations())
+		pendingDependencies = graph.dependencies.map { $0.count }
+	}
+
+	func run() -> Bool {
+		ready = graph.nodes.indices.filter { pendingDependencies[$0] == 0 }
+
+		while true {
+			while running < jobCount && !ready.isEmpty && (failed.isEmpty || keepGoing) {
+				start(takeReadyNode())
+			}
+			if running == 0 {
+				break
+			}
+
+			completionSignal.wait()
+			completionLock.lock()
+			let finished = completions
+			completions.removeAll()
+			completionLock.unlock()
+
+			for (index, exitCode) in finished {
+				running -= 1
+				if exitCode != 0 {
+					print("darwinbuild \(graph.nodes[index].arguments.joined(separator: " ")) failed with code \(exitCode)", to: &standardError)
+					failed.append((graph.nodes[index], exitCode))
+					continue
+				}
+
+				succeeded += 1
+				for dependent in graph.dependents[index] {
+					pendingDependencies[dependent] -= 1
+					if pendingDependencies[dependent] == 0 {
+						ready.append(dependent)
+					}
+				}
+			}
+		}
+
+		if failed.isEmpty {
+			return true
+		}
+
+		let notBuilt = graph.nodes.count - succeeded - failed.count
+		print("\(failed.count) of \(graph.nodes.count) builds failed; \(notBuilt) not attempted", to: &standardError)
+		for (node, exitCode) in failed {
+			print("\t\(node.label) (exit code \(exitCode))", to: &standardError)
+		}
+		return false
+	}
+
+	private func takeReadyNode() -> Int {
+		// Ties go to the lower index, which is the depth-first build order.
+		var best = 0
+		for i in 1..<ready.count {
+			let (a, b) = (ready[i], ready[best])
+			if criticalPaths[a] > criticalPaths[b] || (criticalPaths[a] == criticalPaths[b] && a < b) {
+				best = i
+			}
+		}
+		return ready.remove(at: best)
+	}
+
+	private func start(_ index: Int) {
+		let node = graph.nodes[index]
+		let logName = node.isHeaderDependency ? "\(node.projectName).headers.log" : "\(node.projectName).log"
+		let output = JobOutput(node: node, logPath: joinPath(logDirectory, logName), prefixLines: jobCount > 1)
+
+		let pipe = Pipe()
+		let process = Process()
+		process.launchPath = "/usr/local/bin/darwinbuild"
+		process.arguments = node.arguments
+		process.standardOutput = pipe
+		process.standardError = pipe
+
+		// The job is complete once the process has exited and its output has
+		// been drained, whichever happens last.
+		let group = DispatchGroup()
+		group.enter()
+		group.enter()
+		pipe.fileHandleForReading.readabilityHandler = {
+			handle in
+			let data = handle.availableData
+			if data.isEmpty {
+				handle.readabilityHandler = nil
+				output.close()
+				group.leave()
+			} else {
+				output.append(data)
+			}
+		}
+		process.terminationHandler = {
+			_ in
+			group.leave()
+		}
+		group.notify(queue: DispatchQueue.global()) {
+			self.completionLock.lock()
+			self.completions.append((index, process.terminationStatus))
+			self.completionLock.unlock()
+			self.completionSignal.signal()
+		}
+
+		print("*** Starting darwinbuild \(node.arguments.joined(separator: " "))")
+		fflush(stdout)
+		process.launch()
+		// Our copy of the write end must be closed for the reader to see EOF.
+		pipe.fileHandleForWriting.closeFile()
+		running += 1
+	}
+}
+
+fileprivate func printUsage() -> Never {
+	print("Internal tool used by darwinbuild, please do not invoke directly", to: &standardError)
+	print("usage: darwinbuild-recursive [-j <jobs>] [-k] -g <group> | -p <project>...", to: &standardError)
+	exit(1)
+}
+
 func main() {
-	if CommandLine.arguments.count < 3 {
-		print("Internal tool used by darwinbuild, please do not invoke directly", to: &standardError)
-		exit(1)
+	var jobCount = 1
+	var keepGoing = false
+	var argumentIndex = 1
+	while argumentIndex < CommandLine.arguments.count {
+		let argument = CommandLine.arguments[argumentIndex]
+		if argument == "-j" && argumentIndex + 1 < CommandLine.arguments.count {
+			guard let value = Int(CommandLine.arguments[argumentIndex + 1]), value > 0 else {
+				print("ERROR: -j requires a positive number of jobs", to: &standardError)
+				exit(1)
+			}
+			jobCount = value
+			argumentIndex += 2
+		} else if argument == "-k" {
+			keepGoing = true
+			argumentIndex += 1
+		} else {
+			break
+		}
+	}
+	if CommandLine.arguments.count < argumentIndex + 2 {
+		printUsage()
 	}
 
 	let fm = FileManager()
@@ -116,22 +424,43 @@ func main() {
 	}
 	CommandLine.workingDirectory = buildroot
 
-	var context = RecursiveBuildContext()
-	if CommandLine.arguments[1] == "-g" {
-		let groupOutput = splitLines(readProcessOutput(commandName: "darwinxref", arguments: ["group", CommandLine.arguments[2]]))
+	// Concurrent darwinbuilds must not install into the shared BuildRoot,
+	// so give each a layer of its own.
+	if jobCount > 1 {
+		CommandLine.Environment["DARWINBUILD_ISOLATED"] = "YES"
+	}
+
+	var graph = BuildGraph()
+	let mode = CommandLine.arguments[argumentIndex]
+	let operands = CommandLine.arguments[(argumentIndex + 1)...]
+	if mode == "-g" {
+		let groupOutput = splitLines(readProcessOutput(commandName: "darwinxref", arguments: ["group", operands.first!]))
 		for line in groupOutput {
 			for word in line.components(separatedBy: NSCharacterSet.whitespaces) {
 				if word != "" {
-					context.buildProject(projectName: word)
+					graph.addProject(word)
 				}
 			}
 		}
-	} else if CommandLine.arguments[1] == "-p" {
-		for projectName in CommandLine.arguments[2...] {
-			context.buildProject(projectName: projectName)
+	} else if mode == "-p" {
+		for projectName in operands {
+			graph.addProject(projectName)
 		}
 	} else {
-		print("ERROR: First argument must be either -g or -p", to: &standardError)
+		print("ERROR: Expected either -g or -p after the options", to: &standardError)
+		exit(1)
+	}
+
+	let logDirectory = joinPath(buildroot, "Logs", "darwinbuild-recursive")
+	do {
+		try fm.createDirectory(atPath: logDirectory, withIntermediateDirectories: true, attributes: nil)
+	} catch {
+		print("ERROR: Could not create \(logDirectory): \(error)", to: &standardError)
+		exit(1)
+	}
+
+	let scheduler = BuildScheduler(graph: graph, jobCount: jobCount, keepGoing: keepGoing, logDirectory: logDirectory)
+	if !scheduler.run() {
 		exit(1)
 	}
 }
@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Measure the overhead of darwintrace: run the same workload untraced,
+# traced with DARWINTRACE_UNBUFFERED, and traced with the default
+# per-thread buffers, and report the best wall-clock time of each.
+#
+# usage: benchmark.sh [<iterations>]
+#
+ITERATIONS=${1:-3}
+PREFIX=/tmp/testing/darwintrace-benchmark
+DARWINTRACE="/usr/local/share/darwinbuild/darwintrace.dylib"
+HEADERS=$(ls /usr/include/*.h | head -200)
+
+rm -rf $PREFIX
+mkdir -p $PREFIX
+
+# many short-lived processes, each opening many headers
+function workload() {
+	for H in $HEADERS; do
+		cc -E "$H" > /dev/null 2>&1
+	done
+	find /usr/include -type f -exec cat {} + > /dev/null
+}
+
+function measure() {
+	local best=""
+	local i
+	for ((i = 0; i < ITERATIONS; i++)); do
+		rm -f $PREFIX/trace.log
+		local start=$(perl -MTime::HiRes=time -e 'printf "%.3f", time')
+		"$@" workload
+		local end=$(perl -MTime::HiRes=time -e 'printf "%.3f", time')
+		local elapsed=$(echo "$end - $start" | bc)
+		if [ -z "$best" ] || [ $(echo "$elapsed < $best" | bc) -eq 1 ]; then
+			best=$elapsed
+		fi
+	done
+	echo $best
+}
+
+function untraced() {
+	"$@"
+}
+
+function traced() {
+	DYLD_INSERT_LIBRARIES=$DARWINTRACE DARWINTRACE_LOG=$PREFIX/trace.log "$@"
+}
+
+function traced_unbuffered() {
+	DARWINTRACE_UNBUFFERED=1 traced "$@"
+}
+
+BASE=$(measure untraced)
+UNBUFFERED=$(measure traced_unbuffered)
+BUFFERED=$(measure traced)
+RECORDS=$(wc -l < $PREFIX/trace.log)
+
+echo "records per run:     $RECORDS"
+printf "untraced:            %8.3fs\n" $BASE
+printf "traced, unbuffered:  %8.3fs  (+%.1f%%)\n" $UNBUFFERED $(echo "($UNBUFFERED - $BASE) * 100 / $BASE" | bc -l)
+printf "traced:              %8.3fs  (+%.1f%%)\n" $BUFFERED $(echo "($BUFFERED - $BASE) * 100 / $BASE" | bc -l)
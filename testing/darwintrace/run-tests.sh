@@ -11,10 +11,6 @@ LOGS=$PREFIX/logs
 ROOT=$PREFIX/root
 BIN=$PREFIX/bin
 
-DARWINTRACE="/usr/local/share/darwinbuild/darwintrace.dylib"
-export DYLD_INSERT_LIBRARIES=$DARWINTRACE
-export DARWINTRACE_LOG="${LOGS}/trace.log"
-
 echo "INFO: Cleaning up testing area ..."
 rm -rf $PREFIX
 mkdir -p $PREFIX
@@ -22,6 +18,49 @@ mkdir -p $ROOT
 mkdir -p $LOGS
 mkdir -p $BIN
 
+if [ "$(uname)" == "Darwin" ]; then
+	DARWINTRACE="/usr/local/share/darwinbuild/darwintrace.dylib"
+	DUMP="/usr/local/share/darwinbuild/darwintrace-dump"
+	PROFILE="/usr/local/share/darwinbuild/darwintrace-profile"
+	PRELOAD=DYLD_INSERT_LIBRARIES
+else
+	# nothing is installed on Linux, build from this tree
+	echo "INFO: Building darwintrace ..."
+	DARWINTRACE=$PREFIX/darwintrace.so
+	DUMP=$BIN/darwintrace-dump
+	PROFILE=$BIN/darwintrace-profile
+	${CC:-cc} -shared -fPIC -o $DARWINTRACE ../../darwintrace/darwintrace.c -ldl -lpthread
+	${CC:-cc} -o $DUMP ../../darwintrace/darwintrace-dump.c
+	${CC:-cc} -o $PROFILE ../../darwintrace/darwintrace-profile.c
+	PRELOAD=LD_PRELOAD
+fi
+
+# files and links to trace, and the files under a root to be ignored
+if [ "$(uname)" == "Darwin" ]; then
+	OPENFILES=$(ls /System/Library/LaunchDaemons/*.plist)
+	LINKS=$(find /System/Library/Frameworks/*Foundation.framework -type l | xargs)
+	LOGFILES=$(ls /var/log/*.log)
+	IGNOREDROOT=/System/Library/LaunchAgents
+	IGNOREDFILES=$(ls /System/Library/LaunchAgents/com.apple.*)
+else
+	mkdir -p $PREFIX/files $PREFIX/links $PREFIX/logfiles $PREFIX/ignored
+	for I in $(seq 1 20);
+	do
+		echo $I > $PREFIX/files/file$I
+		ln -s file$I $PREFIX/links/link$I
+		echo $I > $PREFIX/logfiles/file$I.log
+		echo $I > $PREFIX/ignored/file$I
+	done
+	OPENFILES=$(ls $PREFIX/files/*)
+	LINKS=$(ls $PREFIX/links/*)
+	LOGFILES=$(ls $PREFIX/logfiles/*.log)
+	IGNOREDROOT=$PREFIX/ignored
+	IGNOREDFILES=$(ls $PREFIX/ignored/*)
+fi
+
+export $PRELOAD=$DARWINTRACE
+export DARWINTRACE_LOG="${LOGS}/trace.log"
+
 REALPATH=$BIN/realpath
 cp realpath $REALPATH
 
@@ -34,6 +73,12 @@ cp close-test $CLOSETEST
 REDIRECTIONTEST=$BIN/redirection-test
 cp redirection-test $REDIRECTIONTEST
 
+THREADTEST=$BIN/thread-test
+cp thread-test $THREADTEST
+
+EXITTEST=$BIN/exit-test
+cp exit-test $EXITTEST
+
 
 echo "========== TEST: execve() Trace =========="
 for FILE in cp echo chmod  date df expr hostname ls ps pwd test;
@@ -43,7 +88,9 @@ do
 	set +e	
 	$EXEC /bin/$FILE 2>&1 >> /dev/null
 	set -e
-	LOGPAT="[Pp]ython\[[0-9]+\][[:space:]]execve[[:space:]]/bin/${FILE}"
+	# /bin may be a link to /usr/bin
+	RP=$($REALPATH /bin/$FILE)
+	LOGPAT="[Pp]ython[0-9.]*\[[0-9]+\][[:space:]]execve[[:space:]]${RP}\$"
 	C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
   test $C -eq 1
 done
@@ -55,7 +102,7 @@ $CLOSETEST
 
 
 echo "========== TEST: open() Trace =========="
-for FILE in /System/Library/LaunchDaemons/*.plist;
+for FILE in $OPENFILES;
 do
 	cat $FILE >> /dev/null;
 	RP=$($REALPATH $FILE);
@@ -66,7 +113,7 @@ done
 
 
 echo "========== TEST: readlink() Trace =========="
-for FILE in $(find /System/Library/Frameworks/*Foundation.framework -type l | xargs);
+for FILE in $LINKS;
 do
 	readlink $FILE
 	LOGPAT="readlink\[[0-9]+\][[:space:]]readlink[[:space:]]${FILE}"
@@ -77,8 +124,8 @@ done
 
 echo "========== TEST: ROOT Ignores =========="
 export DARWINTRACE_IGNORE_ROOTS=""
-export DSTROOT="/System/Library/LaunchAgents"
-for FILE in /var/log/*.log;
+export DSTROOT="$IGNOREDROOT"
+for FILE in $LOGFILES;
 do
 	cat $FILE >> /dev/null;
 	RP=$($REALPATH $FILE);
@@ -87,7 +134,7 @@ do
   test $C -eq 1
 done
 
-for FILE in /System/Library/LaunchAgents/com.apple.*;
+for FILE in $IGNOREDFILES;
 do
 	cat $FILE >> /dev/null;
 	RP=$($REALPATH $FILE);
@@ -101,10 +148,130 @@ unset DARWINTRACE_IGNORE_ROOTS
 unset DSTROOT
 
 
+echo "========== TEST: Buffered Threads and exec() =========="
+mkdir -p $PREFIX/threads
+FILES=""
+for I in $(seq 1 400);
+do
+	echo $I > $PREFIX/threads/file$I
+	FILES="$FILES $PREFIX/threads/file$I"
+done
+$THREADTEST $FILES
+RP=$($REALPATH $PREFIX/threads)
+LOGPAT="\[[0-9]+\][[:space:]]open[[:space:]]${RP}/file[0-9]+\$"
+C=$(grep -E $LOGPAT $DARWINTRACE_LOG | sort -u | wc -l)
+test $C -eq 400
+# every record is a whole line
+set +e
+C=$(grep -cvE "^[^[:space:]]+\[[0-9]+\][[:space:]][a-z]+[[:space:]]/" $DARWINTRACE_LOG)
+set -e
+test $C -eq 0
+
+# _exit(2) skips the destructors
+echo "data" > $PREFIX/exitfile
+$EXITTEST $PREFIX/exitfile
+RP=$($REALPATH $PREFIX/exitfile)
+LOGPAT="\[[0-9]+\][[:space:]]open[[:space:]]${RP}\$"
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+test $C -eq 1
+
+
+echo "========== TEST: Duplicate Suppression =========="
+echo "data" > $PREFIX/dupfile
+cat $PREFIX/dupfile $PREFIX/dupfile $PREFIX/dupfile >> /dev/null
+RP=$($REALPATH $PREFIX/dupfile)
+LOGPAT="cat\[[0-9]+\][[:space:]]open[[:space:]]${RP}\$"
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+test $C -eq 1
+DARWINTRACE_LOG_ALL=1 cat $PREFIX/dupfile $PREFIX/dupfile $PREFIX/dupfile >> /dev/null
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+test $C -eq 4
+
+
+echo "========== TEST: Probes =========="
+mkdir -p $PREFIX/probes
+echo "data" > $PREFIX/probes/probefile
+# not logged unless asked for
+stat $PREFIX/probes/probefile >> /dev/null
+LOGPAT="stat\[[0-9]+\][[:space:]]stat[[:space:]]$PREFIX/probes/probefile\$"
+set +e
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+set -e
+test $C -eq 0
+export DARWINTRACE_PROBES=1
+stat $PREFIX/probes/probefile >> /dev/null
+ls $PREFIX/probes >> /dev/null
+bash -c "test -r $PREFIX/probes/probefile"
+unset DARWINTRACE_PROBES
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+test $C -eq 1
+LOGPAT="ls\[[0-9]+\][[:space:]]opendir[[:space:]]$PREFIX/probes\$"
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+test $C -eq 1
+LOGPAT="bash\[[0-9]+\][[:space:]]access[[:space:]]$PREFIX/probes/probefile\$"
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+test $C -eq 1
+
+
+echo "========== TEST: Binary Format =========="
+echo "data" > $PREFIX/binfile
+DARWINTRACE_LOG=$LOGS/trace.bin DARWINTRACE_BINARY=1 \
+	cat $PREFIX/binfile $PREFIX/binfile >> /dev/null
+DARWINTRACE_LOG=$LOGS/trace.bin $EXEC /bin/echo >> /dev/null
+test "$(head -c 4 $LOGS/trace.bin)" = "DTRB"
+$DUMP $LOGS/trace.bin > $LOGS/trace.bin.txt
+RP=$($REALPATH $PREFIX/binfile)
+LOGPAT="cat\[[0-9]+\][[:space:]]open[[:space:]]${RP}\$"
+C=$(grep -cE $LOGPAT $LOGS/trace.bin.txt)
+test $C -eq 1
+RP=$($REALPATH /bin/echo)
+LOGPAT="[Pp]ython[0-9.]*\[[0-9]+\][[:space:]]execve[[:space:]]${RP}\$"
+C=$(grep -cE $LOGPAT $LOGS/trace.bin.txt)
+test $C -eq 1
+# text logs pass through unchanged, copied since the tools are traced too
+cp $DARWINTRACE_LOG $LOGS/trace.txt
+$DUMP $LOGS/trace.txt | cmp - $LOGS/trace.txt
+
+
+echo "========== TEST: Profile =========="
+# in a log of its own, process records have more fields
+DARWINTRACE_LOG=$LOGS/profile.txt DARWINTRACE_PROFILE=1 \
+	bash -c "sleep 1; (exit 3); bash -c 'exit 5'; true"
+LOGPAT="sleep\[[0-9]+\][[:space:]]start[[:space:]][0-9]+[[:space:]][0-9]+[[:space:]]/"
+C=$(grep -cE $LOGPAT $LOGS/profile.txt)
+test $C -eq 1
+LOGPAT="bash\[[0-9]+\][[:space:]]exit[[:space:]][0-9]+[[:space:]][0-9]+[[:space:]]5\$"
+C=$(grep -cE $LOGPAT $LOGS/profile.txt)
+test $C -eq 1
+# _exit(2) writes the exit record and flushes what was buffered before it
+DARWINTRACE_LOG=$LOGS/profile.txt DARWINTRACE_PROFILE=1 $EXITTEST $PREFIX/exitfile
+RP=$($REALPATH $PREFIX/exitfile)
+grep -E "\[[0-9]+\][[:space:]](open|exit)[[:space:]]" $LOGS/profile.txt | grep -A1 -E "open[[:space:]]${RP}\$" | \
+	grep -qE "\[[0-9]+\][[:space:]]exit[[:space:]][0-9]+[[:space:]][0-9]+[[:space:]]0\$"
+# children are profiled even when the environment isn't passed on
+DARWINTRACE_LOG=$LOGS/profile-env.txt DARWINTRACE_PROFILE=1 \
+	bash -c "unset DARWINTRACE_PROFILE; sleep 0"
+LOGPAT="sleep\[[0-9]+\][[:space:]]start[[:space:]][0-9]+[[:space:]][0-9]+[[:space:]]/"
+C=$(grep -cE $LOGPAT $LOGS/profile-env.txt)
+test $C -eq 1
+$PROFILE -t $LOGS/profile.txt > $LOGS/profile.out
+# the outer bash includes the sleep, but doesn't own its time
+grep -qE "^ +[1-9][0-9]*\.[0-9]+ +0\.[0-9]+ +[0-9]+  bash\$" $LOGS/profile.out
+grep -qE "^ +[1-9][0-9]*\.[0-9]+ +[1-9][0-9]*\.[0-9]+ +1  sleep\$" $LOGS/profile.out
+grep -qE "^  sleep\[[0-9]+\]" $LOGS/profile.out
+# the same from a binary log
+DARWINTRACE_LOG=$LOGS/profile.bin DARWINTRACE_BINARY=1 DARWINTRACE_PROFILE=1 \
+	bash -c "sleep 1; true"
+$PROFILE $LOGS/profile.bin > $LOGS/profile.bin.out
+grep -qE "^ +[1-9][0-9]*\.[0-9]+ +[1-9][0-9]*\.[0-9]+ +1  sleep\$" $LOGS/profile.bin.out
+
+
 echo "========== TEST: Redirection =========="
 mkdir -p $ROOT/$PREFIX
-mkdir -p $ROOT/usr/lib
-cp /usr/lib/libSystem.B.dylib $ROOT/usr/lib/libSystem.B.dylib
+if [ "$(uname)" == "Darwin" ]; then
+	mkdir -p $ROOT/usr/lib
+	cp /usr/lib/libSystem.B.dylib $ROOT/usr/lib/libSystem.B.dylib
+fi
 mkdir -p $ROOT/bin
 cp /bin/cat $ROOT/bin/cat
 echo "Outside of root" > $PREFIX/datafile
@@ -125,6 +292,18 @@ RP=$($REALPATH ${PREFIX}/datafile)
 LOGPAT="cat\[[0-9]+\][[:space:]]open[[:space:]]${RP}"
 C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
 test $C -eq 1
+# test that DARWINTRACE_EXCEPTIONS adds to the exceptions
+export DARWINTRACE_REDIRECT="${ROOT}"
+export DARWIN_BUILDROOT="${ROOT}"
+export DARWINTRACE_EXCEPTIONS="/nonexistent/:/bin/"
+$REDIRECTIONTEST $PREFIX
+unset DARWINTRACE_REDIRECT
+unset DARWIN_BUILDROOT
+unset DARWINTRACE_EXCEPTIONS
+RP=$($REALPATH /bin/cat)
+LOGPAT="bash\[[0-9]+\][[:space:]]execve[[:space:]]${RP}\$"
+C=$(grep -cE $LOGPAT $DARWINTRACE_LOG)
+test $C -eq 1
 
 popd >> /dev/null
 echo "INFO: Done testing!"